@@ -0,0 +1,927 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+#include "bsdf.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "integrator.h"
+#include "kernels.h"
+#include "lights.h"
+#include "rng.h"
+#include "thread_pool.h"
+
+namespace {
+	using Clock = std::chrono::high_resolution_clock;
+
+	double secondsSince( Clock::time_point start )
+	{
+		return std::chrono::duration<double>( Clock::now() - start ).count();
+	}
+
+	// Лучи из камеры в случайные точки бокса геометрии, чтобы заметная часть тестов попадала
+	std::vector<Ray> makeRays( const Scene& scene, const AABB& bounds, int count )
+	{
+		std::vector<Ray> rays( count );
+		Rng rng( 0, 0 );
+		const Vector3 extent = bounds.max - bounds.min;
+		for ( auto& r : rays )
+		{
+			const Vector3 target = bounds.min + Vector3( rng.nextFloat() * extent.x(), rng.nextFloat() * extent.y(), rng.nextFloat() * extent.z() );
+			r.origin = scene.camera().pos;
+			r.direction = unit_vector( target - r.origin );
+		}
+		return rays;
+	}
+
+	int benchTriangles( const Options& options, const Scene& scene )
+	{
+		std::vector<Triangle> triangles( scene.triangleCount() );
+		for ( size_t i = 0; i < triangles.size(); ++i )
+			triangles[i] = scene.triangle( i );
+		if ( triangles.empty() )
+		{
+			std::printf( "Error: scene has no triangles\n" );
+			return 1;
+		}
+
+		AABB bounds;
+		std::vector<TriangleEdges> edges;
+		edges.reserve( triangles.size() );
+		for ( const auto& tr : triangles )
+		{
+			bounds.grow( tr.a );
+			bounds.grow( tr.b );
+			bounds.grow( tr.c );
+			edges.push_back( makeTriangleEdges( tr.a, tr.b, tr.c ) );
+		}
+
+		const std::vector<Ray> rays = makeRays( scene, bounds, options.benchRays );
+		const double tests = double( rays.size() ) * triangles.size();
+		const float tMin = 0.001f;
+		const float tMax = 10000.0f;
+
+		auto start = Clock::now();
+		size_t hitsOld = 0;
+		for ( const auto& ray : rays )
+		{
+			for ( const auto& tr : triangles )
+			{
+				if ( intersectTriangle( ray, tr.a, tr.b, tr.c, tMin, tMax ) < tMax )
+					hitsOld++;
+			}
+		}
+		const double oldTime = secondsSince( start );
+
+		start = Clock::now();
+		size_t hitsNew = 0;
+		for ( const auto& ray : rays )
+		{
+			for ( const auto& tr : edges )
+			{
+				if ( intersectTriangle( ray, tr, tMin, tMax ) < tMax )
+					hitsNew++;
+			}
+		}
+		const double newTime = secondsSince( start );
+
+		std::printf( "Triangles: %zu, rays: %zu\n", triangles.size(), rays.size() );
+		std::printf( "  plane + edge tests:  %8.2f M intersections/s, %zu hits\n", tests / oldTime * 1e-6, hitsOld );
+		std::printf( "  Moller-Trumbore:     %8.2f M intersections/s, %zu hits\n", tests / newTime * 1e-6, hitsNew );
+		return 0;
+	}
+
+	// Синтетическая сцена версии 4 из случайных мелких треугольников
+	bool writeSyntheticScene( const std::string& path, int triangles )
+	{
+		FILE* f = std::fopen( path.c_str(), "wb" );
+		if ( !f )
+			return false;
+		std::fprintf( f, "# Version\n4\n\n# Width, height, number of samples per side\n1 1 1\n\n" );
+		std::fprintf( f, "# Camera\n0.0 0.0 0.0 0.0 0.0 1.0 0.0 1.0 0.0 60.0\n\n# Environment\n0.0 0.0 0.0\n\n" );
+		std::fprintf( f, "# Number of materials\n1\n0.8 0.8 0.8 0.0 0.0 0.0 0\n\n# Number of spheres\n0\n\n# Number of planes\n0\n\n" );
+		std::fprintf( f, "# Number of triangles\n%d\n", triangles );
+		Rng rng( 0, 1 );
+		for ( int i = 0; i < triangles; ++i )
+		{
+			const float x = rng.nextFloat() * 4.0f - 2.0f;
+			const float y = rng.nextFloat() * 4.0f - 2.0f;
+			const float z = rng.nextFloat() * 4.0f + 4.0f;
+			std::fprintf( f, "%.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f 0\n", x, y, z, x + 0.01f, y, z, x, y + 0.01f, z );
+		}
+		return std::fclose( f ) == 0;
+	}
+
+	// Лучи камеры через центры пикселей кадра сцены и диффузные отскоки из их точек попадания:
+	// когерентная и некогерентная нагрузка
+	void makeTraceRays( const Scene& scene, const BVH& bvh, int count, std::vector<Ray>& primary, std::vector<Ray>& secondary )
+	{
+		const Camera& camera = scene.camera();
+		const Vector3 forward = unit_vector( camera.target - camera.pos );
+		const Vector3 right = unit_vector( cross( camera.up, forward ) );
+		const Vector3 up = cross( forward, right );
+		const float aspect = float( scene.width() ) / scene.height();
+		const float h = std::tan( camera.fov / 180.0f * PI * 0.5f );
+		const int side = std::max( 1, int( std::sqrt( float( count ) / aspect ) ) );
+		const int columns = std::max( 1, int( side * aspect ) );
+
+		primary.clear();
+		secondary.clear();
+		Rng rng( 0, 2 );
+		for ( int y = 0; y < side; ++y )
+		{
+			for ( int x = 0; x < columns; ++x )
+			{
+				const float u = ( ( x + 0.5f ) / columns * 2.0f - 1.0f ) * h * aspect;
+				const float v = ( 1.0f - ( y + 0.5f ) / side * 2.0f ) * h;
+				const Ray ray{ camera.pos, unit_vector( forward + right * u + up * v ) };
+				primary.push_back( ray );
+
+				Hit hit;
+				if ( bvh.intersect( ray, 0.001f, 10000.0f, hit ) )
+				{
+					const Vector3 n = dot( hit.normal, ray.direction ) > 0.0f ? -hit.normal : hit.normal;
+					const Vector3 dir = Frame( n ).toWorld( sampleCosineHemisphere( rng.nextFloat(), rng.nextFloat() ) );
+					secondary.push_back( Ray{ ray.origin + ray.direction * hit.t + n * 1e-4f, dir } );
+				}
+			}
+		}
+	}
+
+	// Трассирует rays с текущей шириной bvh: время, попадания и расхождения с эталонными расстояниями
+	void traceRays( const char* name, const BVH& bvh, const std::vector<Ray>& rays, std::vector<float>& reference )
+	{
+		const bool fill = reference.empty();
+		if ( fill )
+			reference.resize( rays.size() );
+		size_t hits = 0;
+		size_t mismatches = 0;
+		// Первый проход прогревает кеши, замеряется второй
+		for ( const Ray& ray : rays )
+		{
+			Hit hit;
+			bvh.intersect( ray, 0.001f, 10000.0f, hit );
+		}
+		const auto start = Clock::now();
+		for ( size_t i = 0; i < rays.size(); ++i )
+		{
+			Hit hit;
+			const float t = bvh.intersect( rays[i], 0.001f, 10000.0f, hit ) ? hit.t : -1.0f;
+			hits += t >= 0.0f ? 1 : 0;
+			if ( fill )
+				reference[i] = t;
+			else if ( std::abs( reference[i] - t ) > 1e-4f * std::max( 1.0f, t ) )
+				mismatches++;
+		}
+		const double time = secondsSince( start );
+		std::printf( "      %-9s %8.2f M rays/s, %zu hits, %zu mismatches\n", name, rays.size() / time * 1e-6, hits, mismatches );
+	}
+
+	// Время построения каждым построителем против скорости обхода его дерева
+	void benchBvhScene( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		std::printf( "Triangles: %zu, spheres: %zu\n", scene.triangleCount(), scene.spheres().size() );
+		std::vector<Ray> primary, secondary;
+		std::vector<float> primaryReference, secondaryReference;
+		for ( BvhBuilder builder : { BvhBuilder::Sah, BvhBuilder::Lbvh } )
+		{
+			BVH bvh;
+			// Меряется обход дерева, даже если сцена мала
+			bvh.setBruteForceLimit( 0 );
+			bvh.setEdgeCache( options.edgeCache );
+			double serialTime = 0.0;
+			if ( pool.size() > 1 )
+			{
+				ThreadPool serial( 1 );
+				const auto start = Clock::now();
+				bvh.build( scene, builder, serial );
+				serialTime = secondsSince( start );
+			}
+			auto start = Clock::now();
+			bvh.build( scene, builder, pool );
+			const double buildTime = secondsSince( start );
+			std::printf( "  %s: %zu nodes, SAH cost %.1f, built in %.1f ms on %u threads", bvhBuilderName( builder ),
+				bvh.nodeCount(), bvh.sahCost(), buildTime * 1e3, pool.size() );
+			if ( serialTime > 0.0 )
+				std::printf( " (%.1f ms on 1)", serialTime * 1e3 );
+			std::printf( "\n" );
+
+			if ( primary.empty() )
+				makeTraceRays( scene, bvh, options.benchRays, primary, secondary );
+			for ( int width : { 2, 4, 8 } )
+			{
+				start = Clock::now();
+				bvh.collapse( width );
+				const double collapseTime = secondsSince( start );
+				if ( width == 2 )
+					std::printf( "    BVH2: %zu KB\n", bvh.memoryBytes() / 1024 );
+				else
+					std::printf( "    BVH%d: %zu nodes, %zu KB, collapsed in %.1f ms\n", width, bvh.wideNodeCount(), bvh.memoryBytes() / 1024, collapseTime * 1e3 );
+				traceRays( "primary", bvh, primary, primaryReference );
+				traceRays( "diffuse", bvh, secondary, secondaryReference );
+			}
+		}
+	}
+
+	// Отражения лучей от всего, во что они попали, как от зеркала
+	std::vector<Ray> makeMirrorRays( const BVH& bvh, const std::vector<Ray>& rays )
+	{
+		std::vector<Ray> mirror;
+		for ( const Ray& ray : rays )
+		{
+			Hit hit;
+			if ( bvh.intersect( ray, 0.001f, 10000.0f, hit ) )
+			{
+				const Vector3 n = dot( hit.normal, ray.direction ) > 0.0f ? -hit.normal : hit.normal;
+				mirror.push_back( Ray{ ray.origin + ray.direction * hit.t + n * 1e-4f, reflect( ray.direction, n ) } );
+			}
+		}
+		return mirror;
+	}
+
+	// Одни и те же лучи по одному и пакетами: скорость обоих и расхождения пакетов с одиночными
+	void tracePackets( const char* name, const BVH& bvh, const std::vector<Ray>& rays )
+	{
+		const float tMin = 0.001f;
+		const float tMax = 10000.0f;
+		std::vector<float> reference( rays.size() );
+		double singleTime = 0.0;
+		// Первый проход прогревает кеши, замеряется второй
+		for ( int pass = 0; pass < 2; ++pass )
+		{
+			const auto start = Clock::now();
+			for ( size_t i = 0; i < rays.size(); ++i )
+			{
+				Hit hit;
+				reference[i] = bvh.intersect( rays[i], tMin, tMax, hit ) ? hit.t : -1.0f;
+			}
+			singleTime = secondsSince( start );
+		}
+
+		size_t hits = 0;
+		size_t mismatches = 0;
+		double packetTime = 0.0;
+		for ( int pass = 0; pass < 2; ++pass )
+		{
+			hits = 0;
+			mismatches = 0;
+			const auto start = Clock::now();
+			for ( size_t first = 0; first < rays.size(); first += PACKET_SIZE )
+			{
+				// Хвост дополняется копиями последнего луча, как в рендере
+				const size_t count = std::min( rays.size() - first, size_t( PACKET_SIZE ) );
+				Ray packet[PACKET_SIZE];
+				for ( size_t i = 0; i < size_t( PACKET_SIZE ); ++i )
+					packet[i] = rays[first + std::min( i, count - 1 )];
+				Hit packetHits[PACKET_SIZE];
+				const unsigned mask = bvh.intersectPacket( packet, tMin, tMax, packetHits );
+				for ( size_t i = 0; i < count; ++i )
+				{
+					const float t = mask & ( 1u << i ) ? packetHits[i].t : -1.0f;
+					hits += t >= 0.0f ? 1 : 0;
+					mismatches += t != reference[first + i] ? 1 : 0;
+				}
+			}
+			packetTime = secondsSince( start );
+		}
+		std::printf( "    %-7s single %8.2f M rays/s, packets %8.2f M rays/s (x%.2f), %zu hits, %zu mismatches\n", name,
+			rays.size() / singleTime * 1e-6, rays.size() / packetTime * 1e-6, singleTime / packetTime, hits, mismatches );
+	}
+
+	// Лучи камеры через центры пикселей и их зеркальные отражения: то, что рендер трассирует пакетами
+	int benchPackets( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		BvhBuilder builder = BvhBuilder::Sah;
+		parseBvhBuilder( options.bvhBuilder, builder );
+		BVH bvh;
+		bvh.setBruteForceLimit( 0 );
+		bvh.build( scene, builder, pool );
+
+		std::vector<Ray> primary, diffuse;
+		makeTraceRays( scene, bvh, options.benchRays, primary, diffuse );
+		const std::vector<Ray> mirror = makeMirrorRays( bvh, primary );
+
+		std::printf( "Triangles: %zu, spheres: %zu, packets of %d rays\n", scene.triangleCount(), scene.spheres().size(), PACKET_SIZE );
+		for ( int width : { 4, 8 } )
+		{
+			bvh.collapse( width );
+			std::printf( "  BVH%d:\n", width );
+			tracePackets( "camera", bvh, primary );
+			tracePackets( "mirror", bvh, mirror );
+		}
+		return 0;
+	}
+
+	// Расхождения results с reference: наибольшее и число превысивших допуск
+	void compareResults( const std::vector<float>& reference, const std::vector<float>& results, float& maxDifference, size_t& mismatches )
+	{
+		for ( size_t i = 0; i < results.size(); ++i )
+		{
+			const float difference = std::abs( reference[i] - results[i] );
+			maxDifference = std::max( maxDifference, difference );
+			if ( !( difference <= 1e-4f * std::max( 1.0f, std::abs( reference[i] ) ) ) )
+				mismatches++;
+		}
+	}
+
+	// Пакеты лучей камеры и их отражений через BVH4, плоскости сцены, перебор SoA и тонмаппинг каждым вариантом
+	// ядер, который есть в сборке и у процессора: скорость и расхождения с sse2.
+	// Код выхода 1, если какой-то вариант разошелся с sse2 больше допуска.
+	int benchKernels( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		BvhBuilder builder = BvhBuilder::Sah;
+		parseBvhBuilder( options.bvhBuilder, builder );
+		BVH bvh;
+		bvh.setBruteForceLimit( 0 );
+		bvh.build( scene, builder, pool );
+		bvh.collapse( 4 );
+
+		std::vector<Ray> rays, diffuse;
+		makeTraceRays( scene, bvh, options.benchRays, rays, diffuse );
+		const std::vector<Ray> mirror = makeMirrorRays( bvh, rays );
+		rays.insert( rays.end(), mirror.begin(), mirror.end() );
+		// Значения кадра до тонмаппинга: от тени до пересвета
+		std::vector<float> values( size_t( options.benchRays ) * 3 );
+		Rng rng( 0, 3 );
+		for ( float& v : values )
+			v = rng.nextFloat() * rng.nextFloat() * 16.0f;
+
+		std::printf( "Triangles: %zu, spheres: %zu, planes: %zu, %zu rays in packets of %d, %zu tonemapped values\n",
+			scene.triangleCount(), scene.spheres().size(), scene.planes().size(), rays.size(), PACKET_SIZE, values.size() );
+		const KernelScene kernelScene = makeKernelScene( scene );
+		const KernelIsa initial = activeKernelIsa();
+		std::vector<float> bvhReference, planeReference, soaReference, toneReference;
+		bool ok = true;
+		for ( KernelIsa isa : KERNEL_ISAS )
+		{
+			if ( !selectKernels( isa ) )
+			{
+				std::printf( "  %-7s not available\n", kernelIsaName( isa ) );
+				continue;
+			}
+
+			std::vector<float> bvhT( rays.size() ), planeT( rays.size() ), soaT( rays.size() * 2 ), tone;
+			double bvhTime = 0.0, planeTime = 0.0, soaTime = 0.0, toneTime = 0.0;
+			// Первый проход прогревает кеши, замеряется второй
+			for ( int pass = 0; pass < 2; ++pass )
+			{
+				auto start = Clock::now();
+				for ( size_t first = 0; first < rays.size(); first += PACKET_SIZE )
+				{
+					const size_t count = std::min( rays.size() - first, size_t( PACKET_SIZE ) );
+					Ray packet[PACKET_SIZE];
+					for ( size_t i = 0; i < size_t( PACKET_SIZE ); ++i )
+						packet[i] = rays[first + std::min( i, count - 1 )];
+					Hit hits[PACKET_SIZE];
+					const unsigned mask = bvh.intersectPacket( packet, 0.001f, 10000.0f, hits );
+					for ( size_t i = 0; i < count; ++i )
+						bvhT[first + i] = mask & ( 1u << i ) ? hits[i].t : -1.0f;
+				}
+				bvhTime = secondsSince( start );
+
+				start = Clock::now();
+				for ( size_t first = 0; first < rays.size(); first += PACKET_SIZE )
+				{
+					const size_t count = std::min( rays.size() - first, size_t( PACKET_SIZE ) );
+					Ray packet[PACKET_SIZE];
+					for ( size_t i = 0; i < size_t( PACKET_SIZE ); ++i )
+						packet[i] = rays[first + std::min( i, count - 1 )];
+					PacketRays packetRays;
+					makePacketRays( packet, packetRays );
+					float t[PACKET_SIZE];
+					std::int32_t hitPlane[PACKET_SIZE];
+					std::fill( t, t + PACKET_SIZE, 10000.0f );
+					std::fill( hitPlane, hitPlane + PACKET_SIZE, -1 );
+					kernels().intersectPlanes( packetRays, kernelScene, 0.001f, t, hitPlane );
+					for ( size_t i = 0; i < count; ++i )
+						planeT[first + i] = hitPlane[i] >= 0 ? t[i] : -1.0f;
+				}
+				planeTime = secondsSince( start );
+
+				// Перебор сфер и плоскостей по SoA массивам, по одному лучу
+				start = Clock::now();
+				for ( size_t i = 0; i < rays.size(); ++i )
+				{
+					float t = 10000.0f;
+					soaT[i * 2] = kernels().closestSphere( rays[i], scene.sphereSoa(), 0.001f, t ) >= 0 ? t : -1.0f;
+					t = 10000.0f;
+					soaT[i * 2 + 1] = kernels().closestPlane( rays[i], scene.planeSoa(), 0.001f, t ) >= 0 ? t : -1.0f;
+				}
+				soaTime = secondsSince( start );
+
+				tone = values;
+				start = Clock::now();
+				kernels().tonemap( tone.data(), int( tone.size() ) );
+				toneTime = secondsSince( start );
+			}
+
+			std::printf( "  %-7s BVH4 packets %8.2f M rays/s, planes %8.2f M rays/s, SoA spheres and planes %8.2f M rays/s, tonemap %8.2f M values/s",
+				kernelIsaName( isa ), rays.size() / bvhTime * 1e-6, rays.size() / planeTime * 1e-6, rays.size() / soaTime * 1e-6,
+				tone.size() / toneTime * 1e-6 );
+			if ( bvhReference.empty() )
+			{
+				bvhReference = bvhT;
+				planeReference = planeT;
+				soaReference = soaT;
+				toneReference = tone;
+				std::printf( ", reference\n" );
+				continue;
+			}
+			float maxDifference = 0.0f;
+			size_t mismatches = 0;
+			compareResults( bvhReference, bvhT, maxDifference, mismatches );
+			compareResults( planeReference, planeT, maxDifference, mismatches );
+			compareResults( soaReference, soaT, maxDifference, mismatches );
+			compareResults( toneReference, tone, maxDifference, mismatches );
+			std::printf( ", max difference %g, %zu mismatches\n", maxDifference, mismatches );
+			ok = ok && mismatches == 0;
+		}
+		selectKernels( initial );
+		return ok ? 0 : 1;
+	}
+
+	// Треугольник, разбитый по серединам сторон levels раз
+	void subdivide( const Vector3& a, const Vector3& b, const Vector3& c, int levels, std::vector<Vector3>& out )
+	{
+		if ( levels == 0 )
+		{
+			out.push_back( a );
+			out.push_back( b );
+			out.push_back( c );
+			return;
+		}
+		const Vector3 ab = ( a + b ) * 0.5f;
+		const Vector3 bc = ( b + c ) * 0.5f;
+		const Vector3 ca = ( c + a ) * 0.5f;
+		subdivide( a, ab, ca, levels - 1, out );
+		subdivide( ab, b, bc, levels - 1, out );
+		subdivide( ca, bc, c, levels - 1, out );
+		subdivide( ab, bc, ca, levels - 1, out );
+	}
+
+	// Бинарный PLY из треугольников по три вершины подряд
+	bool writePly( const std::string& path, const std::vector<Vector3>& vertices )
+	{
+		FILE* f = std::fopen( path.c_str(), "wb" );
+		if ( !f )
+			return false;
+		const size_t faces = vertices.size() / 3;
+		std::fprintf( f, "ply\nformat binary_little_endian 1.0\nelement vertex %zu\nproperty float x\nproperty float y\nproperty float z\n"
+			"element face %zu\nproperty list uchar int vertex_indices\nend_header\n", vertices.size(), faces );
+		for ( const Vector3& v : vertices )
+		{
+			const float xyz[3] = { v.x(), v.y(), v.z() };
+			std::fwrite( xyz, sizeof( xyz ), 1, f );
+		}
+		for ( size_t i = 0; i < faces; ++i )
+		{
+			const unsigned char n = 3;
+			const std::int32_t idx[3] = { std::int32_t( i * 3 ), std::int32_t( i * 3 + 1 ), std::int32_t( i * 3 + 2 ) };
+			std::fwrite( &n, 1, 1, f );
+			std::fwrite( idx, sizeof( idx ), 1, f );
+		}
+		return std::fclose( f ) == 0;
+	}
+
+	// Та же сцена с треугольниками, разбитыми до не меньше чем triangles штук: бинарный PLY
+	// и сцена версии 4, которая на него ссылается
+	bool writeTessellatedScene( const Scene& scene, int triangles, const std::string& scenePath, const std::string& meshPath, int& levels )
+	{
+		levels = 0;
+		while ( scene.triangleCount() << ( 2 * levels ) < size_t( triangles ) )
+			levels++;
+
+		std::vector<Vector3> vertices;
+		vertices.reserve( scene.triangleCount() * 3 << ( 2 * levels ) );
+		for ( size_t i = 0; i < scene.triangleCount(); ++i )
+		{
+			const Triangle tr = scene.triangle( i );
+			subdivide( tr.a, tr.b, tr.c, levels, vertices );
+		}
+
+		if ( !writePly( meshPath, vertices ) )
+			return false;
+
+		FILE* f = std::fopen( scenePath.c_str(), "wb" );
+		if ( !f )
+			return false;
+		const Camera& c = scene.camera();
+		std::fprintf( f, "4\n%d %d 1\n", scene.width(), scene.height() );
+		std::fprintf( f, "%f %f %f %f %f %f %f %f %f %f\n", c.pos.x(), c.pos.y(), c.pos.z(), c.target.x(), c.target.y(), c.target.z(), c.up.x(), c.up.y(), c.up.z(), c.fov );
+		std::fprintf( f, "0 0 0\n1\n0.8 0.8 0.8 0 0 0 0\n0\n0\n0\n1\n%s 0\n", meshPath.c_str() );
+		return std::fclose( f ) == 0;
+	}
+
+	int benchBvh( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		benchBvhScene( options, scene, pool );
+		if ( scene.triangleCount() == 0 || scene.triangleCount() >= size_t( options.benchTriangles ) )
+			return 0;
+
+		const std::filesystem::path dir = std::filesystem::temp_directory_path();
+		const std::string scenePath = ( dir / "pbr-bench-bvh.txt" ).string();
+		const std::string meshPath = ( dir / "pbr-bench-bvh.ply" ).string();
+		int levels = 0;
+		Scene big;
+		const bool ok = writeTessellatedScene( scene, options.benchTriangles, scenePath, meshPath, levels ) && big.load( scenePath.c_str() );
+		std::filesystem::remove( scenePath );
+		std::filesystem::remove( meshPath );
+		if ( !ok )
+		{
+			std::printf( "Error: could not write the tessellated scene\n" );
+			return 1;
+		}
+		std::printf( "\nTessellated %d times:\n", levels );
+		benchBvhScene( options, big, pool );
+		return 0;
+	}
+
+	// Теневые лучи из точек попадания лучей камеры: к случайной точке источника, как в NEE,
+	// а если источников нет - обратно к камере. tMax - до цели, не включая ее саму.
+	void makeShadowRays( const Scene& scene, const BVH& bvh, int count, std::vector<Ray>& rays, std::vector<float>& tMax )
+	{
+		std::vector<Ray> primary, diffuse;
+		makeTraceRays( scene, bvh, count, primary, diffuse );
+		LightSampler lights;
+		lights.build( scene );
+		Rng rng( 0, 4 );
+		rays.clear();
+		tMax.clear();
+		for ( const Ray& ray : primary )
+		{
+			const SceneHit hit = intersectScene( ray, scene, bvh );
+			if ( hit.t == RAY_T_MAX )
+				continue;
+			const Vector3 n = dot( hit.normal, ray.direction ) > 0.0f ? -hit.normal : hit.normal;
+			const Vector3 origin = ray.origin + ray.direction * hit.t + n * 1e-4f;
+			Vector3 target = scene.camera().pos;
+			if ( !lights.empty() )
+				target = lights.sample( rng.nextFloat(), rng.nextFloat(), rng.nextFloat() ).position;
+			const Vector3 toTarget = target - origin;
+			const float dist = toTarget.length();
+			if ( dist <= 2.0f * RAY_T_MIN )
+				continue;
+			rays.push_back( Ray{ origin, toTarget / dist } );
+			tMax.push_back( dist - RAY_T_MIN );
+		}
+	}
+
+	// Видимость по ближайшему попаданию с нормалью и материалом, как делал occluded раньше
+	bool occludedByClosestHit( const Ray& ray, const Scene& scene, const BVH& bvh, float tMax )
+	{
+		Hit hit;
+		if ( bvh.intersect( ray, RAY_T_MIN, tMax, hit ) )
+			return true;
+		for ( const auto& p : scene.planes() )
+		{
+			if ( intersectPlane2( ray, p.normal, p.dist, RAY_T_MIN, tMax ) < tMax )
+				return true;
+		}
+		return false;
+	}
+
+	// Теневые лучи: поиск ближайшего попадания против occluded по одному и пакетами
+	int benchShadow( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		BvhBuilder builder = BvhBuilder::Sah;
+		parseBvhBuilder( options.bvhBuilder, builder );
+		BVH bvh;
+		bvh.build( scene, builder, pool );
+		bvh.collapse( options.bvhWidth );
+		if ( options.bruteForceLimit >= 0 )
+			bvh.setBruteForceLimit( std::uint32_t( options.bruteForceLimit ) );
+
+		std::vector<Ray> rays;
+		std::vector<float> tMax;
+		makeShadowRays( scene, bvh, options.benchRays, rays, tMax );
+		std::printf( "Triangles: %zu, spheres: %zu, planes: %zu, %zu shadow rays, BVH%d%s\n", scene.triangleCount(), scene.spheres().size(),
+			scene.planes().size(), rays.size(), bvh.width(), bvh.bruteForce() ? " (brute force)" : "" );
+		if ( rays.empty() )
+			return 0;
+
+		std::vector<std::uint8_t> reference( rays.size() ), single( rays.size() ), packets( rays.size() );
+		double closestTime = 0.0, singleTime = 0.0, packetTime = 0.0;
+		// Первый проход прогревает кеши, замеряется второй
+		for ( int pass = 0; pass < 2; ++pass )
+		{
+			auto start = Clock::now();
+			for ( size_t i = 0; i < rays.size(); ++i )
+				reference[i] = occludedByClosestHit( rays[i], scene, bvh, tMax[i] ) ? 1 : 0;
+			closestTime = secondsSince( start );
+
+			start = Clock::now();
+			for ( size_t i = 0; i < rays.size(); ++i )
+				single[i] = occluded( rays[i], scene, bvh, RAY_T_MIN, tMax[i] ) ? 1 : 0;
+			singleTime = secondsSince( start );
+
+			start = Clock::now();
+			for ( size_t first = 0; first < rays.size(); first += PACKET_SIZE )
+			{
+				const size_t count = std::min( rays.size() - first, size_t( PACKET_SIZE ) );
+				Ray packet[PACKET_SIZE];
+				float packetT[PACKET_SIZE];
+				for ( size_t i = 0; i < size_t( PACKET_SIZE ); ++i )
+				{
+					packet[i] = rays[first + std::min( i, count - 1 )];
+					packetT[i] = tMax[first + std::min( i, count - 1 )];
+				}
+				const unsigned mask = occluded( packet, scene, bvh, RAY_T_MIN, packetT );
+				for ( size_t i = 0; i < count; ++i )
+					packets[first + i] = mask & ( 1u << i ) ? 1 : 0;
+			}
+			packetTime = secondsSince( start );
+		}
+
+		size_t blocked = 0, mismatches = 0;
+		for ( size_t i = 0; i < rays.size(); ++i )
+		{
+			blocked += reference[i];
+			mismatches += ( single[i] != reference[i] ? 1 : 0 ) + ( packets[i] != reference[i] ? 1 : 0 );
+		}
+		std::printf( "  closest hit %8.2f M rays/s\n", rays.size() / closestTime * 1e-6 );
+		std::printf( "  any hit     %8.2f M rays/s (x%.2f)\n", rays.size() / singleTime * 1e-6, closestTime / singleTime );
+		std::printf( "  any hit x%d  %8.2f M rays/s (x%.2f)\n", PACKET_SIZE, rays.size() / packetTime * 1e-6, closestTime / packetTime );
+		std::printf( "  %.1f%% occluded, %zu mismatches\n", 100.0 * blocked / rays.size(), mismatches );
+		return mismatches == 0 ? 0 : 1;
+	}
+
+	// Синтетическая сцена версии 4 из spheres случайных сфер перед камерой и пола
+	bool writeSphereScene( const std::string& path, int spheres )
+	{
+		FILE* f = std::fopen( path.c_str(), "wb" );
+		if ( !f )
+			return false;
+		std::fprintf( f, "# Version\n4\n\n# Width, height, number of samples per side\n320 240 1\n\n" );
+		std::fprintf( f, "# Camera\n0.0 0.0 0.0 0.0 0.0 1.0 0.0 1.0 0.0 60.0\n\n# Environment\n0.5 0.5 0.5\n\n" );
+		std::fprintf( f, "# Number of materials\n1\n0.8 0.8 0.8 0.0 0.0 0.0 0\n\n# Number of spheres\n%d\n", spheres );
+		Rng rng( 0, 3 );
+		// Радиус такой, что сферы закрывают заметную часть кадра при любом их числе
+		const float radius = 3.0f / std::sqrt( float( spheres ) );
+		for ( int i = 0; i < spheres; ++i )
+		{
+			const float x = rng.nextFloat() * 6.0f - 3.0f;
+			const float y = rng.nextFloat() * 4.0f - 2.0f;
+			const float z = rng.nextFloat() * 4.0f + 5.0f;
+			std::fprintf( f, "%.4f %.4f %.4f %.4f 0\n", x, y, z, radius );
+		}
+		std::fprintf( f, "\n# Number of planes\n1\n0.0 1.0 0.0 -2.5 0\n\n# Number of triangles\n0\n" );
+		return std::fclose( f ) == 0;
+	}
+
+	// Обход дерева против полного перебора на лучах камеры и диффузных отскоках
+	void benchBruteForceScene( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		BvhBuilder builder = BvhBuilder::Sah;
+		parseBvhBuilder( options.bvhBuilder, builder );
+		BVH bvh;
+		bvh.build( scene, builder, pool );
+		bvh.collapse( options.bvhWidth );
+
+		std::vector<Ray> primary, diffuse;
+		makeTraceRays( scene, bvh, options.benchRays, primary, diffuse );
+		const std::uint32_t prims = std::uint32_t( bvh.primCount() );
+		std::printf( "  %u primitives (%zu spheres), BVH%d vs brute force:\n", prims, scene.spheres().size(), bvh.width() );
+		for ( int kind = 0; kind < 2; ++kind )
+		{
+			const std::vector<Ray>& rays = kind == 0 ? primary : diffuse;
+			std::vector<float> reference;
+			std::printf( "    %s:\n", kind == 0 ? "primary" : "diffuse" );
+			bvh.setBruteForceLimit( 0 );
+			traceRays( "tree", bvh, rays, reference );
+			bvh.setBruteForceLimit( prims );
+			traceRays( "brute", bvh, rays, reference );
+		}
+	}
+
+	// Порог BVH_BRUTE_FORCE_LIMIT: сцена и синтетические сцены из растущего числа сфер
+	int benchBruteForce( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		std::printf( "Scene, %s kernels:\n", kernelIsaName( activeKernelIsa() ) );
+		benchBruteForceScene( options, scene, pool );
+
+		const std::string path = ( std::filesystem::temp_directory_path() / "pbr-bench-spheres.txt" ).string();
+		for ( int spheres : { 4, 8, 16, 32, 64, 128 } )
+		{
+			Scene synthetic;
+			const bool ok = writeSphereScene( path, spheres ) && synthetic.load( path.c_str() );
+			std::filesystem::remove( path );
+			if ( !ok )
+			{
+				std::printf( "Error: could not write %s\n", path.c_str() );
+				return 1;
+			}
+			benchBruteForceScene( options, synthetic, pool );
+		}
+		return 0;
+	}
+
+	// Лес из copies копий треугольников мира сцены на сетке, каждая повернута вокруг Y.
+	// Сцена версии 5 с одним мешом и экземплярами и та же сцена версии 4, где копии - отдельные треугольники.
+	bool writeForestScenes( const Scene& scene, int copies, const std::string& instancedPath, const std::string& flatPath,
+		const std::string& meshPath, const std::string& flatMeshPath )
+	{
+		std::vector<Vector3> mesh;
+		AABB bounds;
+		for ( size_t i = 0; i < scene.triangleCount(); ++i )
+		{
+			const Triangle tr = scene.triangle( i );
+			for ( const Vector3& v : { tr.a, tr.b, tr.c } )
+			{
+				mesh.push_back( v );
+				bounds.grow( v );
+			}
+		}
+
+		const int side = int( std::ceil( std::sqrt( float( copies ) ) ) );
+		const Vector3 extent = bounds.max - bounds.min;
+		const float spacing = 1.2f * std::max( extent.x(), extent.z() );
+		const Vector3 center = bounds.centroid();
+		std::vector<std::array<float, 12>> transforms( copies );
+		std::vector<Vector3> flat;
+		flat.reserve( mesh.size() * copies );
+		for ( int i = 0; i < copies; ++i )
+		{
+			// Поворот вокруг центра меша и перенос в клетку сетки
+			const float angle = 0.7f * i;
+			const float c = std::cos( angle );
+			const float s = std::sin( angle );
+			const Vector3 cell( ( i % side ) * spacing, 0.0f, ( i / side ) * spacing );
+			std::array<float, 12>& m = transforms[i];
+			m = { c, 0.0f, s, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, -s, 0.0f, c, 0.0f };
+			const Vector3 t = center + cell - transformVector( m.data(), center );
+			m[3] = t.x();
+			m[7] = t.y();
+			m[11] = t.z();
+			for ( const Vector3& v : mesh )
+				flat.push_back( transformPoint( m.data(), v ) );
+		}
+		if ( !writePly( meshPath, mesh ) || !writePly( flatMeshPath, flat ) )
+			return false;
+
+		// Камера над ближним краем сетки смотрит на ее центр
+		const float size = spacing * side;
+		const Vector3 target = center + Vector3( 0.5f, 0.0f, 0.5f ) * ( size - spacing );
+		const Vector3 eye = target + Vector3( 0.0f, 0.5f * size, -0.8f * size );
+		for ( int instanced = 0; instanced < 2; ++instanced )
+		{
+			FILE* f = std::fopen( ( instanced ? instancedPath : flatPath ).c_str(), "wb" );
+			if ( !f )
+				return false;
+			std::fprintf( f, "%d\n320 240 1\n", instanced ? 5 : 4 );
+			std::fprintf( f, "%f %f %f %f %f %f 0 1 0 60\n", eye.x(), eye.y(), eye.z(), target.x(), target.y(), target.z() );
+			std::fprintf( f, "0.5 0.5 0.5\n1\n0.8 0.8 0.8 0 0 0 0\n0\n0\n0\n1\n%s 0\n", ( instanced ? meshPath : flatMeshPath ).c_str() );
+			if ( instanced )
+			{
+				std::fprintf( f, "%d\n", copies );
+				for ( const auto& m : transforms )
+				{
+					std::fprintf( f, "0" );
+					for ( float x : m )
+						std::fprintf( f, " %.9g", x );
+					std::fprintf( f, " -1\n" );
+				}
+			}
+			if ( std::fclose( f ) != 0 )
+				return false;
+		}
+		return true;
+	}
+
+	// Экземпляры против копий: память, построение и скорость обхода на одном и том же лесе
+	int benchInstances( const Options& options, const Scene& scene, ThreadPool& pool )
+	{
+		if ( scene.triangleCount() == 0 )
+		{
+			std::printf( "Error: the scene has no triangles to instance\n" );
+			return 1;
+		}
+		const int copies = std::max( 2, int( options.benchTriangles / scene.triangleCount() ) );
+		const std::filesystem::path dir = std::filesystem::temp_directory_path();
+		const std::string instancedPath = ( dir / "pbr-bench-instances.txt" ).string();
+		const std::string flatPath = ( dir / "pbr-bench-flat.txt" ).string();
+		const std::string meshPath = ( dir / "pbr-bench-instances.ply" ).string();
+		const std::string flatMeshPath = ( dir / "pbr-bench-flat.ply" ).string();
+		Scene instanced, flat;
+		const bool ok = writeForestScenes( scene, copies, instancedPath, flatPath, meshPath, flatMeshPath ) &&
+			instanced.load( instancedPath.c_str() ) && flat.load( flatPath.c_str() );
+		for ( const std::string& path : { instancedPath, flatPath, meshPath, flatMeshPath } )
+			std::filesystem::remove( path );
+		if ( !ok )
+		{
+			std::printf( "Error: could not write the instanced scenes\n" );
+			return 1;
+		}
+
+		BvhBuilder builder = BvhBuilder::Sah;
+		parseBvhBuilder( options.bvhBuilder, builder );
+		std::printf( "%d copies of %zu triangles, BVH%d:\n", copies, scene.triangleCount(), options.bvhWidth );
+		BVH bvhs[2];
+		const Scene* scenes[2] = { &flat, &instanced };
+		for ( int i = 0; i < 2; ++i )
+		{
+			const auto start = Clock::now();
+			bvhs[i].build( *scenes[i], builder, pool );
+			bvhs[i].collapse( options.bvhWidth );
+			const double buildTime = secondsSince( start );
+			std::printf( "  %-9s %zu unique triangles, %zu KB with BVH, built in %.1f ms\n", i == 0 ? "copies" : "instances",
+				scenes[i]->indices().size() / 3, ( scenes[i]->geometryBytes() + bvhs[i].memoryBytes() ) / 1024, buildTime * 1e3 );
+		}
+
+		// Расхождения - лучи на ребрах: матрица к лучу и к вершинам округляется по-разному
+		std::vector<Ray> primary, diffuse;
+		makeTraceRays( flat, bvhs[0], options.benchRays, primary, diffuse );
+		for ( int kind = 0; kind < 2; ++kind )
+		{
+			std::vector<float> reference;
+			std::printf( "    %s:\n", kind == 0 ? "primary" : "diffuse" );
+			traceRays( "copies", bvhs[0], kind == 0 ? primary : diffuse, reference );
+			traceRays( "instances", bvhs[1], kind == 0 ? primary : diffuse, reference );
+		}
+		return 0;
+	}
+
+	// Много коротких parallelFor подряд: каждый номер должен выполниться ровно один раз и только
+	// задачей своего вызова. Потоков больше, чем ядер, чтобы потоки вытеснялись посреди вызова.
+	int benchPool( const Options& options )
+	{
+		const int calls = std::max( 1, options.benchRays );
+		bool ok = true;
+		for ( unsigned threads : { 2u, 4u, 8u } )
+		{
+			ThreadPool stress( threads );
+			std::vector<std::atomic<std::uint32_t>> runs( 64 );
+			size_t wrong = 0;
+			const auto start = Clock::now();
+			for ( int call = 0; call < calls; ++call )
+			{
+				const size_t count = 1 + size_t( call ) % runs.size();
+				for ( size_t i = 0; i < count; ++i )
+					runs[i] = 0;
+				const std::uint32_t tag = std::uint32_t( call );
+				stress.parallelFor( count, [&runs, tag]( size_t i ) { runs[i] += tag + 1; } );
+				for ( size_t i = 0; i < count; ++i )
+					wrong += runs[i] != tag + 1 ? 1 : 0;
+			}
+			const double time = secondsSince( start );
+			std::printf( "  %u threads: %d calls, %.2f us per call, %zu wrong items\n", threads, calls, time / calls * 1e6, wrong );
+			ok = ok && wrong == 0;
+		}
+		return ok ? 0 : 1;
+	}
+
+	int benchLoad( const Options& options )
+	{
+		const std::string path = ( std::filesystem::temp_directory_path() / "pbr-bench-load.txt" ).string();
+		if ( !writeSyntheticScene( path, options.benchTriangles ) )
+		{
+			std::printf( "Error: could not write %s\n", path.c_str() );
+			return 1;
+		}
+		const double megabytes = double( std::filesystem::file_size( path ) ) / ( 1024.0 * 1024.0 );
+
+		Scene scene;
+		const auto start = Clock::now();
+		const bool ok = scene.load( path.c_str() );
+		const double time = secondsSince( start );
+		std::filesystem::remove( path );
+		if ( !ok )
+			return 1;
+
+		std::printf( "Loaded %zu triangles (%.1f MB) in %.1f ms: %.1f MB/s, %.2f M triangles/s\n",
+			scene.triangleCount(), megabytes, time * 1e3, megabytes / time, scene.triangleCount() / time * 1e-6 );
+		return 0;
+	}
+}
+
+int runBenchmark( const Options& options, const Scene& scene, ThreadPool& pool )
+{
+	if ( options.bench == "triangles" )
+		return benchTriangles( options, scene );
+	if ( options.bench == "load" )
+		return benchLoad( options );
+	if ( options.bench == "pool" )
+		return benchPool( options );
+	if ( options.bench == "bvh" )
+		return benchBvh( options, scene, pool );
+	if ( options.bench == "packets" )
+		return benchPackets( options, scene, pool );
+	if ( options.bench == "kernels" )
+		return benchKernels( options, scene, pool );
+	if ( options.bench == "bruteforce" )
+		return benchBruteForce( options, scene, pool );
+	if ( options.bench == "shadow" )
+		return benchShadow( options, scene, pool );
+	if ( options.bench == "instances" )
+		return benchInstances( options, scene, pool );
+
+	std::printf( "Error: unknown benchmark %s\n", options.bench.c_str() );
+	return 1;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "options.h"
+#include "../src/scene.h"
+
+class ThreadPool;
+
+// Микробенчмарки, запускаются через --bench <name>. Возвращает код выхода.
+int runBenchmark( const Options& options, const Scene& scene, ThreadPool& pool );
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "geometry.h"
+#include "../src/scene.h"
+
+// Ортонормированный базис вокруг нормали (Duff et al. 2017, без ветвлений по оси)
+struct Frame
+{
+	Vector3 tangent;
+	Vector3 bitangent;
+	Vector3 normal;
+
+	explicit Frame( const Vector3& n )
+		: normal( n )
+	{
+		const float sign = std::copysign( 1.0f, n.z() );
+		const float a = -1.0f / ( sign + n.z() );
+		const float b = n.x() * n.y() * a;
+		tangent = Vector3( 1.0f + sign * n.x() * n.x() * a, sign * b, -sign * n.x() );
+		bitangent = Vector3( b, sign + n.y() * n.y() * a, -n.y() );
+	}
+
+	Vector3 toWorld( const Vector3& v ) const
+	{
+		return tangent * v.x() + bitangent * v.y() + normal * v.z();
+	}
+};
+
+inline Vector3 reflect( const Vector3& d, const Vector3& n )
+{
+	return d - 2.0f * dot( d, n ) * n;
+}
+
+// Направление по косинусу в верхней полусфере локального базиса, pdf = cos / PI
+inline Vector3 sampleCosineHemisphere( float u1, float u2 )
+{
+	const float r = std::sqrt( u1 );
+	const float phi = 2.0f * PI * u2;
+	return Vector3( r * std::cos( phi ), r * std::sin( phi ), std::sqrt( std::max( 0.0f, 1.0f - u1 ) ) );
+}
+
+struct BsdfSample
+{
+	Vector3 direction;
+	Vector3 weight; // f * cos / pdf
+	float pdf;      // по телесному углу, для зеркала не определена
+	bool specular;
+};
+
+// Материалы сцены: type 0 - ламберт, 1 - идеальное зеркало.
+inline bool isSpecular( const Material& m )
+{
+	return m.type == 1;
+}
+
+// normal смотрит навстречу падающему лучу direction.
+inline BsdfSample sampleBsdf( const Material& m, const Vector3& normal, const Vector3& direction, float u1, float u2 )
+{
+	BsdfSample s;
+	if ( isSpecular( m ) )
+	{
+		s.direction = reflect( direction, normal );
+		s.weight = m.albedo;
+		s.pdf = 0.0f;
+		s.specular = true;
+		return s;
+	}
+
+	const Vector3 local = sampleCosineHemisphere( u1, u2 );
+	s.direction = Frame( normal ).toWorld( local );
+	// f * cos / pdf = (albedo / PI) * cos / (cos / PI)
+	s.weight = m.albedo;
+	s.pdf = local.z() / PI;
+	s.specular = false;
+	return s;
+}
+
+// f для заданного направления, зеркальная часть всегда 0
+inline Vector3 evalBsdf( const Material& m, const Vector3& normal, const Vector3& wi )
+{
+	if ( isSpecular( m ) || dot( wi, normal ) <= 0.0f )
+		return Vector3( 0, 0, 0 );
+	return m.albedo / PI;
+}
+
+// Плотность, с которой sampleBsdf выбрал бы wi
+inline float pdfBsdf( const Material& m, const Vector3& normal, const Vector3& wi )
+{
+	if ( isSpecular( m ) )
+		return 0.0f;
+	return std::max( 0.0f, dot( wi, normal ) ) / PI;
+}
@@ -0,0 +1,412 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "kernels.h"
+
+namespace {
+	const char ACCEL_MAGIC[4] = { 'B', 'V', 'H', '3' };
+
+	struct AccelHeader
+	{
+		char magic[4];
+		std::uint32_t sphereCount;
+		std::uint32_t triangleCount;
+		std::uint32_t nodeCount;
+		std::uint32_t primCount;
+	};
+
+	size_t alignOffset( size_t offset )
+	{
+		return ( offset + 15 ) & ~size_t( 15 );
+	}
+
+	// Дерево из кеша: обход не проверяет индексы, поэтому они проверяются здесь один раз.
+	// Дети идут после родителя, и в каждый узел ведет ровно один путь - так нет циклов и общих поддеревьев.
+	bool validTree( ArrayView<BVHNode> nodes, ArrayView<std::uint32_t> prims )
+	{
+		if ( nodes.empty() )
+			return prims.empty();
+		struct Task
+		{
+			std::uint32_t node;
+			std::uint32_t depth;
+		};
+		std::vector<char> visited( nodes.size(), 0 );
+		std::vector<Task> stack = { { 0, 0 } };
+		while ( !stack.empty() )
+		{
+			const Task task = stack.back();
+			stack.pop_back();
+			if ( visited[task.node] || task.depth > BVH_MAX_DEPTH )
+				return false;
+			visited[task.node] = 1;
+			const BVHNode& node = nodes[task.node];
+			if ( node.count > 0 )
+			{
+				if ( size_t( node.first ) + node.count > prims.size() )
+					return false;
+				continue;
+			}
+			if ( node.first <= task.node || size_t( node.first ) + 1 >= nodes.size() )
+				return false;
+			stack.push_back( { node.first, task.depth + 1 } );
+			stack.push_back( { node.first + 1, task.depth + 1 } );
+		}
+		return std::all_of( prims.begin(), prims.end(), [&]( std::uint32_t prim ) { return prim < prims.size(); } );
+	}
+}
+
+void BVH::serialize( std::vector<char>& out ) const
+{
+	AccelHeader header;
+	std::memcpy( header.magic, ACCEL_MAGIC, sizeof( ACCEL_MAGIC ) );
+	header.sphereCount = sphereCount_;
+	header.triangleCount = (std::uint32_t)( prims_.size() - sphereCount_ );
+	header.nodeCount = (std::uint32_t)nodes_.size();
+	header.primCount = (std::uint32_t)prims_.size();
+
+	const size_t nodesOffset = alignOffset( sizeof( header ) );
+	const size_t primsOffset = alignOffset( nodesOffset + nodes_.size() * sizeof( BVHNode ) );
+	out.assign( primsOffset + prims_.size() * sizeof( std::uint32_t ), 0 );
+
+	std::memcpy( out.data(), &header, sizeof( header ) );
+	if ( !nodes_.empty() )
+		std::memcpy( out.data() + nodesOffset, nodes_.data(), nodes_.size() * sizeof( BVHNode ) );
+	if ( !prims_.empty() )
+		std::memcpy( out.data() + primsOffset, prims_.data(), prims_.size() * sizeof( std::uint32_t ) );
+}
+
+bool BVH::load( const Scene& scene, ArrayView<char> data )
+{
+	AccelHeader header;
+	if ( data.size() < sizeof( header ) )
+		return false;
+	std::memcpy( &header, data.data(), sizeof( header ) );
+	if ( std::memcmp( header.magic, ACCEL_MAGIC, sizeof( ACCEL_MAGIC ) ) != 0 ||
+		header.sphereCount != scene.spheres().size() || header.triangleCount != scene.triangleCount() ||
+		header.primCount != header.sphereCount + header.triangleCount )
+		return false;
+
+	const size_t nodesOffset = alignOffset( sizeof( header ) );
+	const size_t primsOffset = alignOffset( nodesOffset + size_t( header.nodeCount ) * sizeof( BVHNode ) );
+	if ( data.size() < primsOffset + size_t( header.primCount ) * sizeof( std::uint32_t ) )
+		return false;
+	const ArrayView<BVHNode> nodes( reinterpret_cast<const BVHNode*>( data.data() + nodesOffset ), header.nodeCount );
+	const ArrayView<std::uint32_t> prims( reinterpret_cast<const std::uint32_t*>( data.data() + primsOffset ), header.primCount );
+	if ( !validTree( nodes, prims ) )
+		return false;
+
+	scene_ = &scene;
+	sphereCount_ = header.sphereCount;
+	blas_.clear();
+	placements_.clear();
+	tlasNodes_.clear();
+	tlasPrims_.clear();
+	collapse( 2 );
+	nodeStorage_.clear();
+	primStorage_.clear();
+	nodes_ = nodes;
+	prims_ = prims;
+	buildTriangles( scene );
+	return true;
+}
+
+void BVH::buildTriangles( const Scene& scene )
+{
+	const size_t count = edgeCache_ ? scene.indices().size() / 3 : 0;
+	edgeStorage_.resize( count );
+	edgeStorage_.shrink_to_fit();
+	for ( size_t i = 0; i < count; ++i )
+	{
+		const std::uint32_t* idx = scene.triangleIndices( i );
+		edgeStorage_[i] = makeTriangleEdges( scene.vertices()[idx[0]], scene.vertices()[idx[1]], scene.vertices()[idx[2]] );
+	}
+	edges_ = edgeStorage_;
+	for ( BVH& blas : blas_ )
+		blas.edges_ = edges_;
+}
+
+void BVH::setEdgeCache( bool enabled )
+{
+	edgeCache_ = enabled;
+	if ( scene_ )
+		buildTriangles( *scene_ );
+}
+
+float BVH::intersectPrim( const Ray& ray, std::uint32_t prim, float tMin, float tMax ) const
+{
+	if ( prim < sphereCount_ )
+	{
+		const Sphere& sp = scene_->spheres()[prim];
+		return intersectSphere( ray, sp.pos, sp.radius, tMin, tMax );
+	}
+	if ( !edges_.empty() )
+		return intersectTriangle( ray, edges_[prim - sphereCount_], tMin, tMax );
+	const std::uint32_t* idx = scene_->triangleIndices( prim - sphereCount_ );
+	const Vector3& v0 = scene_->vertices()[idx[0]];
+	return intersectTriangleEdges( ray, v0, scene_->vertices()[idx[1]] - v0, scene_->vertices()[idx[2]] - v0, tMin, tMax );
+}
+
+bool BVH::intersect( const Ray& ray, float tMin, float tMax, Hit& hit ) const
+{
+	bool found;
+	if ( bruteForce() )
+		found = intersectBruteForce( ray, tMin, tMax, hit );
+	else if ( width_ == 4 )
+		found = intersectWide( wide4_, ray, tMin, tMax, hit );
+	else if ( width_ == 8 )
+		found = intersectWide( wide8_, ray, tMin, tMax, hit );
+	else
+		found = intersectBinary( ray, tMin, tMax, hit );
+	// Экземпляры - после мира, до уже найденного попадания
+	if ( !placements_.empty() && intersectInstances( ray, tMin, found ? hit.t : tMax, hit ) )
+		found = true;
+	return found;
+}
+
+bool BVH::occluded( const Ray& ray, float tMin, float tMax ) const
+{
+	bool blocked;
+	if ( bruteForce() )
+	{
+		const Vector3 invDir( 1.0f / ray.direction.x(), 1.0f / ray.direction.y(), 1.0f / ray.direction.z() );
+		blocked = intersectAABB( nodes_[0].bounds, ray.origin, invDir, tMin, tMax ) < tMax &&
+			kernels().occludedSpheres( ray, scene_->sphereSoa(), tMin, tMax );
+	}
+	else if ( width_ == 4 )
+		blocked = occludedWide( wide4_, ray, tMin, tMax );
+	else if ( width_ == 8 )
+		blocked = occludedWide( wide8_, ray, tMin, tMax );
+	else
+		blocked = occludedBinary( ray, tMin, tMax );
+	return blocked || ( !placements_.empty() && occludedInstances( ray, tMin, tMax ) );
+}
+
+void BVH::fillHit( const Ray& ray, float t, std::uint32_t prim, Hit& hit ) const
+{
+	hit.t = t;
+	hit.prim = prim;
+	if ( prim < sphereCount_ )
+	{
+		const Sphere& sp = scene_->spheres()[prim];
+		hit.normal = unit_vector( ray.origin + ray.direction * t - sp.pos );
+		hit.matIndex = sp.matIndex;
+	}
+	else
+	{
+		// Та же нормаль, что дали бы ребра из makeTriangleEdges, бит в бит
+		const size_t i = prim - sphereCount_;
+		Vector3 e1, e2;
+		if ( !edges_.empty() )
+		{
+			e1 = edges_[i].e1;
+			e2 = edges_[i].e2;
+		}
+		else
+		{
+			const std::uint32_t* idx = scene_->triangleIndices( i );
+			const Vector3& v0 = scene_->vertices()[idx[0]];
+			e1 = scene_->vertices()[idx[1]] - v0;
+			e2 = scene_->vertices()[idx[2]] - v0;
+		}
+		hit.normal = unit_vector( cross( e1, e2 ) );
+		hit.matIndex = scene_->triangleMaterial( prim - sphereCount_ );
+	}
+}
+
+bool BVH::intersectBruteForce( const Ray& ray, float tMin, float tMax, Hit& hit ) const
+{
+	// Бокс корня отсекает лучи мимо сцены одной проверкой, как при обходе
+	if ( nodes_.empty() )
+		return false;
+	const Vector3 invDir( 1.0f / ray.direction.x(), 1.0f / ray.direction.y(), 1.0f / ray.direction.z() );
+	if ( intersectAABB( nodes_[0].bounds, ray.origin, invDir, tMin, tMax ) == tMax )
+		return false;
+
+	// Номера сфер в SoA совпадают с номерами примитивов
+	const std::int32_t sphere = kernels().closestSphere( ray, scene_->sphereSoa(), tMin, tMax );
+	if ( sphere < 0 )
+		return false;
+	fillHit( ray, tMax, std::uint32_t( sphere ), hit );
+	return true;
+}
+
+bool BVH::intersectBinary( const Ray& ray, float tMin, float tMax, Hit& hit ) const
+{
+	if ( nodes_.empty() )
+		return false;
+
+	const Vector3 invDir( 1.0f / ray.direction.x(), 1.0f / ray.direction.y(), 1.0f / ray.direction.z() );
+	const float tFar = tMax;
+	std::uint32_t hitPrim = 0;
+
+	std::uint32_t stack[64];
+	int stackSize = 0;
+	std::uint32_t nodeIndex = 0;
+	if ( intersectAABB( nodes_[0].bounds, ray.origin, invDir, tMin, tMax ) == tMax )
+		return false;
+
+	while ( true )
+	{
+		const BVHNode& node = nodes_[nodeIndex];
+		if ( node.count > 0 )
+		{
+			for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+			{
+				const float t = intersectPrim( ray, prims_[i], tMin, tMax );
+				if ( t < tMax )
+				{
+					tMax = t;
+					hitPrim = prims_[i];
+				}
+			}
+		}
+		else
+		{
+			// Сначала обходим ближайшего ребенка, дальнего кладем в стек
+			std::uint32_t nearChild = node.first;
+			std::uint32_t farChild = node.first + 1;
+			float tNear = intersectAABB( nodes_[nearChild].bounds, ray.origin, invDir, tMin, tMax );
+			float tFarChild = intersectAABB( nodes_[farChild].bounds, ray.origin, invDir, tMin, tMax );
+			if ( tFarChild < tNear )
+			{
+				std::swap( nearChild, farChild );
+				std::swap( tNear, tFarChild );
+			}
+			if ( tNear < tMax )
+			{
+				if ( tFarChild < tMax )
+					stack[stackSize++] = farChild;
+				nodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		// Берем из стека, пропуская узлы дальше уже найденного попадания
+		bool found = false;
+		while ( stackSize > 0 )
+		{
+			nodeIndex = stack[--stackSize];
+			if ( intersectAABB( nodes_[nodeIndex].bounds, ray.origin, invDir, tMin, tMax ) < tMax )
+			{
+				found = true;
+				break;
+			}
+		}
+		if ( !found )
+			break;
+	}
+
+	if ( tMax == tFar )
+		return false;
+
+	fillHit( ray, tMax, hitPrim, hit );
+	return true;
+}
+
+bool BVH::occludedBinary( const Ray& ray, float tMin, float tMax ) const
+{
+	if ( nodes_.empty() )
+		return false;
+
+	// Порядок детей не важен: подходит любое попадание
+	const Vector3 invDir( 1.0f / ray.direction.x(), 1.0f / ray.direction.y(), 1.0f / ray.direction.z() );
+	std::uint32_t stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while ( stackSize > 0 )
+	{
+		const BVHNode& node = nodes_[stack[--stackSize]];
+		if ( intersectAABB( node.bounds, ray.origin, invDir, tMin, tMax ) == tMax )
+			continue;
+		if ( node.count == 0 )
+		{
+			stack[stackSize++] = node.first + 1;
+			stack[stackSize++] = node.first;
+			continue;
+		}
+		for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+		{
+			if ( intersectPrim( ray, prims_[i], tMin, tMax ) < tMax )
+				return true;
+		}
+	}
+	return false;
+}
+
+bool BVH::intersectInstances( const Ray& ray, float tMin, float tMax, Hit& hit ) const
+{
+	// TLAS обходится как бинарное дерево мира, в листьях - BLAS экземпляров
+	const Vector3 invDir( 1.0f / ray.direction.x(), 1.0f / ray.direction.y(), 1.0f / ray.direction.z() );
+	std::uint32_t hitPlacement = 0;
+	bool found = false;
+
+	std::uint32_t stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while ( stackSize > 0 )
+	{
+		const BVHNode& node = tlasNodes_[stack[--stackSize]];
+		if ( intersectAABB( node.bounds, ray.origin, invDir, tMin, tMax ) == tMax )
+			continue;
+		if ( node.count == 0 )
+		{
+			// Ближний ребенок кладется последним и снимается первым
+			const float tLeft = intersectAABB( tlasNodes_[node.first].bounds, ray.origin, invDir, tMin, tMax );
+			const float tRight = intersectAABB( tlasNodes_[node.first + 1].bounds, ray.origin, invDir, tMin, tMax );
+			stack[stackSize++] = tLeft < tRight ? node.first + 1 : node.first;
+			stack[stackSize++] = tLeft < tRight ? node.first : node.first + 1;
+			continue;
+		}
+		for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+		{
+			const Placement& p = placements_[tlasPrims_[i]];
+			const Ray local{ transformPoint( p.toObject, ray.origin ), transformVector( p.toObject, ray.direction ) };
+			if ( blas_[p.blas].intersect( local, tMin, tMax, hit ) )
+			{
+				tMax = hit.t;
+				hitPlacement = tlasPrims_[i];
+				found = true;
+			}
+		}
+	}
+	if ( !found )
+		return false;
+
+	// Нормаль BLAS - в системе меша
+	const Placement& p = placements_[hitPlacement];
+	hit.normal = unit_vector( transformNormal( p.toObject, hit.normal ) );
+	if ( p.matIndex >= 0 )
+		hit.matIndex = p.matIndex;
+	return true;
+}
+
+bool BVH::occludedInstances( const Ray& ray, float tMin, float tMax ) const
+{
+	const Vector3 invDir( 1.0f / ray.direction.x(), 1.0f / ray.direction.y(), 1.0f / ray.direction.z() );
+	std::uint32_t stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while ( stackSize > 0 )
+	{
+		const BVHNode& node = tlasNodes_[stack[--stackSize]];
+		if ( intersectAABB( node.bounds, ray.origin, invDir, tMin, tMax ) == tMax )
+			continue;
+		if ( node.count == 0 )
+		{
+			stack[stackSize++] = node.first + 1;
+			stack[stackSize++] = node.first;
+			continue;
+		}
+		for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+		{
+			const Placement& p = placements_[tlasPrims_[i]];
+			const Ray local{ transformPoint( p.toObject, ray.origin ), transformVector( p.toObject, ray.direction ) };
+			if ( blas_[p.blas].occluded( local, tMin, tMax ) )
+				return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+#include "../src/scene.h"
+
+class ThreadPool;
+
+enum class BvhBuilder
+{
+	Sah,  // биннинг SAH, верхние уровни с параллельными проходами, поддеревья по потокам
+	Lbvh, // сортировка по кодам Мортона: быстрее строится, медленнее трассируется
+};
+
+bool parseBvhBuilder( const std::string& name, BvhBuilder& builder );
+const char* bvhBuilderName( BvhBuilder builder );
+
+struct BVHNode
+{
+	AABB bounds;
+	std::uint32_t first; // лист: первый примитив в prims_, узел: индекс левого ребенка (правый = first + 1)
+	std::uint32_t count; // 0 для внутренних узлов
+};
+
+// Узел широкой BVH из N детей (4 или 8). Границы детей лежат по компонентам (SoA),
+// чтобы проверить всех детей одной SIMD-инструкцией на компоненту. Размер узла кратен 64 байтам.
+// Дети - листья полного бинарного дерева глубины log2(N), axes - оси разбиения его внутренних
+// вершин в порядке кучи: по знакам направления луча сразу известен порядок обхода (QBVH).
+// Бит в axes широкого узла: левый ребенок бинарного узла лежит дальше по оси, чем правый
+const std::uint8_t WIDE_AXIS_FLIP = 4;
+
+template<int N>
+struct alignas( 64 ) WideNode
+{
+	static constexpr std::uint32_t EMPTY = 0xFFFFFFFFu;
+	static constexpr int LEVELS = N == 4 ? 2 : 3; // глубина бинарного поддерева
+
+	float minX[N], minY[N], minZ[N];
+	float maxX[N], maxY[N], maxZ[N];
+	std::uint32_t child[N]; // узел: индекс широкого узла, лист: первый примитив в prims_, пустой слот: EMPTY
+	std::uint16_t count[N]; // примитивов в листе, 0 - внутренний узел или пустой слот
+	std::uint8_t axes[N - 1];
+};
+
+// Порядок обхода детей широкого узла по знакам направления луча: на каждом уровне
+// бинарного поддерева сначала ребенок, ближний по оси разбиения
+struct WideOrder
+{
+	// Для байта axes узла: 1, если первым обходится правый ребенок
+	std::uint8_t rightFirst[8];
+
+	explicit WideOrder( const Vector3& direction )
+	{
+		for ( int b = 0; b < 8; ++b )
+		{
+			const int axis = b & 3;
+			const bool flip = ( b & WIDE_AXIS_FLIP ) != 0;
+			rightFirst[b] = axis < 3 && ( ( direction[axis] < 0.0f ) != flip ) ? 1 : 0;
+		}
+	}
+
+	// Слот ребенка, который обходится order-м по счету
+	template<int N>
+	int slot( const WideNode<N>& node, int order ) const
+	{
+		int heap = 0;
+		int slot = 0;
+		for ( int level = WideNode<N>::LEVELS - 1; level >= 0; --level )
+		{
+			const int b = ( ( order >> level ) & 1 ) ^ rightFirst[node.axes[heap]];
+			slot = slot * 2 + b;
+			heap = 2 * heap + 1 + b;
+		}
+		return slot;
+	}
+};
+
+struct Hit
+{
+	float t;
+	std::uint32_t prim;
+	Vector3 normal;
+	int matIndex;
+};
+
+// Глубина ограничена размером стека обхода в BVH::intersect (64 узла)
+const std::uint32_t BVH_MAX_DEPTH = 60;
+
+// Если в BVH только сферы и их не больше порога, intersect не обходит дерево, а перебирает
+// все SIMD-ядром по SoA массивам сцены. Треугольники по одному перебор не окупают даже
+// в десятке, с ними дерево обходится всегда. Порог подобран по --bench bruteforce.
+const std::uint32_t BVH_BRUTE_FORCE_LIMIT = 32;
+
+// BVH по конечным примитивам сцены (сферы и треугольники мешей).
+// Треугольники читаются прямо из индексных буферов сцены, нормаль считается только для ближайшего
+// попадания. С setEdgeCache(true) вершина и ребра каждого треугольника готовятся один раз:
+// обход быстрее, но это 36 байт на треугольник (48 с выровненным Vector3) поверх 12 байт индексов.
+// Бесконечные плоскости в иерархию не входят и проверяются отдельно.
+// Экземпляры мешей (Scene::instances) - второй уровень: на каждый меш с экземплярами своя BVH
+// в системе меша (BLAS), над мировыми боксами экземпляров - бинарное дерево (TLAS). Луч
+// переводится в систему меша обратной матрицей без нормировки, t при этом не меняется, и попадания
+// в экземпляры сравниваются с попаданиями в мир напрямую. Память растет с числом уникальных мешей.
+class BVH
+{
+public:
+	// Строит дерево и экземпляры в пуле потоков. Форма дерева от числа потоков не зависит,
+	// может поменяться только порядок примитивов внутри листьев.
+	void build( const Scene& scene, BvhBuilder builder, ThreadPool& pool );
+	// Только BLAS и TLAS экземпляров, для дерева из кеша
+	void buildInstances( const Scene& scene, BvhBuilder builder, ThreadPool& pool );
+
+	// Сериализация для бинарного кеша сцены. load использует данные на месте, без копирования,
+	// память должна жить дольше BVH. Возвращает false, если данные не подходят к сцене или
+	// дерево повреждено: индексы вне массивов, циклы, глубина больше BVH_MAX_DEPTH.
+	// Экземпляры в кеш не пишутся: BLAS строятся только по уникальным мешам, это быстро.
+	void serialize( std::vector<char>& out ) const;
+	bool load( const Scene& scene, ArrayView<char> data );
+
+	// Сворачивает бинарное дерево и BLAS в узлы шириной 4 или 8, intersect дальше обходит их.
+	// 2 - обратно к бинарному обходу. Листья и порядок prims_ общие с бинарным деревом.
+	// TLAS остается бинарным.
+	void collapse( int width );
+	int width() const { return width_; }
+
+	// Порог полного перебора, 0 - всегда обходить дерево
+	void setBruteForceLimit( std::uint32_t limit ) { bruteForceLimit_ = limit; }
+	bool bruteForce() const { return !prims_.empty() && prims_.size() == sphereCount_ && prims_.size() <= bruteForceLimit_; }
+
+	// Ближайшее пересечение в (tMin, tMax). Нормаль и материал заполняются только для найденного попадания.
+	bool intersect( const Ray& ray, float tMin, float tMax, Hit& hit ) const;
+	// То же для PACKET_SIZE лучей одним обходом широкого дерева, выгодно для почти параллельных лучей.
+	// Бит i результата - попадание луча i, hits[i] заполняется только для него.
+	// Бинарное дерево и экземпляры проверяют лучи по одному.
+	unsigned intersectPacket( const Ray* rays, float tMin, float tMax, Hit* hits ) const;
+	// Есть ли хоть одно попадание в (tMin, tMax): обход до первого найденного примитива, без
+	// нормали и материала. Для теневых лучей и других проверок видимости.
+	bool occluded( const Ray& ray, float tMin, float tMax ) const;
+	// То же для PACKET_SIZE лучей со своими tMax[i], проверяются лучи из active.
+	// Бит i результата - луч i перекрыт. Бинарное дерево и экземпляры проверяют лучи по одному.
+	unsigned occludedPacket( const Ray* rays, float tMin, const float* tMax, unsigned active ) const;
+
+	size_t nodeCount() const { return nodes_.size(); }
+	size_t wideNodeCount() const { return width_ == 4 ? wide4_.size() : width_ == 8 ? wide8_.size() : 0; }
+	size_t primCount() const { return prims_.size(); }
+	size_t blasCount() const { return blas_.size(); }
+	// Можно звать и до, и после build/load; действует на все BLAS
+	void setEdgeCache( bool enabled );
+	bool edgeCache() const { return edgeCache_; }
+	// Ожидаемая SAH стоимость луча, попавшего в корень: чем меньше, тем лучше дерево
+	float sahCost() const;
+	size_t memoryBytes() const
+	{
+		size_t bytes = nodes_.size() * sizeof( BVHNode ) + prims_.size() * sizeof( std::uint32_t ) +
+			edgeStorage_.size() * sizeof( TriangleEdges ) +
+			wide4_.size() * sizeof( WideNode<4> ) + wide8_.size() * sizeof( WideNode<8> ) +
+			placements_.size() * sizeof( Placement ) + tlasNodes_.size() * sizeof( BVHNode ) + tlasPrims_.size() * sizeof( std::uint32_t );
+		for ( const BVH& blas : blas_ )
+			bytes += blas.memoryBytes();
+		return bytes;
+	}
+
+private:
+	// Экземпляр для обхода: матрица из мира в систему меша
+	struct Placement
+	{
+		float toObject[12];
+		std::uint32_t blas;
+		int matIndex; // -1 - материал треугольника меша
+	};
+
+	// Ребра всех треугольников сцены, включая меши экземпляров, или пусто без edgeCache_
+	void buildTriangles( const Scene& scene );
+	// Дерево над примитивами [firstPrim, firstPrim + primCount) в нумерации prims_
+	void buildPrims( const Scene& scene, std::uint32_t firstPrim, std::uint32_t primCount, BvhBuilder builder, ThreadPool& pool );
+	bool intersectInstances( const Ray& ray, float tMin, float tMax, Hit& hit ) const;
+	bool occludedInstances( const Ray& ray, float tMin, float tMax ) const;
+
+	// Для ядер: nullptr, если кеша ребер нет
+	const TriangleEdges* edgeData() const { return edges_.empty() ? nullptr : edges_.data(); }
+	float intersectPrim( const Ray& ray, std::uint32_t prim, float tMin, float tMax ) const;
+	void fillHit( const Ray& ray, float t, std::uint32_t prim, Hit& hit ) const;
+
+	bool intersectBruteForce( const Ray& ray, float tMin, float tMax, Hit& hit ) const;
+	bool intersectBinary( const Ray& ray, float tMin, float tMax, Hit& hit ) const;
+	bool occludedBinary( const Ray& ray, float tMin, float tMax ) const;
+	template<int N>
+	void collapseTo( std::vector<WideNode<N>>& wide ) const;
+	template<int N>
+	bool intersectWide( const std::vector<WideNode<N>>& wide, const Ray& ray, float tMin, float tMax, Hit& hit ) const;
+	unsigned intersectPacketBruteForce( const Ray* rays, float tMin, float tMax, Hit* hits ) const;
+	template<int N>
+	unsigned intersectPacketWide( const std::vector<WideNode<N>>& wide, const Ray* rays, float tMin, float tMax, Hit* hits ) const;
+	template<int N>
+	bool occludedWide( const std::vector<WideNode<N>>& wide, const Ray& ray, float tMin, float tMax ) const;
+	template<int N>
+	unsigned occludedPacketWide( const std::vector<WideNode<N>>& wide, const Ray* rays, float tMin, const float* tMax, unsigned active ) const;
+
+private:
+	const Scene* scene_ = nullptr;
+	std::uint32_t sphereCount_ = 0;
+	// Виды смотрят либо в векторы ниже (build), либо в кеш сцены (load)
+	ArrayView<BVHNode> nodes_;
+	// Индексы примитивов: [0, sphereCount_) - сферы, дальше треугольники мешей сцены
+	ArrayView<std::uint32_t> prims_;
+
+	// По номеру треугольника сцены (prim - sphereCount_), BLAS смотрят в массив мира.
+	// Пусто - ребра собираются из индексов при каждой проверке.
+	ArrayView<TriangleEdges> edges_;
+	bool edgeCache_ = false;
+
+	std::vector<BVHNode> nodeStorage_;
+	std::vector<std::uint32_t> primStorage_;
+	std::vector<TriangleEdges> edgeStorage_;
+
+	std::uint32_t bruteForceLimit_ = BVH_BRUTE_FORCE_LIMIT;
+	int width_ = 2;
+	std::vector<WideNode<4>> wide4_;
+	std::vector<WideNode<8>> wide8_;
+
+	// Экземпляры: BLAS по мешам, в листьях TLAS - номера placements_
+	std::vector<BVH> blas_;
+	std::vector<Placement> placements_;
+	std::vector<BVHNode> tlasNodes_;
+	std::vector<std::uint32_t> tlasPrims_;
+};
@@ -0,0 +1,779 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "thread_pool.h"
+
+namespace {
+	const int BIN_COUNT = 16;
+	const std::uint32_t MAX_LEAF_SIZE = 8;
+	const std::uint32_t LBVH_LEAF_SIZE = 4;
+	const float TRAVERSAL_COST = 1.0f;
+	const float INTERSECT_COST = 1.0f;
+	// Поддеревьев на поток: крупные раздаются первыми, мелкие выравнивают нагрузку в конце
+	const unsigned SUBTREES_PER_THREAD = 8;
+	const std::uint32_t MIN_SUBTREE_SIZE = 1u << 12;
+	// Примитивов на задачу пула в параллельных проходах
+	const std::uint32_t CHUNK_SIZE = 1u << 14;
+	const int MORTON_AXIS_BITS = 10;
+	const int RADIX_BITS = 10;
+	const std::uint32_t RADIX_BUCKETS = 1u << RADIX_BITS;
+
+	struct PrimInfo
+	{
+		AABB bounds;
+		Vector3 centroid;
+	};
+
+	struct Bin
+	{
+		AABB bounds;
+		std::uint32_t count = 0;
+	};
+
+	// Бины всех трех осей: частичные наборы кусков складываются в один
+	struct BinGrid
+	{
+		Bin bins[3][BIN_COUNT];
+
+		void merge( const BinGrid& other )
+		{
+			for ( int axis = 0; axis < 3; ++axis )
+			{
+				for ( int i = 0; i < BIN_COUNT; ++i )
+				{
+					bins[axis][i].bounds.grow( other.bins[axis][i].bounds );
+					bins[axis][i].count += other.bins[axis][i].count;
+				}
+			}
+		}
+	};
+
+	struct RangeBounds
+	{
+		AABB bounds;
+		AABB centroids;
+
+		void merge( const RangeBounds& other )
+		{
+			bounds.grow( other.bounds );
+			centroids.grow( other.centroids );
+		}
+	};
+
+	struct BuildTask
+	{
+		std::uint32_t node;
+		std::uint32_t begin;
+		std::uint32_t end;
+		std::uint32_t depth;
+	};
+
+	// Поддерево, которое один поток строит в своем массиве узлов с корнем в nodes[0]
+	struct Subtree
+	{
+		BuildTask task;
+		std::vector<BVHNode> nodes;
+	};
+
+	struct Split
+	{
+		int axis = -1;
+		int bin = 0;
+		float cost = std::numeric_limits<float>::max();
+		float cmin = 0.0f;
+		float scale = 0.0f;
+
+		bool left( const PrimInfo& p ) const
+		{
+			return std::min( BIN_COUNT - 1, (int)( ( p.centroid[axis] - cmin ) * scale ) ) < bin;
+		}
+	};
+
+	// Узлы не больше этого строятся целиком одним потоком, крупнее - по уровням с параллельными проходами.
+	// В одном потоке параллельные проходы только мешают, и все дерево строится сразу.
+	std::uint32_t subtreeSize( std::uint32_t primCount, unsigned threads )
+	{
+		if ( threads <= 1 )
+			return primCount;
+		return std::max( MIN_SUBTREE_SIZE, primCount / ( threads * SUBTREES_PER_THREAD ) );
+	}
+
+	size_t chunkCount( std::uint32_t begin, std::uint32_t end )
+	{
+		return ( size_t( end - begin ) + CHUNK_SIZE - 1 ) / CHUNK_SIZE;
+	}
+
+	std::uint32_t chunkEnd( std::uint32_t begin, std::uint32_t end, size_t chunk )
+	{
+		return (std::uint32_t)std::min<size_t>( end, begin + ( chunk + 1 ) * CHUNK_SIZE );
+	}
+
+	RangeBounds rangeBounds( const std::vector<PrimInfo>& info, const std::uint32_t* prims, std::uint32_t begin, std::uint32_t end )
+	{
+		RangeBounds r;
+		for ( std::uint32_t i = begin; i < end; ++i )
+		{
+			r.bounds.grow( info[prims[i]].bounds );
+			r.centroids.grow( info[prims[i]].centroid );
+		}
+		return r;
+	}
+
+	// Все три оси за один проход: на верхних уровнях это один проход по памяти вместо трех
+	void binPrims( const std::vector<PrimInfo>& info, const std::uint32_t* prims, std::uint32_t begin, std::uint32_t end,
+		const AABB& centroidBounds, BinGrid& grid )
+	{
+		float cmin[3];
+		float scale[3];
+		for ( int axis = 0; axis < 3; ++axis )
+		{
+			cmin[axis] = centroidBounds.min[axis];
+			const float extent = centroidBounds.max[axis] - cmin[axis];
+			scale[axis] = extent > 0.0f ? BIN_COUNT / extent : 0.0f;
+		}
+		for ( std::uint32_t i = begin; i < end; ++i )
+		{
+			const PrimInfo& p = info[prims[i]];
+			for ( int axis = 0; axis < 3; ++axis )
+			{
+				const int b = std::min( BIN_COUNT - 1, (int)( ( p.centroid[axis] - cmin[axis] ) * scale[axis] ) );
+				grid.bins[axis][b].count++;
+				grid.bins[axis][b].bounds.grow( p.bounds );
+			}
+		}
+	}
+
+	// Плоскость между бинами оси с минимальной SAH стоимостью, если она лучше best
+	void sweepBins( const Bin* bins, int axis, float cmin, float scale, Split& best )
+	{
+		float leftArea[BIN_COUNT - 1];
+		std::uint32_t leftCount[BIN_COUNT - 1];
+		AABB acc;
+		std::uint32_t count = 0;
+		for ( int i = 0; i < BIN_COUNT - 1; ++i )
+		{
+			acc.grow( bins[i].bounds );
+			count += bins[i].count;
+			leftArea[i] = acc.area();
+			leftCount[i] = count;
+		}
+
+		acc = AABB();
+		count = 0;
+		for ( int i = BIN_COUNT - 1; i > 0; --i )
+		{
+			acc.grow( bins[i].bounds );
+			count += bins[i].count;
+			const float cost = leftArea[i - 1] * leftCount[i - 1] + acc.area() * count;
+			if ( leftCount[i - 1] > 0 && count > 0 && cost < best.cost )
+			{
+				best.cost = cost;
+				best.axis = axis;
+				best.bin = i;
+				best.cmin = cmin;
+				best.scale = scale;
+			}
+		}
+	}
+
+	Split chooseSplit( const BinGrid& grid, const AABB& centroidBounds )
+	{
+		Split best;
+		for ( int axis = 0; axis < 3; ++axis )
+		{
+			const float cmin = centroidBounds.min[axis];
+			const float extent = centroidBounds.max[axis] - cmin;
+			if ( extent > 0.0f )
+				sweepBins( grid.bins[axis], axis, cmin, BIN_COUNT / extent, best );
+		}
+		return best;
+	}
+
+	bool makeLeaf( const Split& split, const AABB& bounds, std::uint32_t count )
+	{
+		const float leafCost = INTERSECT_COST * count;
+		const float splitCost = TRAVERSAL_COST + INTERSECT_COST * split.cost / bounds.area();
+		return split.axis < 0 || ( splitCost >= leafCost && count <= MAX_LEAF_SIZE );
+	}
+
+	// Биннинг SAH одним потоком, начиная с уже добавленного узла root.node
+	void buildSahSubtree( const std::vector<PrimInfo>& info, std::uint32_t* prims, std::vector<BVHNode>& nodes, const BuildTask& root )
+	{
+		std::vector<BuildTask> stack;
+		stack.push_back( root );
+
+		while ( !stack.empty() )
+		{
+			const BuildTask task = stack.back();
+			stack.pop_back();
+
+			RangeBounds r;
+			for ( std::uint32_t i = task.begin; i < task.end; ++i )
+			{
+				r.bounds.grow( info[prims[i]].bounds );
+				r.centroids.grow( info[prims[i]].centroid );
+			}
+			BVHNode& node = nodes[task.node];
+			node.bounds = r.bounds;
+			node.first = task.begin;
+			node.count = task.end - task.begin;
+			if ( node.count <= 1 || task.depth >= BVH_MAX_DEPTH )
+				continue;
+
+			Split split;
+			for ( int axis = 0; axis < 3; ++axis )
+			{
+				const float cmin = r.centroids.min[axis];
+				const float extent = r.centroids.max[axis] - cmin;
+				if ( extent <= 0.0f )
+					continue;
+
+				Bin bins[BIN_COUNT];
+				const float scale = BIN_COUNT / extent;
+				for ( std::uint32_t i = task.begin; i < task.end; ++i )
+				{
+					const PrimInfo& p = info[prims[i]];
+					const int b = std::min( BIN_COUNT - 1, (int)( ( p.centroid[axis] - cmin ) * scale ) );
+					bins[b].count++;
+					bins[b].bounds.grow( p.bounds );
+				}
+				sweepBins( bins, axis, cmin, scale, split );
+			}
+			if ( makeLeaf( split, r.bounds, node.count ) )
+				continue;
+
+			const std::uint32_t* mid = std::partition( prims + task.begin, prims + task.end,
+				[&info, split]( std::uint32_t prim ) { return split.left( info[prim] ); } );
+			const std::uint32_t middle = (std::uint32_t)( mid - prims );
+
+			const std::uint32_t left = (std::uint32_t)nodes.size();
+			nodes[task.node].first = left;
+			nodes[task.node].count = 0;
+			nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+			nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+
+			stack.push_back( { left + 1, middle, task.end, task.depth + 1 } );
+			stack.push_back( { left, task.begin, middle, task.depth + 1 } );
+		}
+	}
+
+	// Поддеревья дописываются в конец nodes, индексы их детей сдвигаются на новое место
+	void appendSubtrees( std::vector<BVHNode>& nodes, const std::vector<Subtree>& subtrees )
+	{
+		size_t total = nodes.size();
+		for ( const Subtree& s : subtrees )
+			total += s.nodes.size() - 1;
+		nodes.reserve( total );
+
+		for ( const Subtree& s : subtrees )
+		{
+			// Локальный узел i >= 1 ложится в base + i
+			const std::uint32_t base = (std::uint32_t)nodes.size() - 1;
+			for ( size_t i = 0; i < s.nodes.size(); ++i )
+			{
+				BVHNode node = s.nodes[i];
+				if ( node.count == 0 )
+					node.first += base;
+				if ( i == 0 )
+					nodes[s.task.node] = node;
+				else
+					nodes.push_back( node );
+			}
+		}
+	}
+
+	// Крупные поддеревья раздаются первыми, чтобы в конце потоки не ждали одно большое
+	void sortSubtrees( std::vector<Subtree>& subtrees )
+	{
+		std::sort( subtrees.begin(), subtrees.end(), []( const Subtree& a, const Subtree& b ) {
+			const std::uint32_t sizeA = a.task.end - a.task.begin;
+			const std::uint32_t sizeB = b.task.end - b.task.begin;
+			return sizeA != sizeB ? sizeA > sizeB : a.task.node < b.task.node;
+		} );
+	}
+
+	// Устойчивое разбиение диапазона по кускам: левые примитивы каждого куска ложатся подряд
+	// после левых из предыдущих кусков, правые - так же после всех левых. Сторона примитива
+	// запоминается в sides, чтобы не читать info вразброс второй раз.
+	std::uint32_t partitionParallel( const std::vector<PrimInfo>& info, std::vector<std::uint32_t>& prims, std::vector<std::uint32_t>& scratch,
+		std::vector<std::uint8_t>& sides, const BuildTask& task, const Split& split, ThreadPool& pool )
+	{
+		const size_t chunks = chunkCount( task.begin, task.end );
+		std::vector<std::uint32_t> leftCounts( chunks );
+		pool.parallelFor( chunks, [&, split]( size_t c ) {
+			std::uint32_t count = 0;
+			for ( std::uint32_t i = task.begin + std::uint32_t( c * CHUNK_SIZE ); i < chunkEnd( task.begin, task.end, c ); ++i )
+			{
+				sides[i] = split.left( info[prims[i]] ) ? 1 : 0;
+				count += sides[i];
+			}
+			leftCounts[c] = count;
+		} );
+
+		std::uint32_t totalLeft = 0;
+		for ( std::uint32_t count : leftCounts )
+			totalLeft += count;
+
+		std::vector<std::uint32_t> leftOffsets( chunks );
+		std::vector<std::uint32_t> rightOffsets( chunks );
+		std::uint32_t left = task.begin;
+		std::uint32_t right = task.begin + totalLeft;
+		for ( size_t c = 0; c < chunks; ++c )
+		{
+			const std::uint32_t chunkBegin = task.begin + std::uint32_t( c * CHUNK_SIZE );
+			leftOffsets[c] = left;
+			rightOffsets[c] = right;
+			left += leftCounts[c];
+			right += chunkEnd( task.begin, task.end, c ) - chunkBegin - leftCounts[c];
+		}
+
+		pool.parallelFor( chunks, [&]( size_t c ) {
+			std::uint32_t l = leftOffsets[c];
+			std::uint32_t r = rightOffsets[c];
+			for ( std::uint32_t i = task.begin + std::uint32_t( c * CHUNK_SIZE ); i < chunkEnd( task.begin, task.end, c ); ++i )
+			{
+				if ( sides[i] )
+					scratch[l++] = prims[i];
+				else
+					scratch[r++] = prims[i];
+			}
+		} );
+		pool.parallelFor( chunks, [&]( size_t c ) {
+			const std::uint32_t chunkBegin = task.begin + std::uint32_t( c * CHUNK_SIZE );
+			std::copy( scratch.begin() + chunkBegin, scratch.begin() + chunkEnd( task.begin, task.end, c ), prims.begin() + chunkBegin );
+		} );
+		return task.begin + totalLeft;
+	}
+
+	// Верхние уровни по одному узлу, но границы, биннинг и разбиение делятся на куски между потоками.
+	// Небольшие узлы откладываются и строятся потом параллельно целыми поддеревьями.
+	void buildSah( const std::vector<PrimInfo>& info, std::vector<std::uint32_t>& prims, std::vector<BVHNode>& nodes, ThreadPool& pool )
+	{
+		const std::uint32_t maxSubtree = subtreeSize( (std::uint32_t)prims.size(), pool.size() );
+		if ( maxSubtree >= prims.size() )
+		{
+			buildSahSubtree( info, prims.data(), nodes, { 0, 0, (std::uint32_t)prims.size(), 0 } );
+			return;
+		}
+		std::vector<Subtree> subtrees;
+		std::vector<std::uint32_t> scratch;
+		std::vector<std::uint8_t> sides;
+		std::vector<BuildTask> level;
+		level.push_back( { 0, 0, (std::uint32_t)prims.size(), 0 } );
+		while ( !level.empty() )
+		{
+			std::vector<BuildTask> next;
+			for ( const BuildTask& task : level )
+			{
+				if ( task.end - task.begin <= maxSubtree )
+				{
+					subtrees.push_back( { task, {} } );
+					continue;
+				}
+
+				const size_t chunks = chunkCount( task.begin, task.end );
+				std::vector<RangeBounds> partialBounds( chunks );
+				pool.parallelFor( chunks, [&]( size_t c ) {
+					partialBounds[c] = rangeBounds( info, prims.data(), task.begin + std::uint32_t( c * CHUNK_SIZE ), chunkEnd( task.begin, task.end, c ) );
+				} );
+				RangeBounds r;
+				for ( const RangeBounds& p : partialBounds )
+					r.merge( p );
+
+				BVHNode& node = nodes[task.node];
+				node.bounds = r.bounds;
+				node.first = task.begin;
+				node.count = task.end - task.begin;
+				if ( task.depth >= BVH_MAX_DEPTH )
+					continue;
+
+				std::vector<BinGrid> partialBins( chunks );
+				pool.parallelFor( chunks, [&]( size_t c ) {
+					binPrims( info, prims.data(), task.begin + std::uint32_t( c * CHUNK_SIZE ), chunkEnd( task.begin, task.end, c ), r.centroids, partialBins[c] );
+				} );
+				BinGrid grid;
+				for ( const BinGrid& p : partialBins )
+					grid.merge( p );
+				const Split split = chooseSplit( grid, r.centroids );
+				if ( makeLeaf( split, r.bounds, node.count ) )
+					continue;
+
+				scratch.resize( prims.size() );
+				sides.resize( prims.size() );
+				const std::uint32_t middle = partitionParallel( info, prims, scratch, sides, task, split, pool );
+
+				const std::uint32_t left = (std::uint32_t)nodes.size();
+				nodes[task.node].first = left;
+				nodes[task.node].count = 0;
+				nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+				nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+				next.push_back( { left, task.begin, middle, task.depth + 1 } );
+				next.push_back( { left + 1, middle, task.end, task.depth + 1 } );
+			}
+			level.swap( next );
+		}
+
+		sortSubtrees( subtrees );
+		pool.parallelFor( subtrees.size(), [&]( size_t i ) {
+			Subtree& s = subtrees[i];
+			s.nodes.reserve( 2 * size_t( s.task.end - s.task.begin ) );
+			s.nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+			buildSahSubtree( info, prims.data(), s.nodes, { 0, s.task.begin, s.task.end, s.task.depth } );
+		} );
+		appendSubtrees( nodes, subtrees );
+	}
+
+	// 10 младших бит v, разведенные через два нуля
+	std::uint32_t expandBits( std::uint32_t v )
+	{
+		v = ( v * 0x00010001u ) & 0xFF0000FFu;
+		v = ( v * 0x00000101u ) & 0x0F00F00Fu;
+		v = ( v * 0x00000011u ) & 0xC30C30C3u;
+		v = ( v * 0x00000005u ) & 0x49249249u;
+		return v;
+	}
+
+	// 30-битный код Мортона точки, отнесенной к боксу центроидов
+	std::uint32_t mortonCode( const Vector3& p, const AABB& bounds )
+	{
+		const float cells = float( 1 << MORTON_AXIS_BITS );
+		std::uint32_t code = 0;
+		for ( int axis = 0; axis < 3; ++axis )
+		{
+			const float extent = bounds.max[axis] - bounds.min[axis];
+			const float t = extent > 0.0f ? ( p[axis] - bounds.min[axis] ) / extent : 0.0f;
+			const std::uint32_t cell = (std::uint32_t)std::min( std::max( t * cells, 0.0f ), cells - 1.0f );
+			code |= expandBits( cell ) << ( 2 - axis );
+		}
+		return code;
+	}
+
+	// LSD radix sort ключей (код << 32 | примитив) по коду. Гистограммы и раскладка - по кускам
+	// в пуле; сортировка устойчивая, порядок одинаковых кодов - по номеру примитива.
+	void sortMorton( std::vector<std::uint64_t>& keys, ThreadPool& pool )
+	{
+		const std::uint32_t count = (std::uint32_t)keys.size();
+		const size_t chunks = chunkCount( 0, count );
+		std::vector<std::uint64_t> scratch( count );
+		std::vector<std::uint32_t> offsets( chunks * RADIX_BUCKETS );
+		for ( int shift = 32; shift < 32 + 3 * MORTON_AXIS_BITS; shift += RADIX_BITS )
+		{
+			pool.parallelFor( chunks, [&]( size_t c ) {
+				std::uint32_t* histogram = &offsets[c * RADIX_BUCKETS];
+				std::fill( histogram, histogram + RADIX_BUCKETS, 0u );
+				for ( std::uint32_t i = std::uint32_t( c * CHUNK_SIZE ); i < chunkEnd( 0, count, c ); ++i )
+					histogram[( keys[i] >> shift ) & ( RADIX_BUCKETS - 1 )]++;
+			} );
+
+			std::uint32_t sum = 0;
+			for ( std::uint32_t b = 0; b < RADIX_BUCKETS; ++b )
+			{
+				for ( size_t c = 0; c < chunks; ++c )
+				{
+					const std::uint32_t n = offsets[c * RADIX_BUCKETS + b];
+					offsets[c * RADIX_BUCKETS + b] = sum;
+					sum += n;
+				}
+			}
+
+			pool.parallelFor( chunks, [&]( size_t c ) {
+				std::uint32_t* offset = &offsets[c * RADIX_BUCKETS];
+				for ( std::uint32_t i = std::uint32_t( c * CHUNK_SIZE ); i < chunkEnd( 0, count, c ); ++i )
+					scratch[offset[( keys[i] >> shift ) & ( RADIX_BUCKETS - 1 )]++] = keys[i];
+			} );
+			keys.swap( scratch );
+		}
+	}
+
+	// Граница между половинами диапазона отсортированных кодов: по старшему различающемуся биту
+	// (Karras 2012), а если коды все одинаковые - посередине
+	std::uint32_t mortonSplit( const std::vector<std::uint64_t>& keys, std::uint32_t begin, std::uint32_t end )
+	{
+		const std::uint32_t first = std::uint32_t( keys[begin] >> 32 );
+		const std::uint32_t last = std::uint32_t( keys[end - 1] >> 32 );
+		if ( first == last )
+			return ( begin + end ) / 2;
+
+		int bit = 31;
+		while ( ( ( first ^ last ) >> bit ) == 0 )
+			--bit;
+		const auto mid = std::partition_point( keys.begin() + begin, keys.begin() + end,
+			[bit]( std::uint64_t key ) { return ( ( key >> ( 32 + bit ) ) & 1 ) == 0; } );
+		return (std::uint32_t)( mid - keys.begin() );
+	}
+
+	// Поддерево LBVH в порядке обхода в глубину, границы собираются снизу вверх
+	AABB buildLbvhSubtree( const std::vector<PrimInfo>& info, const std::vector<std::uint64_t>& keys, std::vector<BVHNode>& nodes,
+		std::uint32_t node, std::uint32_t begin, std::uint32_t end, std::uint32_t depth )
+	{
+		if ( end - begin <= LBVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH )
+		{
+			AABB bounds;
+			for ( std::uint32_t i = begin; i < end; ++i )
+				bounds.grow( info[std::uint32_t( keys[i] )].bounds );
+			nodes[node] = BVHNode{ bounds, begin, end - begin };
+			return bounds;
+		}
+
+		const std::uint32_t middle = mortonSplit( keys, begin, end );
+		const std::uint32_t left = (std::uint32_t)nodes.size();
+		nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+		nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+		AABB bounds = buildLbvhSubtree( info, keys, nodes, left, begin, middle, depth + 1 );
+		bounds.grow( buildLbvhSubtree( info, keys, nodes, left + 1, middle, end, depth + 1 ) );
+		nodes[node] = BVHNode{ bounds, left, 0 };
+		return bounds;
+	}
+
+	// LBVH: примитивы сортируются по кодам Мортона центроидов, дерево режет отсортированный
+	// массив по битам кодов без оценки SAH. Строится в разы быстрее, но обходится медленнее.
+	void buildLbvh( const std::vector<PrimInfo>& info, std::vector<std::uint32_t>& prims, std::vector<BVHNode>& nodes, ThreadPool& pool )
+	{
+		const std::uint32_t count = (std::uint32_t)prims.size();
+		const size_t chunks = chunkCount( 0, count );
+		std::vector<RangeBounds> partialBounds( chunks );
+		pool.parallelFor( chunks, [&]( size_t c ) {
+			partialBounds[c] = rangeBounds( info, prims.data(), std::uint32_t( c * CHUNK_SIZE ), chunkEnd( 0, count, c ) );
+		} );
+		RangeBounds r;
+		for ( const RangeBounds& p : partialBounds )
+			r.merge( p );
+
+		std::vector<std::uint64_t> keys( count );
+		pool.parallelFor( chunks, [&]( size_t c ) {
+			for ( std::uint32_t i = std::uint32_t( c * CHUNK_SIZE ); i < chunkEnd( 0, count, c ); ++i )
+				keys[i] = std::uint64_t( mortonCode( info[i].centroid, r.centroids ) ) << 32 | i;
+		} );
+		sortMorton( keys, pool );
+		pool.parallelFor( chunks, [&]( size_t c ) {
+			for ( std::uint32_t i = std::uint32_t( c * CHUNK_SIZE ); i < chunkEnd( 0, count, c ); ++i )
+				prims[i] = std::uint32_t( keys[i] );
+		} );
+
+		// Верх дерева режется одним потоком, это двоичный поиск на узел
+		const std::uint32_t maxSubtree = subtreeSize( count, pool.size() );
+		if ( maxSubtree >= count )
+		{
+			buildLbvhSubtree( info, keys, nodes, 0, 0, count, 0 );
+			return;
+		}
+		std::vector<Subtree> subtrees;
+		std::vector<BuildTask> stack;
+		stack.push_back( { 0, 0, count, 0 } );
+		while ( !stack.empty() )
+		{
+			const BuildTask task = stack.back();
+			stack.pop_back();
+			if ( task.end - task.begin <= maxSubtree || task.depth >= BVH_MAX_DEPTH )
+			{
+				subtrees.push_back( { task, {} } );
+				continue;
+			}
+			const std::uint32_t middle = mortonSplit( keys, task.begin, task.end );
+			const std::uint32_t left = (std::uint32_t)nodes.size();
+			nodes[task.node].first = left;
+			nodes[task.node].count = 0;
+			nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+			nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+			stack.push_back( { left + 1, middle, task.end, task.depth + 1 } );
+			stack.push_back( { left, task.begin, middle, task.depth + 1 } );
+		}
+		const size_t topCount = nodes.size();
+
+		sortSubtrees( subtrees );
+		pool.parallelFor( subtrees.size(), [&]( size_t i ) {
+			Subtree& s = subtrees[i];
+			s.nodes.reserve( 2 * size_t( s.task.end - s.task.begin ) / LBVH_LEAF_SIZE + 1 );
+			s.nodes.push_back( BVHNode{ AABB(), 0, 0 } );
+			buildLbvhSubtree( info, keys, s.nodes, 0, s.task.begin, s.task.end, s.task.depth );
+		} );
+		appendSubtrees( nodes, subtrees );
+
+		// Дети верхних узлов всегда правее родителя, поэтому границы собираются одним проходом справа налево
+		for ( size_t i = topCount; i-- > 0; )
+		{
+			BVHNode& node = nodes[i];
+			if ( node.count > 0 )
+				continue;
+			node.bounds = nodes[node.first].bounds;
+			node.bounds.grow( nodes[node.first + 1].bounds );
+		}
+	}
+
+	// Дерево над info, на входе prims - номера 0, 1, ... по порядку
+	void buildTree( const std::vector<PrimInfo>& info, BvhBuilder builder, ThreadPool& pool, std::vector<BVHNode>& nodes, std::vector<std::uint32_t>& prims )
+	{
+		nodes.clear();
+		if ( info.empty() )
+			return;
+		nodes.reserve( 2 * info.size() );
+		nodes.push_back( BVHNode{ AABB(), 0, (std::uint32_t)info.size() } );
+
+		if ( builder == BvhBuilder::Lbvh )
+			buildLbvh( info, prims, nodes, pool );
+		else
+			buildSah( info, prims, nodes, pool );
+	}
+
+	// Обратная к аффинной матрице 3x4: обратный блок 3x3 и перенос -inv * t
+	void invertAffine( const float* m, float* inv )
+	{
+		const float c00 = m[5] * m[10] - m[6] * m[9];
+		const float c01 = m[6] * m[8] - m[4] * m[10];
+		const float c02 = m[4] * m[9] - m[5] * m[8];
+		const float invDet = 1.0f / ( m[0] * c00 + m[1] * c01 + m[2] * c02 );
+		inv[0] = c00 * invDet;
+		inv[1] = ( m[2] * m[9] - m[1] * m[10] ) * invDet;
+		inv[2] = ( m[1] * m[6] - m[2] * m[5] ) * invDet;
+		inv[4] = c01 * invDet;
+		inv[5] = ( m[0] * m[10] - m[2] * m[8] ) * invDet;
+		inv[6] = ( m[2] * m[4] - m[0] * m[6] ) * invDet;
+		inv[8] = c02 * invDet;
+		inv[9] = ( m[1] * m[8] - m[0] * m[9] ) * invDet;
+		inv[10] = ( m[0] * m[5] - m[1] * m[4] ) * invDet;
+		for ( int r = 0; r < 3; ++r )
+			inv[r * 4 + 3] = -( inv[r * 4] * m[3] + inv[r * 4 + 1] * m[7] + inv[r * 4 + 2] * m[11] );
+	}
+}
+
+bool parseBvhBuilder( const std::string& name, BvhBuilder& builder )
+{
+	if ( name == "sah" )
+		builder = BvhBuilder::Sah;
+	else if ( name == "lbvh" )
+		builder = BvhBuilder::Lbvh;
+	else
+		return false;
+	return true;
+}
+
+const char* bvhBuilderName( BvhBuilder builder )
+{
+	return builder == BvhBuilder::Lbvh ? "lbvh" : "sah";
+}
+
+void BVH::build( const Scene& scene, BvhBuilder builder, ThreadPool& pool )
+{
+	scene_ = &scene;
+	sphereCount_ = (std::uint32_t)scene.spheres().size();
+	buildTriangles( scene );
+	buildPrims( scene, 0, sphereCount_ + (std::uint32_t)scene.triangleCount(), builder, pool );
+	buildInstances( scene, builder, pool );
+}
+
+void BVH::buildPrims( const Scene& scene, std::uint32_t firstPrim, std::uint32_t primCount, BvhBuilder builder, ThreadPool& pool )
+{
+	collapse( 2 );
+
+	// Построители нумеруют примитивы с нуля, сдвиг на firstPrim - после построения
+	std::vector<PrimInfo> info( primCount );
+	primStorage_.resize( primCount );
+	pool.parallelFor( chunkCount( 0, primCount ), [&]( size_t c ) {
+		for ( std::uint32_t i = std::uint32_t( c * CHUNK_SIZE ); i < chunkEnd( 0, primCount, c ); ++i )
+		{
+			const std::uint32_t prim = firstPrim + i;
+			AABB& b = info[i].bounds;
+			if ( prim < sphereCount_ )
+			{
+				const Sphere& sp = scene.spheres()[prim];
+				const Vector3 r( sp.radius, sp.radius, sp.radius );
+				b.grow( sp.pos - r );
+				b.grow( sp.pos + r );
+			}
+			else
+			{
+				const std::uint32_t* idx = scene.triangleIndices( prim - sphereCount_ );
+				b.grow( scene.vertices()[idx[0]] );
+				b.grow( scene.vertices()[idx[1]] );
+				b.grow( scene.vertices()[idx[2]] );
+			}
+			info[i].centroid = b.centroid();
+			primStorage_[i] = i;
+		}
+	} );
+
+	buildTree( info, builder, pool, nodeStorage_, primStorage_ );
+	if ( firstPrim > 0 )
+	{
+		for ( std::uint32_t& prim : primStorage_ )
+			prim += firstPrim;
+	}
+	nodes_ = nodeStorage_;
+	prims_ = primStorage_;
+}
+
+void BVH::buildInstances( const Scene& scene, BvhBuilder builder, ThreadPool& pool )
+{
+	blas_.clear();
+	placements_.clear();
+	tlasNodes_.clear();
+	tlasPrims_.clear();
+	if ( scene.instances().empty() )
+		return;
+
+	// BLAS на каждый меш с экземплярами. Размер вектора задается сразу: виды BLAS смотрят в их же векторы
+	const std::uint32_t NO_BLAS = 0xFFFFFFFFu;
+	std::vector<std::uint32_t> blasIndex( scene.meshes().size(), NO_BLAS );
+	std::uint32_t blasCount = 0;
+	for ( const Instance& inst : scene.instances() )
+	{
+		if ( blasIndex[inst.mesh] == NO_BLAS )
+			blasIndex[inst.mesh] = blasCount++;
+	}
+	blas_.resize( blasCount );
+
+	std::vector<PrimInfo> info;
+	for ( const Instance& inst : scene.instances() )
+	{
+		const std::uint32_t index = blasIndex[inst.mesh];
+		if ( blas_[index].scene_ == nullptr )
+		{
+			const Mesh& mesh = scene.meshes()[inst.mesh];
+			BVH& blas = blas_[index];
+			blas.scene_ = &scene;
+			blas.sphereCount_ = sphereCount_;
+			blas.edges_ = edges_;
+			blas.edgeCache_ = edgeCache_;
+			// Число треугольников меша может совпасть с числом сфер, а перебор SoA - только для сфер
+			blas.bruteForceLimit_ = 0;
+			blas.buildPrims( scene, sphereCount_ + mesh.firstTriangle, mesh.triangleCount, builder, pool );
+		}
+		const BVH& blas = blas_[index];
+		if ( blas.nodes_.empty() )
+			continue;
+
+		// Мировой бокс экземпляра - бокс восьми углов корня BLAS
+		const AABB& box = blas.nodes_[0].bounds;
+		PrimInfo p;
+		for ( int corner = 0; corner < 8; ++corner )
+		{
+			const Vector3 v( corner & 1 ? box.max.x() : box.min.x(), corner & 2 ? box.max.y() : box.min.y(), corner & 4 ? box.max.z() : box.min.z() );
+			p.bounds.grow( transformPoint( inst.transform, v ) );
+		}
+		p.centroid = p.bounds.centroid();
+		info.push_back( p );
+
+		Placement placement;
+		invertAffine( inst.transform, placement.toObject );
+		placement.blas = index;
+		placement.matIndex = inst.matIndex;
+		placements_.push_back( placement );
+	}
+
+	tlasPrims_.resize( info.size() );
+	for ( std::uint32_t i = 0; i < std::uint32_t( info.size() ); ++i )
+		tlasPrims_[i] = i;
+	buildTree( info, builder, pool, tlasNodes_, tlasPrims_ );
+}
+
+float BVH::sahCost() const
+{
+	if ( nodes_.empty() || nodes_[0].bounds.area() <= 0.0f )
+		return 0.0f;
+	double cost = 0.0;
+	for ( const BVHNode& node : nodes_ )
+		cost += node.bounds.area() * ( node.count > 0 ? INTERSECT_COST * node.count : TRAVERSAL_COST );
+	return float( cost / nodes_[0].bounds.area() );
+}
@@ -0,0 +1,268 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "kernels.h"
+
+namespace {
+	// Slab test пакета с каждым из N детей: бит ребенка в маске, если в его бокс попал хоть один луч,
+	// tNear - самый ближний вход среди попавших лучей.
+	// Ближнюю грань у каждого луча своя, поэтому min/max обеих граней. Порядок операндов подобран
+	// под NaN (0 * inf, луч в плоскости грани): такая грань не ограничивает отрезок, как в скалярном тесте.
+	template<int N>
+	int intersectChildren( const WideNode<N>& node, const RayPacket& r, const Float8& tMin, const Float8& tMax, float* tNear )
+	{
+		const Float8 inf( std::numeric_limits<float>::infinity() );
+		int mask = 0;
+		for ( int i = 0; i < N; ++i )
+		{
+			if ( node.child[i] == WideNode<N>::EMPTY )
+				continue;
+			const Float8 x0 = ( Float8( node.minX[i] ) - r.ox ) * r.ix;
+			const Float8 x1 = ( Float8( node.maxX[i] ) - r.ox ) * r.ix;
+			const Float8 y0 = ( Float8( node.minY[i] ) - r.oy ) * r.iy;
+			const Float8 y1 = ( Float8( node.maxY[i] ) - r.oy ) * r.iy;
+			const Float8 z0 = ( Float8( node.minZ[i] ) - r.oz ) * r.iz;
+			const Float8 z1 = ( Float8( node.maxZ[i] ) - r.oz ) * r.iz;
+			Float8 t0 = vmax( vmin( x1, x0 ), tMin );
+			t0 = vmax( vmin( y1, y0 ), t0 );
+			t0 = vmax( vmin( z1, z0 ), t0 );
+			Float8 t1 = vmin( vmax( x0, x1 ), tMax );
+			t1 = vmin( vmax( y0, y1 ), t1 );
+			t1 = vmin( vmax( z0, z1 ), t1 );
+			const Mask8 hit = t0 <= t1;
+			if ( movemask( hit ) == 0 )
+				continue;
+			tNear[i] = hmin( vselect( hit, t0, inf ) );
+			mask |= 1 << i;
+		}
+		return mask;
+	}
+}
+
+unsigned BVH::intersectPacket( const Ray* rays, float tMin, float tMax, Hit* hits ) const
+{
+	unsigned mask = 0;
+	if ( bruteForce() )
+		mask = intersectPacketBruteForce( rays, tMin, tMax, hits );
+	else if ( width_ == 4 )
+		mask = intersectPacketWide( wide4_, rays, tMin, tMax, hits );
+	else if ( width_ == 8 )
+		mask = intersectPacketWide( wide8_, rays, tMin, tMax, hits );
+	else
+	{
+		for ( int i = 0; i < PACKET_SIZE; ++i )
+			mask |= intersectBinary( rays[i], tMin, tMax, hits[i] ) ? 1u << i : 0u;
+	}
+
+	if ( !placements_.empty() )
+	{
+		for ( int i = 0; i < PACKET_SIZE; ++i )
+		{
+			const unsigned bit = 1u << i;
+			if ( intersectInstances( rays[i], tMin, mask & bit ? hits[i].t : tMax, hits[i] ) )
+				mask |= bit;
+		}
+	}
+	return mask;
+}
+
+unsigned BVH::occludedPacket( const Ray* rays, float tMin, const float* tMax, unsigned active ) const
+{
+	if ( active == 0 )
+		return 0;
+	unsigned mask = 0;
+	if ( bruteForce() )
+	{
+		PacketRays packetRays;
+		makePacketRays( rays, packetRays );
+		mask = kernels().occludedPrims( packetRays, makeKernelScene( *scene_, edgeData() ), prims_.data(), std::uint32_t( prims_.size() ), tMin, tMax, active );
+	}
+	else if ( width_ == 4 )
+		mask = occludedPacketWide( wide4_, rays, tMin, tMax, active );
+	else if ( width_ == 8 )
+		mask = occludedPacketWide( wide8_, rays, tMin, tMax, active );
+	else
+	{
+		for ( int i = 0; i < PACKET_SIZE; ++i )
+		{
+			if ( ( active & ( 1u << i ) ) && occludedBinary( rays[i], tMin, tMax[i] ) )
+				mask |= 1u << i;
+		}
+	}
+
+	if ( !placements_.empty() )
+	{
+		for ( int i = 0; i < PACKET_SIZE; ++i )
+		{
+			const unsigned bit = 1u << i;
+			if ( ( active & ~mask & bit ) && occludedInstances( rays[i], tMin, tMax[i] ) )
+				mask |= bit;
+		}
+	}
+	return mask;
+}
+
+unsigned BVH::intersectPacketBruteForce( const Ray* rays, float tMin, float tMax, Hit* hits ) const
+{
+	PacketRays packetRays;
+	makePacketRays( rays, packetRays );
+	float t[PACKET_SIZE];
+	std::fill( t, t + PACKET_SIZE, tMax );
+	std::uint32_t hitPrim[PACKET_SIZE] = {};
+	if ( prims_.empty() || !kernels().intersectPrims( packetRays, makeKernelScene( *scene_, edgeData() ), prims_.data(), std::uint32_t( prims_.size() ), tMin, t, hitPrim ) )
+		return 0;
+
+	unsigned result = 0;
+	for ( int l = 0; l < PACKET_SIZE; ++l )
+	{
+		if ( t[l] == tMax )
+			continue;
+		fillHit( rays[l], t[l], hitPrim[l], hits[l] );
+		result |= 1u << l;
+	}
+	return result;
+}
+
+template<int N>
+unsigned BVH::intersectPacketWide( const std::vector<WideNode<N>>& wide, const Ray* rays, float tMin, float tMax, Hit* hits ) const
+{
+	if ( wide.empty() )
+		return 0;
+
+	// Узлы обходятся в порядке для первого луча: у когерентного пакета знаки направлений общие
+	PacketRays packetRays;
+	makePacketRays( rays, packetRays );
+	const RayPacket packet( packetRays );
+	// Листья проверяются ядрами выбранного при запуске варианта
+	const Kernels& k = kernels();
+	const KernelScene scene = makeKernelScene( *scene_, edgeData() );
+	const WideOrder order( rays[0].direction );
+	const Float8 tMinV( tMin );
+	// Ближайшее попадание каждого луча и самое дальнее из них: узлы дальше него не нужны никому
+	Float8 tHit( tMax );
+	float tCull = tMax;
+	std::uint32_t hitPrim[PACKET_SIZE] = {};
+
+	struct Entry
+	{
+		std::uint32_t child;
+		std::uint32_t count;
+		float t;
+	};
+	Entry stack[32 * N];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, tMin };
+
+	float tNear[N];
+	while ( stackSize > 0 )
+	{
+		const Entry e = stack[--stackSize];
+		if ( e.t >= tCull )
+			continue;
+
+		if ( e.count > 0 )
+		{
+			float t[PACKET_SIZE];
+			tHit.store( t );
+			if ( k.intersectPrims( packetRays, scene, &prims_[e.child], e.count, tMin, t, hitPrim ) )
+			{
+				tHit = Float8::load( t );
+				tCull = hmax( tHit );
+			}
+			continue;
+		}
+
+		const WideNode<N>& node = wide[e.child];
+		const int mask = intersectChildren( node, packet, tMinV, tHit, tNear );
+		if ( mask == 0 )
+			continue;
+		for ( int o = N - 1; o >= 0; --o )
+		{
+			const int slot = order.slot( node, o );
+			if ( mask & ( 1 << slot ) )
+				stack[stackSize++] = { node.child[slot], node.count[slot], tNear[slot] };
+		}
+	}
+
+	float t[PACKET_SIZE];
+	tHit.store( t );
+	unsigned result = 0;
+	for ( int l = 0; l < PACKET_SIZE; ++l )
+	{
+		if ( t[l] == tMax )
+			continue;
+		fillHit( rays[l], t[l], hitPrim[l], hits[l] );
+		result |= 1u << l;
+	}
+	return result;
+}
+
+template<int N>
+unsigned BVH::occludedPacketWide( const std::vector<WideNode<N>>& wide, const Ray* rays, float tMin, const float* tMax, unsigned active ) const
+{
+	if ( wide.empty() )
+		return 0;
+
+	PacketRays packetRays;
+	makePacketRays( rays, packetRays );
+	const RayPacket packet( packetRays );
+	const Kernels& k = kernels();
+	const KernelScene scene = makeKernelScene( *scene_, edgeData() );
+	const WideOrder order( rays[0].direction );
+	const Float8 tMinV( tMin );
+	// Перекрытые лучи и лучи вне active получают tMax = -inf: в боксы они больше не попадают,
+	// и узел обходится, только пока в него попадает хоть один еще открытый луч
+	float t[PACKET_SIZE];
+	for ( int l = 0; l < PACKET_SIZE; ++l )
+		t[l] = active & ( 1u << l ) ? tMax[l] : -std::numeric_limits<float>::infinity();
+	Float8 tMaxV = Float8::load( t );
+	unsigned result = 0;
+
+	struct Entry
+	{
+		std::uint32_t child;
+		std::uint32_t count;
+	};
+	Entry stack[32 * N];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0 };
+
+	float tNear[N];
+	while ( stackSize > 0 )
+	{
+		const Entry e = stack[--stackSize];
+		if ( e.count > 0 )
+		{
+			const unsigned hit = k.occludedPrims( packetRays, scene, &prims_[e.child], e.count, tMin, t, active & ~result );
+			if ( hit == 0 )
+				continue;
+			result |= hit;
+			if ( result == active )
+				break;
+			for ( int l = 0; l < PACKET_SIZE; ++l )
+			{
+				if ( hit & ( 1u << l ) )
+					t[l] = -std::numeric_limits<float>::infinity();
+			}
+			tMaxV = Float8::load( t );
+			continue;
+		}
+
+		const WideNode<N>& node = wide[e.child];
+		const int mask = intersectChildren( node, packet, tMinV, tMaxV, tNear );
+		for ( int o = N - 1; mask != 0 && o >= 0; --o )
+		{
+			const int slot = order.slot( node, o );
+			if ( mask & ( 1 << slot ) )
+				stack[stackSize++] = { node.child[slot], node.count[slot] };
+		}
+	}
+	return result;
+}
+
+template unsigned BVH::intersectPacketWide<4>( const std::vector<WideNode<4>>& wide, const Ray* rays, float tMin, float tMax, Hit* hits ) const;
+template unsigned BVH::intersectPacketWide<8>( const std::vector<WideNode<8>>& wide, const Ray* rays, float tMin, float tMax, Hit* hits ) const;
+template unsigned BVH::occludedPacketWide<4>( const std::vector<WideNode<4>>& wide, const Ray* rays, float tMin, const float* tMax, unsigned active ) const;
+template unsigned BVH::occludedPacketWide<8>( const std::vector<WideNode<8>>& wide, const Ray* rays, float tMin, const float* tMax, unsigned active ) const;
@@ -0,0 +1,380 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define BVH_SSE 1
+#include <immintrin.h>
+#endif
+
+static_assert( sizeof( WideNode<4> ) == 128 && sizeof( WideNode<8> ) == 256, "wide nodes should fill whole cache lines" );
+
+namespace {
+	// Больше в count узла не помещается, такие листья режутся на части
+	const std::uint32_t MAX_WIDE_LEAF = 0xFFFF;
+	template<int N>
+	void clearSlot( WideNode<N>& node, int slot )
+	{
+		// Вывернутый бокс: тест луча с ним всегда дает промах, проверять слот отдельно не нужно
+		const float big = std::numeric_limits<float>::max();
+		node.minX[slot] = node.minY[slot] = node.minZ[slot] = big;
+		node.maxX[slot] = node.maxY[slot] = node.maxZ[slot] = -big;
+		node.child[slot] = WideNode<N>::EMPTY;
+		node.count[slot] = 0;
+	}
+
+	template<int N>
+	void setBounds( WideNode<N>& node, int slot, const AABB& b )
+	{
+		node.minX[slot] = b.min.x();
+		node.minY[slot] = b.min.y();
+		node.minZ[slot] = b.min.z();
+		node.maxX[slot] = b.max.x();
+		node.maxY[slot] = b.max.y();
+		node.maxZ[slot] = b.max.z();
+	}
+
+	template<int N>
+	WideNode<N> emptyNode()
+	{
+		WideNode<N> node;
+		for ( int i = 0; i < N; ++i )
+			clearSlot( node, i );
+		for ( int i = 0; i < N - 1; ++i )
+			node.axes[i] = 0;
+		return node;
+	}
+
+	// Ось, по которой разошлись дети бинарного узла, и какой из них дальше по ней
+	std::uint8_t splitAxis( const BVHNode& left, const BVHNode& right )
+	{
+		const Vector3 d = right.bounds.centroid() - left.bounds.centroid();
+		int axis = 0;
+		for ( int i = 1; i < 3; ++i )
+		{
+			if ( std::abs( d[i] ) > std::abs( d[axis] ) )
+				axis = i;
+		}
+		return std::uint8_t( axis | ( d[axis] < 0.0f ? WIDE_AXIS_FLIP : 0 ) );
+	}
+
+	// Лист в слот; слишком большой - через промежуточный узел с частями листа
+	template<int N>
+	void addLeaf( std::vector<WideNode<N>>& wide, WideNode<N>& node, int slot, const AABB& bounds, std::uint32_t first, std::uint32_t count )
+	{
+		setBounds( node, slot, bounds );
+		if ( count <= MAX_WIDE_LEAF )
+		{
+			node.child[slot] = first;
+			node.count[slot] = std::uint16_t( count );
+			return;
+		}
+
+		WideNode<N> split = emptyNode<N>();
+		const std::uint32_t part = ( count + N - 1 ) / N;
+		for ( int i = 0; i < N && count > 0; ++i )
+		{
+			const std::uint32_t n = std::min( part, count );
+			addLeaf( wide, split, i, bounds, first, n );
+			first += n;
+			count -= n;
+		}
+		node.child[slot] = std::uint32_t( wide.size() );
+		node.count[slot] = 0;
+		wide.push_back( split );
+	}
+
+	// Луч, подготовленный к проверке всех детей узла разом
+	struct WideRay
+	{
+		float origin[3];
+		float invDir[3];
+		bool negative[3];
+		WideOrder order;
+
+		explicit WideRay( const Ray& ray )
+			: order( ray.direction )
+		{
+			for ( int i = 0; i < 3; ++i )
+			{
+				origin[i] = ray.origin[i];
+				invDir[i] = 1.0f / ray.direction[i];
+				negative[i] = ray.direction[i] < 0.0f;
+			}
+		}
+	};
+
+	// Slab test всех N детей, бит i маски - попадание в ребенка i, tNear - вход в его бокс.
+	// Ближняя по оси грань выбирается по знаку направления, поэтому min/max считать не нужно.
+	template<int N>
+	int intersectChildren( const WideNode<N>& node, const WideRay& r, float tMin, float tMax, float* tNear )
+	{
+		const float* nearX = r.negative[0] ? node.maxX : node.minX;
+		const float* farX = r.negative[0] ? node.minX : node.maxX;
+		const float* nearY = r.negative[1] ? node.maxY : node.minY;
+		const float* farY = r.negative[1] ? node.minY : node.maxY;
+		const float* nearZ = r.negative[2] ? node.maxZ : node.minZ;
+		const float* farZ = r.negative[2] ? node.minZ : node.maxZ;
+		int mask = 0;
+
+#if defined( BVH_SSE ) && defined( __AVX__ )
+		if ( N == 8 )
+		{
+			const __m256 ox = _mm256_set1_ps( r.origin[0] ), oy = _mm256_set1_ps( r.origin[1] ), oz = _mm256_set1_ps( r.origin[2] );
+			const __m256 ix = _mm256_set1_ps( r.invDir[0] ), iy = _mm256_set1_ps( r.invDir[1] ), iz = _mm256_set1_ps( r.invDir[2] );
+			// Порядок операндов max/min важен: при NaN (0 * inf) остается второй, то есть уже накопленный отрезок
+			__m256 t0 = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( nearX ), ox ), ix ), _mm256_set1_ps( tMin ) );
+			t0 = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( nearY ), oy ), iy ), t0 );
+			t0 = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( nearZ ), oz ), iz ), t0 );
+			__m256 t1 = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( farX ), ox ), ix ), _mm256_set1_ps( tMax ) );
+			t1 = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( farY ), oy ), iy ), t1 );
+			t1 = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( farZ ), oz ), iz ), t1 );
+			_mm256_store_ps( tNear, t0 );
+			return _mm256_movemask_ps( _mm256_cmp_ps( t0, t1, _CMP_LE_OQ ) );
+		}
+#endif
+
+#if defined( BVH_SSE )
+		const __m128 ox = _mm_set1_ps( r.origin[0] ), oy = _mm_set1_ps( r.origin[1] ), oz = _mm_set1_ps( r.origin[2] );
+		const __m128 ix = _mm_set1_ps( r.invDir[0] ), iy = _mm_set1_ps( r.invDir[1] ), iz = _mm_set1_ps( r.invDir[2] );
+		for ( int g = 0; g < N; g += 4 )
+		{
+			// Порядок операндов max/min важен: при NaN (0 * inf) остается второй, то есть уже накопленный отрезок
+			__m128 t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( nearX + g ), ox ), ix ), _mm_set1_ps( tMin ) );
+			t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( nearY + g ), oy ), iy ), t0 );
+			t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( nearZ + g ), oz ), iz ), t0 );
+			__m128 t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( farX + g ), ox ), ix ), _mm_set1_ps( tMax ) );
+			t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( farY + g ), oy ), iy ), t1 );
+			t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( farZ + g ), oz ), iz ), t1 );
+			_mm_store_ps( tNear + g, t0 );
+			mask |= _mm_movemask_ps( _mm_cmple_ps( t0, t1 ) ) << g;
+		}
+#else
+		for ( int i = 0; i < N; ++i )
+		{
+			float t0 = tMin;
+			float t1 = tMax;
+			const float nx = ( nearX[i] - r.origin[0] ) * r.invDir[0];
+			const float ny = ( nearY[i] - r.origin[1] ) * r.invDir[1];
+			const float nz = ( nearZ[i] - r.origin[2] ) * r.invDir[2];
+			const float fx = ( farX[i] - r.origin[0] ) * r.invDir[0];
+			const float fy = ( farY[i] - r.origin[1] ) * r.invDir[1];
+			const float fz = ( farZ[i] - r.origin[2] ) * r.invDir[2];
+			t0 = nx > t0 ? nx : t0;
+			t0 = ny > t0 ? ny : t0;
+			t0 = nz > t0 ? nz : t0;
+			t1 = fx < t1 ? fx : t1;
+			t1 = fy < t1 ? fy : t1;
+			t1 = fz < t1 ? fz : t1;
+			tNear[i] = t0;
+			mask |= t0 <= t1 ? 1 << i : 0;
+		}
+#endif
+		return mask;
+	}
+}
+
+void BVH::collapse( int width )
+{
+	for ( BVH& blas : blas_ )
+		blas.collapse( width );
+	width_ = 2;
+	wide4_.clear();
+	wide8_.clear();
+	if ( width == 4 )
+		collapseTo( wide4_ );
+	else if ( width == 8 )
+		collapseTo( wide8_ );
+	else
+		return;
+	width_ = width;
+}
+
+template<int N>
+void BVH::collapseTo( std::vector<WideNode<N>>& wide ) const
+{
+	wide.clear();
+	if ( nodes_.empty() )
+		return;
+
+	// Каждый широкий узел - бинарное поддерево глубины log2(N). Внутренний узел бинарного
+	// дерева на последнем уровне становится новым широким узлом, лист - листом.
+	// Лист выше последнего уровня занимает первый слот своей половины, остальные пустые.
+	struct Task
+	{
+		std::uint32_t wide;
+		std::uint32_t binary;
+	};
+	struct Fill
+	{
+		std::uint32_t binary;
+		int level;
+		int heap;
+		int slot;
+	};
+
+	std::vector<Task> stack;
+	wide.reserve( nodes_.size() / ( N - 1 ) + 1 );
+	wide.push_back( emptyNode<N>() );
+	stack.push_back( { 0, 0 } );
+	while ( !stack.empty() )
+	{
+		const Task task = stack.back();
+		stack.pop_back();
+
+		WideNode<N> node = emptyNode<N>();
+		Fill fills[2 * N];
+		int fillCount = 0;
+		fills[fillCount++] = { task.binary, 0, 0, 0 };
+		while ( fillCount > 0 )
+		{
+			const Fill f = fills[--fillCount];
+			const BVHNode& b = nodes_[f.binary];
+			if ( b.count == 0 && f.level < WideNode<N>::LEVELS )
+			{
+				node.axes[f.heap] = splitAxis( nodes_[b.first], nodes_[b.first + 1] );
+				const int half = N >> ( f.level + 1 );
+				fills[fillCount++] = { b.first, f.level + 1, 2 * f.heap + 1, f.slot };
+				fills[fillCount++] = { b.first + 1, f.level + 1, 2 * f.heap + 2, f.slot + half };
+				continue;
+			}
+
+			if ( b.count > 0 )
+			{
+				addLeaf( wide, node, f.slot, b.bounds, b.first, b.count );
+				continue;
+			}
+			setBounds( node, f.slot, b.bounds );
+			node.child[f.slot] = std::uint32_t( wide.size() );
+			node.count[f.slot] = 0;
+			stack.push_back( { std::uint32_t( wide.size() ), f.binary } );
+			wide.push_back( emptyNode<N>() );
+		}
+		wide[task.wide] = node;
+	}
+}
+
+template<int N>
+bool BVH::intersectWide( const std::vector<WideNode<N>>& wide, const Ray& ray, float tMin, float tMax, Hit& hit ) const
+{
+	if ( wide.empty() )
+		return false;
+
+	const WideRay r( ray );
+	const float tFar = tMax;
+	std::uint32_t hitPrim = 0;
+
+	struct Entry
+	{
+		std::uint32_t child;
+		std::uint32_t count;
+		float t;
+	};
+	// Глубина бинарного дерева до 60, широкого - до 60 / log2(N), на уровне в стек ложится до N детей
+	Entry stack[32 * N];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, tMin };
+
+	alignas( 32 ) float tNear[N];
+	while ( stackSize > 0 )
+	{
+		const Entry e = stack[--stackSize];
+		// Узлы дальше уже найденного попадания пропускаем
+		if ( e.t >= tMax )
+			continue;
+
+		if ( e.count > 0 )
+		{
+			for ( std::uint32_t i = e.child; i < e.child + e.count; ++i )
+			{
+				const float t = intersectPrim( ray, prims_[i], tMin, tMax );
+				if ( t < tMax )
+				{
+					tMax = t;
+					hitPrim = prims_[i];
+				}
+			}
+			continue;
+		}
+
+		const WideNode<N>& node = wide[e.child];
+		const int mask = intersectChildren( node, r, tMin, tMax, tNear );
+		if ( mask == 0 )
+			continue;
+		if ( ( mask & ( mask - 1 ) ) == 0 )
+		{
+			// Один ребенок, порядок не нужен
+			int slot = 0;
+			while ( !( mask & ( 1 << slot ) ) )
+				slot++;
+			stack[stackSize++] = { node.child[slot], node.count[slot], tNear[slot] };
+			continue;
+		}
+
+		// Порядок обхода по знакам направления: на каждом уровне бинарного поддерева сначала
+		// ребенок, ближний по оси разбиения. В стек кладем с конца, чтобы ближний был сверху.
+		for ( int order = N - 1; order >= 0; --order )
+		{
+			const int slot = r.order.slot( node, order );
+			if ( mask & ( 1 << slot ) )
+				stack[stackSize++] = { node.child[slot], node.count[slot], tNear[slot] };
+		}
+	}
+
+	if ( tMax == tFar )
+		return false;
+
+	fillHit( ray, tMax, hitPrim, hit );
+	return true;
+}
+
+template<int N>
+bool BVH::occludedWide( const std::vector<WideNode<N>>& wide, const Ray& ray, float tMin, float tMax ) const
+{
+	if ( wide.empty() )
+		return false;
+
+	const WideRay r( ray );
+	struct Entry
+	{
+		std::uint32_t child;
+		std::uint32_t count;
+	};
+	Entry stack[32 * N];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0 };
+
+	alignas( 32 ) float tNear[N];
+	while ( stackSize > 0 )
+	{
+		const Entry e = stack[--stackSize];
+		if ( e.count > 0 )
+		{
+			for ( std::uint32_t i = e.child; i < e.child + e.count; ++i )
+			{
+				if ( intersectPrim( ray, prims_[i], tMin, tMax ) < tMax )
+					return true;
+			}
+			continue;
+		}
+
+		// Ближние дети первыми, как в intersectWide: препятствие находится раньше
+		const WideNode<N>& node = wide[e.child];
+		const int mask = intersectChildren( node, r, tMin, tMax, tNear );
+		for ( int order = N - 1; mask != 0 && order >= 0; --order )
+		{
+			const int slot = r.order.slot( node, order );
+			if ( mask & ( 1 << slot ) )
+				stack[stackSize++] = { node.child[slot], node.count[slot] };
+		}
+	}
+	return false;
+}
+
+template void BVH::collapseTo<4>( std::vector<WideNode<4>>& wide ) const;
+template void BVH::collapseTo<8>( std::vector<WideNode<8>>& wide ) const;
+template bool BVH::intersectWide<4>( const std::vector<WideNode<4>>& wide, const Ray& ray, float tMin, float tMax, Hit& hit ) const;
+template bool BVH::intersectWide<8>( const std::vector<WideNode<8>>& wide, const Ray& ray, float tMin, float tMax, Hit& hit ) const;
+template bool BVH::occludedWide<4>( const std::vector<WideNode<4>>& wide, const Ray& ray, float tMin, float tMax ) const;
+template bool BVH::occludedWide<8>( const std::vector<WideNode<8>>& wide, const Ray& ray, float tMin, float tMax ) const;
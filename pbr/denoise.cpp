@@ -0,0 +1,261 @@
+#include "denoise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "film.h"
+#include "lights.h"
+#include "thread_pool.h"
+
+// Строки сигнала и накопители не пересекаются, но компилятор этого не докажет
+// для полутора десятков массивов и без подсказки цикл не векторизует
+#if defined( __clang__ )
+#define LOOP_IVDEP _Pragma( "clang loop vectorize(assume_safety)" )
+#elif defined( __GNUC__ )
+#define LOOP_IVDEP _Pragma( "GCC ivdep" )
+#elif defined( _MSC_VER )
+#define LOOP_IVDEP __pragma( loop( ivdep ) )
+#else
+#define LOOP_IVDEP
+#endif
+
+namespace {
+	const float ALBEDO_MIN = 0.01f;
+	const float DEPTH_MIN = 1e-3f;
+	const float VARIANCE_EPS = 1e-4f;
+	const int ROWS_PER_TASK = 8;
+	const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+	// Функции внутреннего цикла без сравнений: без -ffast-math GCC не превращает
+	// сравнения float в маски и не векторизует цикл с ними
+	inline float maxZero( float x )
+	{
+		return 0.5f * ( x + std::abs( x ) );
+	}
+
+	// e^x для x <= 0 без libm: 2^x как степень в битах float и полином дробной части.
+	// Ошибка меньше 0.3%.
+	inline float fastExp( float x )
+	{
+		const float t = maxZero( x * 1.44269504f + 126.0f ) - 126.0f;
+		const std::int32_t i = std::int32_t( t ); // к нулю, f в (-1, 0]
+		const float f = t - float( i );
+		const float p = 1.0f + f * ( 0.6931472f + f * ( 0.2402265f + f * ( 0.0555041f + f * 0.0096181f ) ) );
+		const std::int32_t bits = ( i + 127 ) << 23;
+		float scale;
+		std::memcpy( &scale, &bits, sizeof( scale ) );
+		return p * scale;
+	}
+
+	// Вес нормалей: dot( n_p, n_q )^128 семью возведениями в квадрат
+	inline float normalWeight( float cosine )
+	{
+		float w = maxZero( cosine );
+		w *= w;
+		w *= w;
+		w *= w;
+		w *= w;
+		w *= w;
+		w *= w;
+		w *= w;
+		return w;
+	}
+
+	// Освещенность и ее дисперсия по плоскостям каналов, чтобы цикл по x шел подряд по памяти
+	struct Signal
+	{
+		std::vector<float> r, g, b, variance;
+
+		void resize( size_t n )
+		{
+			r.resize( n );
+			g.resize( n );
+			b.resize( n );
+			variance.resize( n );
+		}
+	};
+
+	// Неизменные между итерациями данные пикселя
+	struct Guides
+	{
+		std::vector<float> nx, ny, nz;
+		std::vector<float> ar, ag, ab;
+		std::vector<float> depth;
+		std::vector<float> invDepth; // 1 / (sigmaDepth * depth)
+	};
+
+	// Один проход a-trous с шагом step: src -> dst
+	void filterPass( int width, int height, int step, const DenoiseSettings& settings, const Guides& guides,
+		const Signal& src, Signal& dst, ThreadPool& pool )
+	{
+		const size_t count = size_t( width ) * height;
+
+		// Стандартное отклонение для веса яркости по дисперсии, сглаженной гауссом 3x3, иначе веса слишком шумные
+		std::vector<float> deviation( count );
+		pool.parallelFor( size_t( height ), [&]( size_t row ) {
+			const int y = int( row );
+			for ( int x = 0; x < width; ++x )
+			{
+				float sum = 0.0f;
+				float weight = 0.0f;
+				for ( int dy = -1; dy <= 1; ++dy )
+				{
+					const int yq = y + dy;
+					if ( yq < 0 || yq >= height )
+						continue;
+					for ( int dx = -1; dx <= 1; ++dx )
+					{
+						const int xq = x + dx;
+						if ( xq < 0 || xq >= width )
+							continue;
+						const float w = ( dx == 0 ? 0.5f : 0.25f ) * ( dy == 0 ? 0.5f : 0.25f );
+						sum += w * src.variance[size_t( yq ) * width + xq];
+						weight += w;
+					}
+				}
+				deviation[size_t( y ) * width + x] = std::sqrt( sum / weight );
+			}
+		} );
+
+		const float sigmaL = settings.sigmaLuminance * 0.70710678f;
+		const float invAlbedo = 1.0f / ( settings.sigmaAlbedo * settings.sigmaAlbedo );
+		const size_t tasks = ( size_t( height ) + ROWS_PER_TASK - 1 ) / ROWS_PER_TASK;
+		pool.parallelFor( tasks, [&]( size_t task ) {
+			std::vector<float> sr( width ), sg( width ), sb( width ), sv( width ), sw( width );
+			const int yEnd = std::min( height, int( task + 1 ) * ROWS_PER_TASK );
+			for ( int y = int( task ) * ROWS_PER_TASK; y < yEnd; ++y )
+			{
+				const size_t rowP = size_t( y ) * width;
+
+				// Центральный отвод всегда с весом ядра: фон с нулевой нормалью остается как есть
+				const float hc = KERNEL[2] * KERNEL[2];
+				for ( int x = 0; x < width; ++x )
+				{
+					const size_t p = rowP + x;
+					sr[x] = hc * src.r[p];
+					sg[x] = hc * src.g[p];
+					sb[x] = hc * src.b[p];
+					sv[x] = hc * hc * src.variance[p];
+					sw[x] = hc;
+				}
+
+				for ( int dy = -2; dy <= 2; ++dy )
+				{
+					const int yq = y + dy * step;
+					if ( yq < 0 || yq >= height )
+						continue;
+					const size_t rowQ = size_t( yq ) * width;
+					for ( int dx = -2; dx <= 2; ++dx )
+					{
+						if ( dx == 0 && dy == 0 )
+							continue;
+						const int offset = dx * step;
+						const int x0 = std::max( 0, -offset );
+						const int x1 = std::min( width, width - offset );
+						const float h = KERNEL[dx + 2] * KERNEL[dy + 2];
+						const float invDistance = 1.0f / ( float( step ) * std::sqrt( float( dx * dx + dy * dy ) ) );
+
+						// Подряд по x: без ветвлений, чтобы компилятор векторизовал цикл
+						LOOP_IVDEP
+						for ( int x = x0; x < x1; ++x )
+						{
+							const size_t p = rowP + x;
+							const size_t q = rowQ + x + offset;
+
+							const float wn = normalWeight( guides.nx[p] * guides.nx[q] + guides.ny[p] * guides.ny[q] + guides.nz[p] * guides.nz[q] );
+
+							const float lp = 0.2126f * src.r[p] + 0.7152f * src.g[p] + 0.0722f * src.b[p];
+							const float lq = 0.2126f * src.r[q] + 0.7152f * src.g[q] + 0.0722f * src.b[q];
+							const float dar = guides.ar[p] - guides.ar[q];
+							const float dag = guides.ag[p] - guides.ag[q];
+							const float dab = guides.ab[p] - guides.ab[q];
+							// Допуск по отклонениям обоих пикселей: вес симметричный, иначе выброс
+							// с большой дисперсией растворяется в соседях, а они его не принимают, и кадр темнеет
+							const float sigma = sigmaL * ( deviation[p] + deviation[q] ) + VARIANCE_EPS;
+							const float e = std::abs( lp - lq ) / sigma +
+								std::abs( guides.depth[p] - guides.depth[q] ) * guides.invDepth[p] * invDistance +
+								( dar * dar + dag * dag + dab * dab ) * invAlbedo;
+							const float w = h * wn * fastExp( -e );
+
+							sr[x] += w * src.r[q];
+							sg[x] += w * src.g[q];
+							sb[x] += w * src.b[q];
+							sv[x] += w * w * src.variance[q];
+							sw[x] += w;
+						}
+					}
+				}
+
+				for ( int x = 0; x < width; ++x )
+				{
+					const size_t p = rowP + x;
+					const float k = 1.0f / sw[x];
+					dst.r[p] = sr[x] * k;
+					dst.g[p] = sg[x] * k;
+					dst.b[p] = sb[x] * k;
+					dst.variance[p] = sv[x] * k * k;
+				}
+			}
+		} );
+	}
+}
+
+void denoise( const Film& film, const DenoiseSettings& settings, std::vector<Vector3>& out, ThreadPool& pool )
+{
+	const int width = film.width();
+	const int height = film.height();
+	const size_t count = size_t( width ) * height;
+
+	Guides guides;
+	for ( std::vector<float>* plane : { &guides.nx, &guides.ny, &guides.nz, &guides.ar, &guides.ag, &guides.ab, &guides.depth, &guides.invDepth } )
+		plane->resize( count );
+	Signal a, b;
+	a.resize( count );
+	b.resize( count );
+
+	// Делим цвет на albedo; нормали усреднены по сэмплам и нормируются заново
+	std::vector<Vector3> albedo( count );
+	for ( int y = 0; y < height; ++y )
+	{
+		for ( int x = 0; x < width; ++x )
+		{
+			const size_t i = size_t( y ) * width + x;
+			const FilmAov& aov = film.aov( x, y );
+			const Vector3 al( std::max( aov.albedo.x(), ALBEDO_MIN ), std::max( aov.albedo.y(), ALBEDO_MIN ), std::max( aov.albedo.z(), ALBEDO_MIN ) );
+			albedo[i] = al;
+
+			const float length = aov.normal.length();
+			const Vector3 n = length > 0.0f ? aov.normal / length : Vector3( 0, 0, 0 );
+			guides.nx[i] = n.x();
+			guides.ny[i] = n.y();
+			guides.nz[i] = n.z();
+			guides.ar[i] = aov.albedo.x();
+			guides.ag[i] = aov.albedo.y();
+			guides.ab[i] = aov.albedo.z();
+			guides.depth[i] = aov.depth;
+			guides.invDepth[i] = 1.0f / ( settings.sigmaDepth * std::max( aov.depth, DEPTH_MIN ) );
+
+			const Vector3 mean = film.pixel( x, y ).mean;
+			const float l = luminance( al );
+			a.r[i] = mean.x() / al.x();
+			a.g[i] = mean.y() / al.y();
+			a.b[i] = mean.z() / al.z();
+			a.variance[i] = film.variance( x, y ) / ( l * l );
+		}
+	}
+
+	Signal* src = &a;
+	Signal* dst = &b;
+	const int iterations = std::min( settings.iterations, DENOISE_MAX_ITERATIONS );
+	for ( int i = 0; i < iterations; ++i )
+	{
+		filterPass( width, height, 1 << i, settings, guides, *src, *dst, pool );
+		std::swap( src, dst );
+	}
+
+	out.resize( count );
+	for ( size_t i = 0; i < count; ++i )
+		out[i] = Vector3( src->r[i] * albedo[i].x(), src->g[i] * albedo[i].y(), src->b[i] * albedo[i].z() );
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+
+#include "../src/vector.h"
+
+class Film;
+class ThreadPool;
+
+// Кадр не больше 65535 пикселей по стороне: шаг 2^16 уже шире любого изображения
+const int DENOISE_MAX_ITERATIONS = 16;
+
+struct DenoiseSettings
+{
+	int iterations = 4;          // шаги 1, 2, 4, ... пикселей, радиус фильтра 2^iterations
+	float sigmaLuminance = 4.0f; // допуск разницы яркости в стандартных отклонениях шума
+	float sigmaDepth = 0.02f;    // допуск относительного изменения глубины на пиксель
+	float sigmaAlbedo = 0.1f;
+};
+
+// Edge-avoiding a-trous (Dammertz et al. 2010): ядро B3-сплайна 5x5 с растущим шагом,
+// веса гасятся на границах нормалей, глубины и albedo. Вес яркости нормирован на
+// дисперсию пикселя из Film, которая фильтруется вместе с цветом (как в SVGF).
+// Фильтруется освещенность - цвет, деленный на albedo, - поэтому границы материалов не размываются.
+void denoise( const Film& film, const DenoiseSettings& settings, std::vector<Vector3>& out, ThreadPool& pool );
@@ -0,0 +1,246 @@
+#include "film.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#include "lights.h"
+
+namespace {
+	const float ERROR_LUMINANCE_FLOOR = 0.1f;
+
+	const char CHECKPOINT_MAGIC[4] = { 'P', 'B', 'R', 'C' };
+	const std::uint32_t CHECKPOINT_VERSION = 3;
+
+	struct CheckpointHeader
+	{
+		char magic[4];
+		std::uint32_t version;
+		std::uint32_t pixelSize;
+		std::uint32_t aovSize;
+		std::int32_t width;
+		std::int32_t height;
+		std::uint32_t sampler;
+		std::uint32_t sideCount;
+		std::uint32_t merged;
+		std::int32_t maxDepth;
+		std::int32_t rouletteDepth;
+		std::uint32_t nee;
+		std::uint32_t seedCount; // сразу за заголовком идут seedCount номеров seed
+		std::uint64_t sceneHash;
+	};
+
+	// Столько прогонов не объединяют; больше - значит файл испорчен
+	const std::uint32_t MAX_CHECKPOINT_SEEDS = 1u << 16;
+}
+
+Film::Film( int width, int height )
+	: width_( width ), height_( height ), pixels_( size_t( width ) * height ), aovs_( pixels_.size() )
+{
+}
+
+void Film::add( int x, int y, const Vector3& value )
+{
+	FilmPixel& p = pixels_[size_t( y ) * width_ + x];
+	// Яркость линейна, поэтому ее среднее - яркость среднего цвета
+	const float oldMean = luminance( p.mean );
+	p.count++;
+	p.mean += ( value - p.mean ) / float( p.count );
+	const float l = luminance( value );
+	p.m2 += ( l - oldMean ) * ( l - luminance( p.mean ) );
+}
+
+void Film::addAov( int x, int y, const Vector3& albedo, const Vector3& normal, float depth )
+{
+	const size_t i = size_t( y ) * width_ + x;
+	FilmAov& a = aovs_[i];
+	const float k = 1.0f / float( pixels_[i].count );
+	a.albedo += ( albedo - a.albedo ) * k;
+	a.normal += ( normal - a.normal ) * k;
+	a.depth += ( depth - a.depth ) * k;
+}
+
+float Film::variance( int x, int y ) const
+{
+	const FilmPixel& p = pixel( x, y );
+	if ( p.count < 2 )
+		return 0.0f;
+	return p.m2 / ( float( p.count - 1 ) * float( p.count ) );
+}
+
+float Film::relativeError( int x, int y ) const
+{
+	const FilmPixel& p = pixel( x, y );
+	if ( p.count < 2 )
+		return std::numeric_limits<float>::max();
+	const float variance = p.m2 / float( p.count - 1 );
+	const float halfWidth = 1.96f * std::sqrt( variance / float( p.count ) );
+	return halfWidth / std::max( luminance( p.mean ), ERROR_LUMINANCE_FLOOR );
+}
+
+std::uint64_t Film::totalSamples() const
+{
+	std::uint64_t total = 0;
+	for ( const FilmPixel& p : pixels_ )
+		total += p.count;
+	return total;
+}
+
+void Film::resolve( std::vector<Vector3>& out ) const
+{
+	out.resize( pixels_.size() );
+	for ( size_t i = 0; i < pixels_.size(); ++i )
+		out[i] = pixels_[i].mean;
+}
+
+void Film::sampleHeatmap( std::vector<Vector3>& out, bool raw ) const
+{
+	out.resize( pixels_.size() );
+	std::uint32_t minCount = std::numeric_limits<std::uint32_t>::max();
+	std::uint32_t maxCount = 0;
+	for ( const FilmPixel& p : pixels_ )
+	{
+		minCount = std::min( minCount, p.count );
+		maxCount = std::max( maxCount, p.count );
+	}
+
+	// Черный - синий - красный - желтый - белый
+	const Vector3 ramp[] = { Vector3( 0, 0, 0 ), Vector3( 0, 0, 1 ), Vector3( 1, 0, 0 ), Vector3( 1, 1, 0 ), Vector3( 1, 1, 1 ) };
+	const int segments = int( sizeof( ramp ) / sizeof( ramp[0] ) ) - 1;
+	for ( size_t i = 0; i < pixels_.size(); ++i )
+	{
+		const std::uint32_t count = pixels_[i].count;
+		if ( raw )
+		{
+			out[i] = Vector3( float( count ), float( count ), float( count ) );
+			continue;
+		}
+		const float t = maxCount > minCount ? float( count - minCount ) / float( maxCount - minCount ) : 0.0f;
+		const int s = std::min( segments - 1, int( t * segments ) );
+		const float f = t * segments - s;
+		out[i] = ramp[s] * ( 1.0f - f ) + ramp[s + 1] * f;
+	}
+}
+
+bool Film::saveCheckpoint( const std::string& path, const CheckpointInfo& info ) const
+{
+	CheckpointHeader header;
+	std::memset( static_cast<void*>( &header ), 0, sizeof( header ) );
+	std::memcpy( header.magic, CHECKPOINT_MAGIC, sizeof( CHECKPOINT_MAGIC ) );
+	header.version = CHECKPOINT_VERSION;
+	header.pixelSize = sizeof( FilmPixel );
+	header.aovSize = sizeof( FilmAov );
+	header.width = width_;
+	header.height = height_;
+	header.sampler = info.sampler;
+	header.sideCount = info.sideCount;
+	header.merged = info.merged ? 1 : 0;
+	header.maxDepth = info.maxDepth;
+	header.rouletteDepth = info.rouletteDepth;
+	header.nee = info.nee ? 1 : 0;
+	header.seedCount = std::uint32_t( info.seeds.size() );
+	header.sceneHash = info.sceneHash;
+
+	// Через временный файл: если процесс убьют во время записи, старая точка останется целой
+	const std::string temp = path + ".tmp";
+	{
+		std::ofstream file( temp, std::ios::out | std::ios::binary );
+		file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+		file.write( reinterpret_cast<const char*>( info.seeds.data() ), info.seeds.size() * sizeof( std::uint32_t ) );
+		file.write( reinterpret_cast<const char*>( pixels_.data() ), pixels_.size() * sizeof( FilmPixel ) );
+		file.write( reinterpret_cast<const char*>( aovs_.data() ), aovs_.size() * sizeof( FilmAov ) );
+		if ( !file )
+		{
+			std::cerr << "Error: could not write checkpoint " << temp << std::endl;
+			return false;
+		}
+	}
+	if ( std::rename( temp.c_str(), path.c_str() ) != 0 )
+	{
+		std::remove( path.c_str() );
+		if ( std::rename( temp.c_str(), path.c_str() ) != 0 )
+		{
+			std::cerr << "Error: could not write checkpoint " << path << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Film::loadCheckpoint( const std::string& path, CheckpointInfo& info )
+{
+	std::ifstream file( path, std::ios::in | std::ios::binary );
+	if ( !file.is_open() )
+	{
+		std::cerr << "Error: could not open checkpoint " << path << std::endl;
+		return false;
+	}
+
+	CheckpointHeader header;
+	if ( !file.read( reinterpret_cast<char*>( &header ), sizeof( header ) ) ||
+		std::memcmp( header.magic, CHECKPOINT_MAGIC, sizeof( CHECKPOINT_MAGIC ) ) != 0 ||
+		header.version != CHECKPOINT_VERSION || header.pixelSize != sizeof( FilmPixel ) ||
+		header.aovSize != sizeof( FilmAov ) )
+	{
+		std::cerr << path << ": error: not a checkpoint of this version" << std::endl;
+		return false;
+	}
+	if ( header.width != width_ || header.height != height_ )
+	{
+		std::cerr << path << ": error: checkpoint is " << header.width << "x" << header.height
+			<< ", frame is " << width_ << "x" << height_ << std::endl;
+		return false;
+	}
+	if ( header.seedCount == 0 || header.seedCount > MAX_CHECKPOINT_SEEDS )
+	{
+		std::cerr << path << ": error: corrupted checkpoint" << std::endl;
+		return false;
+	}
+	std::vector<std::uint32_t> seeds( header.seedCount );
+	if ( !file.read( reinterpret_cast<char*>( seeds.data() ), seeds.size() * sizeof( std::uint32_t ) ) ||
+		!file.read( reinterpret_cast<char*>( pixels_.data() ), pixels_.size() * sizeof( FilmPixel ) ) ||
+		!file.read( reinterpret_cast<char*>( aovs_.data() ), aovs_.size() * sizeof( FilmAov ) ) )
+	{
+		std::cerr << path << ": error: truncated checkpoint" << std::endl;
+		return false;
+	}
+
+	info.sceneHash = header.sceneHash;
+	info.sampler = header.sampler;
+	info.sideCount = header.sideCount;
+	info.maxDepth = header.maxDepth;
+	info.rouletteDepth = header.rouletteDepth;
+	info.nee = header.nee != 0;
+	info.seeds = std::move( seeds );
+	info.merged = header.merged != 0;
+	return true;
+}
+
+void Film::merge( const Film& other )
+{
+	for ( size_t i = 0; i < pixels_.size(); ++i )
+	{
+		FilmPixel& a = pixels_[i];
+		const FilmPixel& b = other.pixels_[i];
+		if ( b.count == 0 )
+			continue;
+		const float n = float( a.count ) + float( b.count );
+		const float k = float( b.count ) / n;
+		const float delta = luminance( b.mean ) - luminance( a.mean );
+		a.m2 += b.m2 + delta * delta * float( a.count ) * float( b.count ) / n;
+		a.mean += ( b.mean - a.mean ) * k;
+
+		FilmAov& aovA = aovs_[i];
+		const FilmAov& aovB = other.aovs_[i];
+		aovA.albedo += ( aovB.albedo - aovA.albedo ) * k;
+		aovA.normal += ( aovB.normal - aovA.normal ) * k;
+		aovA.depth += ( aovB.depth - aovA.depth ) * k;
+		a.count += b.count;
+		a.target = a.count;
+	}
+}
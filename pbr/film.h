@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../src/vector.h"
+
+// Накопитель пикселя: среднее по каналам и сумма квадратов отклонений яркости (Уэлфорд)
+struct FilmPixel
+{
+	Vector3 mean;
+	float m2 = 0.0f;
+	std::uint32_t count = 0;
+	// Сколько сэмплов пикселю назначил адаптивный проход; больше count, если проход прерван
+	std::uint32_t target = 0;
+};
+
+// Средние по сэмплам вспомогательные буферы для шумодава
+struct FilmAov
+{
+	Vector3 albedo;
+	Vector3 normal;
+	float depth = 0.0f;
+};
+
+// Что нужно совпасть, чтобы продолжить рендер из контрольной точки
+struct CheckpointInfo
+{
+	std::uint64_t sceneHash = 0;
+	std::uint32_t sampler = 0;
+	std::uint32_t sideCount = 0; // сетка стратификации сэмплера
+	// Настройки интегратора: с другими значениями в кадре смешались бы разные оценки
+	std::int32_t maxDepth = 0;
+	std::int32_t rouletteDepth = 0;
+	bool nee = true;
+	// Seed всех прогонов, чьи сэмплы лежат в кадре; у обычного прогона он один
+	std::vector<std::uint32_t> seeds;
+	// Сумма нескольких независимых прогонов: номера сэмплов у пикселей уже не продолжаются
+	bool merged = false;
+};
+
+// Кадр с накоплением сэмплов. Один пиксель одновременно пишет только один поток.
+class Film
+{
+public:
+	Film( int width, int height );
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+
+	void add( int x, int y, const Vector3& value );
+	// AOV того же сэмпла, вызывается после add
+	void addAov( int x, int y, const Vector3& albedo, const Vector3& normal, float depth );
+
+	const FilmPixel& pixel( int x, int y ) const { return pixels_[size_t( y ) * width_ + x]; }
+	void setTarget( int x, int y, std::uint32_t target ) { pixels_[size_t( y ) * width_ + x].target = target; }
+	const FilmAov& aov( int x, int y ) const { return aovs_[size_t( y ) * width_ + x]; }
+
+	// Дисперсия среднего яркости пикселя, 0 при меньше чем двух сэмплах
+	float variance( int x, int y ) const;
+
+	// Полуширина 95% доверительного интервала среднего, отнесенная к яркости пикселя.
+	// Для темных пикселей знаменатель ограничен снизу, чтобы шум в черном не съедал бюджет.
+	float relativeError( int x, int y ) const;
+
+	std::uint64_t totalSamples() const;
+
+	// Средние значения пикселей
+	void resolve( std::vector<Vector3>& out ) const;
+	// Число сэмплов на пиксель: цветовая шкала от черного (min) до белого (max)
+	// или, если raw, само число во всех каналах
+	void sampleHeatmap( std::vector<Vector3>& out, bool raw ) const;
+
+	// Контрольная точка: заголовок и накопители пикселей как есть. Номер следующего сэмпла
+	// пикселя равен его count, а сэмплер - чистая функция от (seed, пиксель, номер),
+	// поэтому продолжение с контрольной точки дает тот же результат бит в бит.
+	bool saveCheckpoint( const std::string& path, const CheckpointInfo& info ) const;
+	bool loadCheckpoint( const std::string& path, CheckpointInfo& info );
+
+	// Объединение с независимым прогоном той же сцены (Chan et al. для дисперсии)
+	void merge( const Film& other );
+
+private:
+	int width_;
+	int height_;
+	std::vector<FilmPixel> pixels_;
+	std::vector<FilmAov> aovs_;
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "../src/vector.h"
+
+const float PI = 3.14159265f;
+
+struct Ray
+{
+	Vector3 origin;
+	Vector3 direction;
+};
+
+struct AABB
+{
+	Vector3 min = Vector3( std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() );
+	Vector3 max = Vector3( -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() );
+
+	void grow( const Vector3& p )
+	{
+		for ( int i = 0; i < 3; ++i )
+		{
+			min[i] = std::min( min[i], p[i] );
+			max[i] = std::max( max[i], p[i] );
+		}
+	}
+
+	void grow( const AABB& b )
+	{
+		if ( b.empty() )
+			return;
+		grow( b.min );
+		grow( b.max );
+	}
+
+	bool empty() const { return min.x() > max.x(); }
+
+	Vector3 centroid() const { return ( min + max ) * 0.5f; }
+
+	float area() const
+	{
+		if ( empty() )
+			return 0.0f;
+		const Vector3 e = max - min;
+		return 2.0f * ( e.x() * e.y() + e.y() * e.z() + e.z() * e.x() );
+	}
+};
+
+// Аффинное преобразование 3x4 по строкам, как Instance::transform: точка с переносом, вектор без него
+inline Vector3 transformPoint( const float* m, const Vector3& p )
+{
+	return Vector3( m[0] * p.x() + m[1] * p.y() + m[2] * p.z() + m[3],
+		m[4] * p.x() + m[5] * p.y() + m[6] * p.z() + m[7],
+		m[8] * p.x() + m[9] * p.y() + m[10] * p.z() + m[11] );
+}
+
+inline Vector3 transformVector( const float* m, const Vector3& v )
+{
+	return Vector3( m[0] * v.x() + m[1] * v.y() + m[2] * v.z(),
+		m[4] * v.x() + m[5] * v.y() + m[6] * v.z(),
+		m[8] * v.x() + m[9] * v.y() + m[10] * v.z() );
+}
+
+// Нормаль переводится транспонированной обратной матрицей: inverse - обратная к преобразованию точек
+inline Vector3 transformNormal( const float* inverse, const Vector3& n )
+{
+	return Vector3( inverse[0] * n.x() + inverse[4] * n.y() + inverse[8] * n.z(),
+		inverse[1] * n.x() + inverse[5] * n.y() + inverse[9] * n.z(),
+		inverse[2] * n.x() + inverse[6] * n.y() + inverse[10] * n.z() );
+}
+
+//можно использовать точку и дистанцию
+inline float intersectPlane( Ray ray,  Vector3 poinOnPlane, Vector3 normPlane, float tMin, float tMax )
+{
+	float t =  dot( (poinOnPlane - ray.origin ) , normPlane ) / dot( ray.direction , normPlane );
+	if ( t > tMin && t < tMax )
+	{
+		return t;
+	}
+	else
+	{
+		return tMax;
+	}
+}
+
+inline float intersectPlane2( const Ray& ray, const Vector3& normal, float d, float tMin, float tMax )
+ {
+	const float dist = dot( normal, ray.origin ) - d;
+	const float dotND = dot( ray.direction, normal );
+	if ( dotND == 0.0 )
+	{
+		if ( dist == 0.0 && tMin == 0.0)
+		{
+			return 0.0;
+		}
+		return tMax;
+	}
+	const float t = dist / -dotND;
+	if ( t< tMin || t > tMax )
+		return tMax;
+	return t;
+}
+
+inline float intersectTriangle( const Ray& ray, const Vector3& a, const Vector3& b, const Vector3& c, float tMin, float tMax )
+{
+	const Vector3 normal = unit_vector( cross( b- a, c - a ) );
+	const float d = dot( normal, a );
+	const float t = intersectPlane2( ray, normal, d, tMin, tMax );
+	if ( t == tMax )
+		return tMax;
+	const Vector3 p = ray.origin + ray.direction * t;
+	if ( dot( cross( b - a, p - a ), normal ) < 0.0f )
+		return tMax;
+	if ( dot( cross( c - b, p - b ), normal ) < 0.0f )
+		return tMax;
+	if ( dot( cross( a - c, p - c ), normal ) < 0.0f )
+		return tMax;
+	return t;
+}
+
+// Треугольник для Moller-Trumbore: вершина и два ребра из нее, считаются один раз при построении BVH
+struct TriangleEdges
+{
+	Vector3 v0;
+	Vector3 e1;
+	Vector3 e2;
+};
+
+inline TriangleEdges makeTriangleEdges( const Vector3& a, const Vector3& b, const Vector3& c )
+{
+	TriangleEdges r;
+	r.v0 = a;
+	r.e1 = b - a;
+	r.e2 = c - a;
+	return r;
+}
+
+// Moller-Trumbore, двусторонний
+inline float intersectTriangleEdges( const Ray& ray, const Vector3& v0, const Vector3& e1, const Vector3& e2, float tMin, float tMax )
+{
+	const Vector3 p = cross( ray.direction, e2 );
+	const float det = dot( e1, p );
+	if ( det == 0.0f )
+		return tMax;
+	const float invDet = 1.0f / det;
+	const Vector3 s = ray.origin - v0;
+	const float u = dot( s, p ) * invDet;
+	if ( u < 0.0f || u > 1.0f )
+		return tMax;
+	const Vector3 q = cross( s, e1 );
+	const float v = dot( ray.direction, q ) * invDet;
+	if ( v < 0.0f || u + v > 1.0f )
+		return tMax;
+	const float t = dot( e2, q ) * invDet;
+	if ( t < tMin || t > tMax )
+		return tMax;
+	return t;
+}
+
+inline float intersectTriangle( const Ray& ray, const TriangleEdges& tr, float tMin, float tMax )
+{
+	return intersectTriangleEdges( ray, tr.v0, tr.e1, tr.e2, tMin, tMax );
+}
+
+inline float intersectSphere(const Ray& ray, const Vector3& center, float radius, float tMin, float tMax)
+{
+	const Vector3 origin = ray.origin - center; // сдвигаем сферу в центр
+	const float A = 1;
+	const float B = 2.0f * dot( origin, ray.direction );
+	const float C = dot( origin, origin ) - radius * radius;
+	const float D = B * B - 4 * A * C;
+	if ( D < 0.0f )
+		return tMax;
+	const float sqrtD = std::sqrt( D );
+	const float t0 = ( -B - sqrtD ) / ( 2.0f * A );
+	if ( t0 >= tMin && t0 < tMax ) return t0;
+	const float t1 = (-B + sqrtD) / (2.0f * A);
+	if ( t1 >= tMin && t1 < tMax ) return t1;
+	return tMax;
+}
+
+// Slab test, возвращает расстояние входа в бокс или tMax если промах
+inline float intersectAABB( const AABB& box, const Vector3& origin, const Vector3& invDir, float tMin, float tMax )
+{
+	float t0 = tMin;
+	float t1 = tMax;
+	for ( int i = 0; i < 3; ++i )
+	{
+		float tNear = ( box.min[i] - origin[i] ) * invDir[i];
+		float tFar = ( box.max[i] - origin[i] ) * invDir[i];
+		if ( tNear > tFar )
+			std::swap( tNear, tFar );
+		t0 = tNear > t0 ? tNear : t0;
+		t1 = tFar < t1 ? tFar : t1;
+		if ( t0 > t1 )
+			return tMax;
+	}
+	return t0;
+}
@@ -0,0 +1,216 @@
+#include "image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "kernels.h"
+#include "thread_pool.h"
+
+namespace {
+	const int SRGB_LUT_SIZE = 1 << 16;
+
+	// pow() на каждый канал слишком дорогой, значения после тонмаппинга в [0, 1]
+	struct SrgbLut
+	{
+		std::uint8_t values[SRGB_LUT_SIZE];
+
+		SrgbLut()
+		{
+			for ( int i = 0; i < SRGB_LUT_SIZE; ++i )
+				values[i] = (std::uint8_t)std::clamp( srgb( float( i ) / ( SRGB_LUT_SIZE - 1 ) ) * 255, 0.0f, 255.0f );
+		}
+
+		std::uint8_t operator()( float x ) const
+		{
+			// !( x > 0 ) ловит и NaN
+			if ( !( x > 0.0f ) )
+				return values[0];
+			if ( x >= 1.0f )
+				return values[SRGB_LUT_SIZE - 1];
+			return values[int( x * ( SRGB_LUT_SIZE - 1 ) + 0.5f )];
+		}
+	};
+
+	const SrgbLut& srgbLut()
+	{
+		static const SrgbLut lut;
+		return lut;
+	}
+
+	void tonemapRow( const Vector3* in, std::uint8_t* out, int width, float* scratch, bool tonemap )
+	{
+		const int count = width * 3;
+		for ( int x = 0; x < width; ++x )
+		{
+			scratch[x * 3 + 0] = in[x].x();
+			scratch[x * 3 + 1] = in[x].y();
+			scratch[x * 3 + 2] = in[x].z();
+		}
+
+		float white[3] = { 1.0f, 1.0f, 1.0f };
+		if ( tonemap )
+		{
+			// Кривая Uncharted 2 - ядром выбранного набора инструкций, точка белого - ей же
+			kernels().tonemap( scratch, count );
+			float curveWhite[3] = { 11.20f, 11.30f, 11.20f };
+			kernels().tonemap( curveWhite, 3 );
+			for ( int k = 0; k < 3; ++k )
+				white[k] = 1.0f / curveWhite[k];
+		}
+		const SrgbLut& lut = srgbLut();
+		for ( int x = 0; x < width; ++x )
+		{
+			out[x * 3 + 0] = lut( scratch[x * 3 + 0] * white[0] );
+			out[x * 3 + 1] = lut( scratch[x * 3 + 1] * white[1] );
+			out[x * 3 + 2] = lut( scratch[x * 3 + 2] * white[2] );
+		}
+	}
+
+	// Пишет во временный файл и переименовывает: читатель никогда не видит недописанную картинку
+	bool writeFile( const std::string& path, const std::string& header, const void* data, size_t size )
+	{
+		const std::string temp = path + ".tmp";
+		{
+			std::ofstream outfile( temp, std::ios::out | std::ios::binary );
+			if ( !outfile.is_open() )
+			{
+				printf( "Error: Could not open %s for writing.\n", temp.c_str() );
+				return false;
+			}
+			outfile.write( header.data(), header.size() );
+			outfile.write( static_cast<const char*>( data ), size );
+			if ( !outfile )
+			{
+				printf( "Error: Could not write %s.\n", temp.c_str() );
+				return false;
+			}
+		}
+		// На Windows rename не заменяет существующий файл
+		if ( std::rename( temp.c_str(), path.c_str() ) != 0 )
+		{
+			std::remove( path.c_str() );
+			if ( std::rename( temp.c_str(), path.c_str() ) != 0 )
+			{
+				printf( "Error: Could not write %s.\n", path.c_str() );
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+bool parseImageFormat( const std::string& name, const std::string& path, ImageFormat& format )
+{
+	if ( name.empty() )
+	{
+		const size_t dot = path.rfind( '.' );
+		const std::string ext = dot == std::string::npos ? std::string() : path.substr( dot + 1 );
+		format = ( ext == "pfm" || ext == "PFM" ) ? ImageFormat::PFM : ImageFormat::P6;
+		return true;
+	}
+	if ( name == "p3" )
+		format = ImageFormat::P3;
+	else if ( name == "p6" )
+		format = ImageFormat::P6;
+	else if ( name == "pfm" )
+		format = ImageFormat::PFM;
+	else
+		return false;
+	return true;
+}
+
+float srgb( float x )
+{
+	return std::pow( x, 1.f / 2.2f );
+}
+
+Vector3 tonemapping( const Vector3& color )
+{
+	return Vector3( std::min( 1.0f, color.x() ), std::min( 1.0f, color.y() ), std::min( 1.0f, color.z() ) );
+}
+
+Vector3 tonemappingUncharted( const Vector3& color )
+{
+	const Vector3 A = Vector3( 0.15f, 0.15f, 0.15f );
+	const Vector3 B = Vector3( 0.50f, 0.50f, 0.50f );
+	const Vector3 C = Vector3( 0.10f, 0.10f, 0.10f );
+	const Vector3 D = Vector3( 0.20f, 0.20f, 0.20f );
+	const Vector3 E = Vector3( 0.02f, 0.02f, 0.02f );
+	const Vector3 F = Vector3( 0.30f, 0.30f, 0.30f );
+	const Vector3 wPoint = Vector3(11.20f, 11.30f, 11.20f);
+
+	auto applay = [&](const Vector3& c) {
+		return ((c * (A * c + C * B) + D * E) / (c * (A * c + B) + D * F)) - E / F;
+		};
+
+	return applay(color) * (Vector3(1.0, 1.0f, 1.0f) / applay(wPoint));
+}
+
+void tonemapImage( int width, int height, const std::vector<Vector3>& data, std::vector<std::uint8_t>& rgb, ThreadPool& pool, bool tonemap )
+{
+	rgb.resize( size_t( width ) * height * 3 );
+	srgbLut();
+
+	// По одной задаче на строку, scratch свой на каждую строку
+	pool.parallelFor( height, [&]( size_t y ) {
+		std::vector<float> scratch( width * 3 );
+		tonemapRow( &data[y * width], &rgb[y * width * 3], width, scratch.data(), tonemap );
+	} );
+}
+
+bool saveImageToFile( const std::string& path, ImageFormat format, int width, int height, const std::vector<Vector3>& data, ThreadPool& pool, bool tonemap )
+{
+	const std::string size = std::to_string( width ) + " " + std::to_string( height ) + "\n";
+	bool ok = false;
+
+	if ( format == ImageFormat::PFM )
+	{
+		// PFM хранит строки снизу вверх, -1.0 - little endian
+		std::vector<float> rows( size_t( width ) * height * 3 );
+		// Покомпонентно: с PBR_SSE_VECTOR у Vector3 четыре float
+		for ( int y = 0; y < height; ++y )
+		{
+			float* row = &rows[size_t( height - 1 - y ) * width * 3];
+			const Vector3* in = &data[size_t( y ) * width];
+			for ( int x = 0; x < width; ++x )
+			{
+				row[x * 3 + 0] = in[x].x();
+				row[x * 3 + 1] = in[x].y();
+				row[x * 3 + 2] = in[x].z();
+			}
+		}
+		ok = writeFile( path, "PF\n" + size + "-1.0\n", rows.data(), rows.size() * sizeof( float ) );
+	}
+	else
+	{
+		std::vector<std::uint8_t> rgb;
+		tonemapImage( width, height, data, rgb, pool, tonemap );
+
+		if ( format == ImageFormat::P6 )
+		{
+			ok = writeFile( path, "P6\n" + size + "255\n", rgb.data(), rgb.size() );
+		}
+		else
+		{
+			std::string text;
+			text.reserve( rgb.size() * 4 + height );
+			for ( int y = 0; y < height; ++y )
+			{
+				for ( int x = 0; x < width * 3; ++x )
+				{
+					text += std::to_string( rgb[size_t( y ) * width * 3 + x] );
+					text += ' ';
+				}
+				text += '\n';
+			}
+			ok = writeFile( path, "P3\n" + size + "255\n", text.data(), text.size() );
+		}
+	}
+
+	if ( ok )
+		printf( "Image saved to %s\n", path.c_str() );
+	return ok;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../src/vector.h"
+
+class ThreadPool;
+
+enum class ImageFormat
+{
+	P3,  // ASCII PPM
+	P6,  // бинарный PPM
+	PFM, // float HDR без тонмаппинга
+};
+
+// "p3", "p6", "pfm"; пустая строка - по расширению файла (.pfm или PPM P6)
+bool parseImageFormat( const std::string& name, const std::string& path, ImageFormat& format );
+
+float srgb( float x );
+Vector3 tonemapping( const Vector3& color );
+Vector3 tonemappingUncharted( const Vector3& color );
+
+// Тонмаппинг + sRGB в 8 бит, построчно на пуле. Без tonemap значения только обрезаются до [0, 1].
+void tonemapImage( int width, int height, const std::vector<Vector3>& data, std::vector<std::uint8_t>& rgb, ThreadPool& pool, bool tonemap = true );
+
+bool saveImageToFile( const std::string& path, ImageFormat format, int width, int height, const std::vector<Vector3>& data, ThreadPool& pool, bool tonemap = true );
@@ -0,0 +1,397 @@
+#include "integrator.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "bsdf.h"
+#include "kernels.h"
+
+namespace {
+	// Отскоков, которые трассируются пакетом, и сколько лучей нужно, чтобы пакет окупился
+	const int PACKET_BOUNCES = 2;
+	const int PACKET_MIN_RAYS = 4;
+	// С этого числа плоскостей луч проверяет их SIMD-ядром по SoA массивам сцены. Блок ядра -
+	// SCENE_SOA_WIDTH плоскостей, при 8 он еще медленнее скалярного цикла, при 16 уже быстрее
+	const size_t PLANE_KERNEL_MIN = 12;
+
+	// Степенная эвристика MIS (beta = 2)
+	float powerHeuristic( float pdfA, float pdfB )
+	{
+		const float a = pdfA * pdfA;
+		const float b = pdfB * pdfB;
+		return a / ( a + b );
+	}
+
+	// Вершина пути в точке hit или уход в фон: вклад в radiance, AOV и следующий луч в path.ray.
+	// false - путь закончен.
+	bool shadeHit( PathState& path, const SceneHit& hit, const Scene& scene, const BVH& bvh, const LightSampler& lights,
+		const IntegratorSettings& settings, Sampler& sampler, PathStats& stats )
+	{
+		sampler.startBounce( path.depth );
+
+		if ( hit.t == RAY_T_MAX )
+		{
+			shadeMiss( path, scene, stats );
+			return false;
+		}
+
+		Vector3 normal = hit.normal;
+		if ( dot( normal, path.ray.direction ) > 0.0 )
+			normal = -normal;
+		const Material m = scene.material( hit.matIndex );
+		if ( !shadeEmission( path, hit, m, normal, lights, settings, stats ) )
+			return false;
+
+		float u1, u2;
+		sampler.get2D( u1, u2 );
+		const BsdfSample bs = sampleBsdf( m, normal, path.ray.direction, u1, u2 );
+		const Vector3 hitPoint = path.ray.origin + path.ray.direction * hit.t;
+
+		Ray shadow;
+		float shadowT;
+		Vector3 contribution;
+		if ( !bs.specular && !lights.empty() && sampleLight( path, lights, m, hitPoint, normal, sampler, shadow, shadowT, contribution ) &&
+			!occluded( shadow, scene, bvh, RAY_T_MIN, shadowT ) )
+			path.radiance += contribution;
+
+		return continuePath( path, bs, hitPoint, normal, settings, sampler, stats );
+	}
+}
+
+bool parseIntegratorType( const std::string& name, IntegratorType& type )
+{
+	if ( name == "path" )
+		type = IntegratorType::Path;
+	else if ( name == "wavefront" )
+		type = IntegratorType::Wavefront;
+	else
+		return false;
+	return true;
+}
+
+const char* integratorName( IntegratorType type )
+{
+	switch ( type )
+	{
+	case IntegratorType::Path:
+		return "path";
+	case IntegratorType::Wavefront:
+		return "wavefront";
+	}
+	return "unknown";
+}
+
+SceneHit intersectScene( const Ray& ray, const Scene& scene, const BVH& bvh )
+{
+	SceneHit result;
+	Hit hit;
+	if ( bvh.intersect( ray, RAY_T_MIN, RAY_T_MAX, hit ) )
+	{
+		result.t = hit.t;
+		result.normal = hit.normal;
+		result.matIndex = hit.matIndex;
+	}
+
+	// Плоскости бесконечные, поэтому в BVH их нет
+	if ( scene.planes().size() < PLANE_KERNEL_MIN )
+	{
+		for ( const auto& p : scene.planes() )
+		{
+			const float t = intersectPlane2( ray, p.normal, p.dist, RAY_T_MIN, result.t );
+			if ( t < result.t )
+			{
+				result.t = t;
+				result.normal = p.normal;
+				result.matIndex = p.matIndex;
+				result.plane = true;
+			}
+		}
+		return result;
+	}
+	const std::int32_t plane = kernels().closestPlane( ray, scene.planeSoa(), RAY_T_MIN, result.t );
+	if ( plane >= 0 )
+	{
+		const Plane& p = scene.planes()[plane];
+		result.normal = p.normal;
+		result.matIndex = p.matIndex;
+		result.plane = true;
+	}
+	return result;
+}
+
+void intersectScene( const Ray* rays, const Scene& scene, const BVH& bvh, SceneHit* result )
+{
+	Hit hits[PACKET_SIZE];
+	const unsigned mask = bvh.intersectPacket( rays, RAY_T_MIN, RAY_T_MAX, hits );
+	float t[PACKET_SIZE];
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+	{
+		result[i] = SceneHit();
+		if ( mask & ( 1u << i ) )
+		{
+			result[i].t = hits[i].t;
+			result[i].normal = hits[i].normal;
+			result[i].matIndex = hits[i].matIndex;
+		}
+		t[i] = result[i].t;
+	}
+	if ( scene.planes().empty() )
+		return;
+
+	PacketRays packet;
+	makePacketRays( rays, packet );
+	std::int32_t hitPlane[PACKET_SIZE];
+	std::fill( hitPlane, hitPlane + PACKET_SIZE, -1 );
+	if ( !kernels().intersectPlanes( packet, makeKernelScene( scene ), RAY_T_MIN, t, hitPlane ) )
+		return;
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+	{
+		if ( hitPlane[i] < 0 )
+			continue;
+		const Plane& p = scene.planes()[hitPlane[i]];
+		result[i].t = t[i];
+		result[i].normal = p.normal;
+		result[i].matIndex = p.matIndex;
+		result[i].plane = true;
+	}
+}
+
+bool occluded( const Ray& ray, const Scene& scene, const BVH& bvh, float tMin, float tMax )
+{
+	// Плоскости дешевле обхода, с них и начинаем
+	if ( scene.planes().size() < PLANE_KERNEL_MIN )
+	{
+		for ( const auto& p : scene.planes() )
+		{
+			if ( intersectPlane2( ray, p.normal, p.dist, tMin, tMax ) < tMax )
+				return true;
+		}
+	}
+	else if ( kernels().occludedPlanes( ray, scene.planeSoa(), tMin, tMax ) )
+	{
+		return true;
+	}
+	return bvh.occluded( ray, tMin, tMax );
+}
+
+unsigned occluded( const Ray* rays, const Scene& scene, const BVH& bvh, float tMin, const float* tMax )
+{
+	unsigned mask = 0;
+	if ( !scene.planes().empty() )
+	{
+		PacketRays packet;
+		makePacketRays( rays, packet );
+		float t[PACKET_SIZE];
+		std::int32_t hitPlane[PACKET_SIZE];
+		std::copy( tMax, tMax + PACKET_SIZE, t );
+		std::fill( hitPlane, hitPlane + PACKET_SIZE, -1 );
+		if ( kernels().intersectPlanes( packet, makeKernelScene( scene ), tMin, t, hitPlane ) )
+		{
+			for ( int i = 0; i < PACKET_SIZE; ++i )
+				mask |= hitPlane[i] >= 0 ? 1u << i : 0u;
+		}
+	}
+	const unsigned all = ( 1u << PACKET_SIZE ) - 1;
+	if ( mask == all )
+		return mask;
+	return mask | bvh.occludedPacket( rays, tMin, tMax, all & ~mask );
+}
+
+void shadeMiss( PathState& path, const Scene& scene, PathStats& stats )
+{
+	if ( path.aov )
+		*path.aov = PathAov{ path.aovTint, Vector3( 0, 0, 0 ), RAY_T_MAX };
+	path.radiance += path.throughput * scene.enviroment();
+	stats.record( PathStats::ESCAPED, path.depth );
+}
+
+bool shadeEmission( PathState& path, const SceneHit& hit, const Material& m, const Vector3& normal,
+	const LightSampler& lights, const IntegratorSettings& settings, PathStats& stats )
+{
+	path.aovDepth += hit.t;
+	if ( path.aov && ( !isSpecular( m ) || path.depth >= settings.maxDepth ) )
+	{
+		*path.aov = PathAov{ path.aovTint * m.albedo, normal, path.aovDepth };
+		path.aov = nullptr;
+	}
+	else if ( path.aov )
+	{
+		path.aovTint = path.aovTint * m.albedo;
+	}
+
+	// Попадание в источник, который на предыдущем отскоке уже сэмплировался явно:
+	// вес MIS со стороны BSDF, плотность выбора точки переводим в телесный угол
+	Vector3 emission = m.emmision;
+	if ( path.bsdfPdf > 0.0f && !hit.plane && !lights.empty() && luminance( emission ) > 0.0f )
+	{
+		const float cosLight = -dot( normal, path.ray.direction );
+		const float lightPdf = cosLight > 0.0f ? lights.pdfArea( emission ) * hit.t * hit.t / cosLight : 0.0f;
+		emission *= powerHeuristic( path.bsdfPdf, lightPdf );
+	}
+	path.radiance += path.throughput * emission;
+
+	if ( path.depth >= settings.maxDepth )
+	{
+		stats.record( PathStats::MAX_DEPTH, path.depth );
+		return false;
+	}
+	return true;
+}
+
+bool sampleLight( const PathState& path, const LightSampler& lights, const Material& m, const Vector3& hitPoint,
+	const Vector3& normal, Sampler& sampler, Ray& shadow, float& shadowT, Vector3& contribution )
+{
+	// Точка на источнике - парой соседних измерений, выбор источника - отдельным
+	float u1, u2;
+	sampler.get2D( u1, u2 );
+	const float u0 = sampler.get1D();
+	const LightSample ls = lights.sample( u0, u1, u2 );
+	const Vector3 toLight = ls.position - hitPoint;
+	const float dist2 = toLight.length_squared();
+	const float dist = std::sqrt( dist2 );
+	const Vector3 wi = toLight / dist;
+	const float cosSurface = dot( wi, normal );
+	const float cosLight = std::abs( dot( wi, ls.normal ) );
+	if ( cosSurface <= 0.0f || cosLight <= 0.0f )
+		return false;
+
+	const float lightPdf = ls.pdfArea * dist2 / cosLight;
+	shadow = Ray{ hitPoint + normal * 1e-4f, wi };
+	shadowT = dist - RAY_T_MIN;
+	contribution = path.throughput * ( ls.emission * evalBsdf( m, normal, wi ) * ( cosSurface / lightPdf * powerHeuristic( lightPdf, pdfBsdf( m, normal, wi ) ) ) );
+	return true;
+}
+
+bool continuePath( PathState& path, const BsdfSample& bs, const Vector3& hitPoint, const Vector3& normal,
+	const IntegratorSettings& settings, Sampler& sampler, PathStats& stats )
+{
+	path.throughput = path.throughput * bs.weight;
+
+	// Русская рулетка: путь выживает с вероятностью по наибольшей компоненте throughput,
+	// выжившие компенсируются делением. Зеркала с albedo 1 почти не обрываются.
+	if ( path.depth + 1 >= settings.rouletteDepth )
+	{
+		const float survive = std::min( 1.0f, std::max( path.throughput.x(), std::max( path.throughput.y(), path.throughput.z() ) ) );
+		if ( sampler.get1D() >= survive )
+		{
+			// Оборванная цепочка зеркал: AOV по последнему зеркалу
+			if ( path.aov )
+				*path.aov = PathAov{ path.aovTint, normal, path.aovDepth };
+			stats.record( PathStats::ROULETTE, path.depth );
+			return false;
+		}
+		path.throughput *= 1.0f / survive;
+	}
+
+	path.ray = Ray{ hitPoint + bs.direction * 1e-4f, bs.direction };
+	path.bsdfPdf = bs.specular ? 0.0f : bs.pdf;
+	path.depth++;
+	return true;
+}
+
+void PathStats::record( End end, int depth )
+{
+	std::vector<std::uint64_t>& l = lengths[end];
+	if ( l.size() <= size_t( depth ) )
+		l.resize( depth + 1, 0 );
+	l[depth]++;
+}
+
+void PathStats::merge( const PathStats& other )
+{
+	for ( int e = 0; e < END_COUNT; ++e )
+	{
+		if ( lengths[e].size() < other.lengths[e].size() )
+			lengths[e].resize( other.lengths[e].size(), 0 );
+		for ( size_t i = 0; i < other.lengths[e].size(); ++i )
+			lengths[e][i] += other.lengths[e][i];
+	}
+}
+
+void PathStats::print() const
+{
+	size_t maxLength = 0;
+	std::uint64_t total[END_COUNT] = {};
+	std::uint64_t paths = 0;
+	std::uint64_t bounces = 0;
+	for ( int e = 0; e < END_COUNT; ++e )
+	{
+		maxLength = std::max( maxLength, lengths[e].size() );
+		for ( size_t i = 0; i < lengths[e].size(); ++i )
+		{
+			total[e] += lengths[e][i];
+			bounces += lengths[e][i] * i;
+		}
+		paths += total[e];
+	}
+	if ( paths == 0 )
+		return;
+
+	std::printf( "Paths: %llu, %.2f bounces on average, escaped %.1f%%, roulette %.1f%%, max depth %.1f%%\n",
+		(unsigned long long)paths, double( bounces ) / paths,
+		100.0 * total[ESCAPED] / paths, 100.0 * total[ROULETTE] / paths, 100.0 * total[MAX_DEPTH] / paths );
+	std::printf( "  bounces  escaped  roulette  max depth\n" );
+	for ( size_t i = 0; i < maxLength; ++i )
+	{
+		std::uint64_t n[END_COUNT] = {};
+		for ( int e = 0; e < END_COUNT; ++e )
+			n[e] = i < lengths[e].size() ? lengths[e][i] : 0;
+		if ( n[ESCAPED] + n[ROULETTE] + n[MAX_DEPTH] == 0 )
+			continue;
+		std::printf( "  %7zu  %6.2f%%  %7.2f%%  %8.2f%%\n", i,
+			100.0 * n[ESCAPED] / paths, 100.0 * n[ROULETTE] / paths, 100.0 * n[MAX_DEPTH] / paths );
+	}
+}
+
+Vector3 trace( const Ray& ray, const Scene& scene, const BVH& bvh, const LightSampler& lights,
+	const IntegratorSettings& settings, Sampler& sampler, PathStats& stats, PathAov* aov )
+{
+	PathState path{ ray, Vector3( 1, 1, 1 ), Vector3( 0, 0, 0 ), 0, 0.0f, aov };
+	while ( shadeHit( path, intersectScene( path.ray, scene, bvh ), scene, bvh, lights, settings, sampler, stats ) )
+	{
+	}
+	return path.radiance;
+}
+
+void tracePacket( const CameraSample* samples, int count, const Scene& scene, const BVH& bvh, const LightSampler& lights,
+	const IntegratorSettings& settings, Sampler* const* samplers, PathStats& stats, Vector3* radiance, PathAov* aovs )
+{
+	count = std::min( count, PACKET_SIZE );
+	PathState paths[PACKET_SIZE];
+	bool alive[PACKET_SIZE];
+	for ( int i = 0; i < count; ++i )
+	{
+		paths[i] = PathState{ samples[i].ray, Vector3( 1, 1, 1 ), Vector3( 0, 0, 0 ), 0, 0.0f, aovs ? &aovs[i] : nullptr };
+		alive[i] = true;
+	}
+
+	// Отскок 0 - лучи камеры, отскок 1 - только отражения от зеркал: они остаются почти
+	// параллельными, а после диффузного отскока пакет рассыпается
+	Ray packet[PACKET_SIZE];
+	SceneHit hits[PACKET_SIZE];
+	int lanes[PACKET_SIZE];
+	for ( int depth = 0; depth < PACKET_BOUNCES; ++depth )
+	{
+		int n = 0;
+		for ( int i = 0; i < count; ++i )
+		{
+			if ( alive[i] && ( depth == 0 || paths[i].bsdfPdf == 0.0f ) )
+				lanes[n++] = i;
+		}
+		if ( n < PACKET_MIN_RAYS )
+			break;
+		for ( int i = 0; i < PACKET_SIZE; ++i )
+			packet[i] = paths[lanes[std::min( i, n - 1 )]].ray;
+		intersectScene( packet, scene, bvh, hits );
+		for ( int i = 0; i < n; ++i )
+			alive[lanes[i]] = shadeHit( paths[lanes[i]], hits[i], scene, bvh, lights, settings, *samplers[lanes[i]], stats );
+	}
+
+	for ( int i = 0; i < count; ++i )
+	{
+		while ( alive[i] && shadeHit( paths[i], intersectScene( paths[i].ray, scene, bvh ), scene, bvh, lights, settings, *samplers[i], stats ) )
+		{
+		}
+		radiance[i] = paths[i].radiance;
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "geometry.h"
+#include "lights.h"
+#include "sampler.h"
+#include "../src/scene.h"
+
+struct BsdfSample;
+
+enum class IntegratorType
+{
+	Path,      // путь от камеры до конца, сэмпл за сэмплом
+	Wavefront, // пачка путей по отскокам: пересечения, шейдинг по типам материалов, теневые лучи
+};
+
+bool parseIntegratorType( const std::string& name, IntegratorType& type );
+const char* integratorName( IntegratorType type );
+
+// Ближе RAY_T_MIN попадания не считаются (самопересечение), дальше RAY_T_MAX - фон
+const float RAY_T_MIN = 0.001f;
+const float RAY_T_MAX = 10000.0f;
+
+struct IntegratorSettings
+{
+	int maxDepth = 16;   // максимум отскоков, после него путь обрывается
+	int rouletteDepth = 3; // с этого отскока включается русская рулетка
+};
+
+struct PathAov;
+
+// Состояние пути между отскоками
+struct PathState
+{
+	Ray ray;
+	Vector3 throughput; // произведение весов BSDF вдоль пути
+	Vector3 radiance;   // накопленный вклад
+	int depth;
+	float bsdfPdf; // плотность выбора ray, 0 для камеры и зеркала
+	// Для AOV: куда записать, оттенок пройденных зеркал и длина пути до текущей вершины
+	PathAov* aov = nullptr;
+	Vector3 aovTint = Vector3( 1, 1, 1 );
+	float aovDepth = 0.0f;
+};
+
+// Статистика завершения путей по числу отскоков. Заполняется в потоке и сливается через merge.
+struct PathStats
+{
+	enum End { ESCAPED, ROULETTE, MAX_DEPTH, END_COUNT };
+
+	std::vector<std::uint64_t> lengths[END_COUNT];
+
+	void record( End end, int depth );
+	void merge( const PathStats& other );
+	void print() const;
+};
+
+// Вспомогательные буферы для шумодава: первая незеркальная вершина пути.
+// Зеркала проходятся насквозь, их albedo домножается. Для ушедшего в фон пути
+// albedo - оттенок зеркал (1 без них), нормаль нулевая, глубина RAY_T_MAX.
+struct PathAov
+{
+	Vector3 albedo;
+	Vector3 normal;
+	float depth = 0.0f; // длина пути от камеры
+};
+
+// Луч камеры и сэмпл, которому он принадлежит: по пикселю и номеру сэмпла
+// сэмплер восстанавливает измерения пути на любом отскоке
+struct CameraSample
+{
+	Ray ray;
+	std::uint32_t x;
+	std::uint32_t y;
+	std::uint32_t index;
+};
+
+// Ближайшее попадание луча в сцену, t == RAY_T_MAX - промах
+struct SceneHit
+{
+	float t = RAY_T_MAX;
+	Vector3 normal;
+	int matIndex = 0;
+	bool plane = false;
+};
+
+SceneHit intersectScene( const Ray& ray, const Scene& scene, const BVH& bvh );
+// То же для PACKET_SIZE лучей одним обходом
+void intersectScene( const Ray* rays, const Scene& scene, const BVH& bvh, SceneHit* hits );
+// Есть ли препятствие на отрезке луча (tMin, tMax): поиск до первого попадания, без нормали и материала
+bool occluded( const Ray& ray, const Scene& scene, const BVH& bvh, float tMin, float tMax );
+// То же для PACKET_SIZE лучей со своими tMax[i] одним обходом, бит i результата - луч i перекрыт
+unsigned occluded( const Ray* rays, const Scene& scene, const BVH& bvh, float tMin, const float* tMax );
+
+// Этапы вершины пути, из которых собраны trace и волновой интегратор. Сэмплер должен быть
+// на отскоке path.depth, измерения тратятся в порядке: BSDF (get2D), sampleLight, continuePath.
+// normal везде развернута навстречу лучу.
+
+// Путь ушел в фон
+void shadeMiss( PathState& path, const Scene& scene, PathStats& stats );
+// Излучение в точке попадания с весом MIS и AOV. false - путь достиг maxDepth.
+bool shadeEmission( PathState& path, const SceneHit& hit, const Material& m, const Vector3& normal,
+	const LightSampler& lights, const IntegratorSettings& settings, PathStats& stats );
+// Next event estimation без проверки видимости: теневой луч до точки на источнике длиной shadowT
+// и вклад в radiance, если точка видна. false - вклада нет, луч не нужен.
+bool sampleLight( const PathState& path, const LightSampler& lights, const Material& m, const Vector3& hitPoint,
+	const Vector3& normal, Sampler& sampler, Ray& shadow, float& shadowT, Vector3& contribution );
+// Вес BSDF, русская рулетка и следующий луч в path.ray. false - путь оборван.
+bool continuePath( PathState& path, const BsdfSample& bs, const Vector3& hitPoint, const Vector3& normal,
+	const IntegratorSettings& settings, Sampler& sampler, PathStats& stats );
+
+// Трассировка пути из камеры: NEE в диффузных вершинах с MIS и русская рулетка по throughput.
+// aov, если задан, заполняется на первой незеркальной вершине.
+Vector3 trace( const Ray& ray, const Scene& scene, const BVH& bvh, const LightSampler& lights,
+	const IntegratorSettings& settings, Sampler& sampler, PathStats& stats, PathAov* aov = nullptr );
+
+// Те же пути для count <= PACKET_SIZE сэмплов: лучи камеры и отражения от зеркал на первом
+// отскоке обходят сцену пакетом, дальше пути идут по одному. Результат пути i тот же, что у trace
+// с samplers[i]: radiance[i] и, если aovs задан, aovs[i].
+void tracePacket( const CameraSample* samples, int count, const Scene& scene, const BVH& bvh, const LightSampler& lights,
+	const IntegratorSettings& settings, Sampler* const* samplers, PathStats& stats, Vector3* radiance, PathAov* aovs );
@@ -0,0 +1,186 @@
+#include "kernels.h"
+
+#if defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+#include <intrin.h>
+#endif
+
+// Таблицы ядер из kernels_<isa>.cpp; какие варианты собраны, решает CMakeLists.txt
+extern const Kernels kernelsSse2;
+#if defined( PBR_KERNELS_SSE42 )
+extern const Kernels kernelsSse42;
+#endif
+#if defined( PBR_KERNELS_AVX2 )
+extern const Kernels kernelsAvx2;
+#endif
+#if defined( PBR_KERNELS_AVX512 )
+extern const Kernels kernelsAvx512;
+#endif
+
+namespace {
+	const Kernels* compiledKernels( KernelIsa isa )
+	{
+		switch ( isa )
+		{
+		case KernelIsa::Sse2:
+			return &kernelsSse2;
+#if defined( PBR_KERNELS_SSE42 )
+		case KernelIsa::Sse42:
+			return &kernelsSse42;
+#endif
+#if defined( PBR_KERNELS_AVX2 )
+		case KernelIsa::Avx2:
+			return &kernelsAvx2;
+#endif
+#if defined( PBR_KERNELS_AVX512 )
+		case KernelIsa::Avx512:
+			return &kernelsAvx512;
+#endif
+		default:
+			return nullptr;
+		}
+	}
+
+	bool cpuSupports( KernelIsa isa )
+	{
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+		// Проверяет и поддержку регистров ОС (XSAVE)
+		switch ( isa )
+		{
+		case KernelIsa::Sse2:
+			return __builtin_cpu_supports( "sse2" );
+		case KernelIsa::Sse42:
+			return __builtin_cpu_supports( "sse4.2" );
+		case KernelIsa::Avx2:
+			return __builtin_cpu_supports( "avx2" );
+		case KernelIsa::Avx512:
+			return __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512vl" );
+		}
+		return false;
+#elif defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+		int info[4];
+		__cpuid( info, 1 );
+		const bool sse42 = ( info[2] & ( 1 << 20 ) ) != 0;
+		const bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+		const bool avx = ( info[2] & ( 1 << 28 ) ) != 0;
+		const unsigned long long xcr0 = osxsave ? _xgetbv( 0 ) : 0;
+		// ОС сохраняет YMM, и для AVX-512 еще маски и ZMM
+		const bool ymm = ( xcr0 & 0x6 ) == 0x6;
+		const bool zmm = ( xcr0 & 0xE6 ) == 0xE6;
+		__cpuidex( info, 7, 0 );
+		switch ( isa )
+		{
+		case KernelIsa::Sse2:
+			return true;
+		case KernelIsa::Sse42:
+			return sse42;
+		case KernelIsa::Avx2:
+			return avx && ymm && ( info[1] & ( 1 << 5 ) ) != 0;
+		case KernelIsa::Avx512:
+			return avx && zmm && ( info[1] & ( 1 << 16 ) ) != 0 && ( info[1] & ( 1 << 31 ) ) != 0;
+		}
+		return false;
+#else
+		return isa == KernelIsa::Sse2;
+#endif
+	}
+
+	// Базовый вариант есть всегда и не требует ничего сверх флагов сборки
+	KernelIsa active = KernelIsa::Sse2;
+	const Kernels* activeTable = &kernelsSse2;
+}
+
+bool parseKernelIsa( const std::string& name, KernelIsa& isa )
+{
+	if ( name == "sse2" )
+		isa = KernelIsa::Sse2;
+	else if ( name == "sse4.2" )
+		isa = KernelIsa::Sse42;
+	else if ( name == "avx2" )
+		isa = KernelIsa::Avx2;
+	else if ( name == "avx512" )
+		isa = KernelIsa::Avx512;
+	else
+		return false;
+	return true;
+}
+
+const char* kernelIsaName( KernelIsa isa )
+{
+	switch ( isa )
+	{
+	case KernelIsa::Sse2:
+		return "sse2";
+	case KernelIsa::Sse42:
+		return "sse4.2";
+	case KernelIsa::Avx2:
+		return "avx2";
+	case KernelIsa::Avx512:
+		return "avx512";
+	}
+	return "unknown";
+}
+
+KernelScene makeKernelScene( const Scene& scene, const TriangleEdges* triangles )
+{
+	KernelScene k;
+	k.spheres = scene.spheres().data();
+	k.sphereCount = std::uint32_t( scene.spheres().size() );
+	k.vertices = scene.vertices().data();
+	k.indices = scene.indices().data();
+	k.triangles = triangles;
+	k.planes = scene.planes().data();
+	k.planeCount = std::uint32_t( scene.planes().size() );
+	return k;
+}
+
+void makePacketRays( const Ray* rays, PacketRays& packet )
+{
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+	{
+		const Ray& r = rays[i];
+		packet.ox[i] = r.origin.x();
+		packet.oy[i] = r.origin.y();
+		packet.oz[i] = r.origin.z();
+		packet.dx[i] = r.direction.x();
+		packet.dy[i] = r.direction.y();
+		packet.dz[i] = r.direction.z();
+		packet.ix[i] = 1.0f / r.direction.x();
+		packet.iy[i] = 1.0f / r.direction.y();
+		packet.iz[i] = 1.0f / r.direction.z();
+	}
+}
+
+bool kernelIsaAvailable( KernelIsa isa )
+{
+	return compiledKernels( isa ) != nullptr && cpuSupports( isa );
+}
+
+KernelIsa detectKernelIsa()
+{
+	KernelIsa best = KernelIsa::Sse2;
+	for ( KernelIsa isa : KERNEL_ISAS )
+	{
+		if ( kernelIsaAvailable( isa ) )
+			best = isa;
+	}
+	return best;
+}
+
+bool selectKernels( KernelIsa isa )
+{
+	if ( !kernelIsaAvailable( isa ) )
+		return false;
+	active = isa;
+	activeTable = compiledKernels( isa );
+	return true;
+}
+
+KernelIsa activeKernelIsa()
+{
+	return active;
+}
+
+const Kernels& kernels()
+{
+	return *activeTable;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "packet.h"
+#include "../src/scene.h"
+
+// Горячие SIMD-ядра - пересечения пакета лучей со сферами, треугольниками и плоскостями,
+// проверки видимости и тонмаппинг - собраны в нескольких вариантах набора инструкций, каждый в своем kernels_<isa>.cpp
+// со своими флагами компилятора. Один бинарник работает на любом x86-64, а вариант выбирается
+// при запуске по процессору или флагом --kernels. Все варианты считают те же формулы в том же
+// порядке и без FMA, поэтому результаты у них одинаковые (проверка - --bench kernels).
+enum class KernelIsa
+{
+	Sse2,
+	Sse42,
+	Avx2,
+	Avx512,
+};
+
+const KernelIsa KERNEL_ISAS[] = { KernelIsa::Sse2, KernelIsa::Sse42, KernelIsa::Avx2, KernelIsa::Avx512 };
+
+bool parseKernelIsa( const std::string& name, KernelIsa& isa );
+const char* kernelIsaName( KernelIsa isa );
+
+// Геометрия сцены для ядер: только указатели на массивы, ядра читают их по полям
+struct KernelScene
+{
+	const Sphere* spheres = nullptr;
+	std::uint32_t sphereCount = 0;
+	const Vector3* vertices = nullptr;
+	const std::uint32_t* indices = nullptr; // по три на треугольник
+	const TriangleEdges* triangles = nullptr; // по номеру треугольника сцены из BVH; нет - из индексов
+	const Plane* planes = nullptr;
+	std::uint32_t planeCount = 0;
+};
+
+// triangles - кеш ребер BVH, если он включен
+KernelScene makeKernelScene( const Scene& scene, const TriangleEdges* triangles = nullptr );
+void makePacketRays( const Ray* rays, PacketRays& packet );
+
+struct Kernels
+{
+	// Примитивы BVH prims[0, count): номера меньше sphereCount - сферы, дальше треугольники.
+	// Ближайшее попадание дорожки на [tMin, tHit[l]) записывается в tHit[l], номер примитива -
+	// в hitPrim[l]; равное расстояние примитив не меняет. Возвращает, было ли такое попадание.
+	bool ( *intersectPrims )( const PacketRays& rays, const KernelScene& scene, const std::uint32_t* prims, std::uint32_t count,
+		float tMin, float* tHit, std::uint32_t* hitPrim );
+	// То же для всех плоскостей сцены, hitPlane[l] - номер плоскости
+	bool ( *intersectPlanes )( const PacketRays& rays, const KernelScene& scene, float tMin, float* tHit, std::int32_t* hitPlane );
+	// Проверка видимости: биты дорожек из active, у которых есть хоть одно попадание на
+	// [tMin, tMax[l]). Перебор заканчивается, как только попали все дорожки active.
+	unsigned ( *occludedPrims )( const PacketRays& rays, const KernelScene& scene, const std::uint32_t* prims, std::uint32_t count,
+		float tMin, const float* tMax, unsigned active );
+	// Полный перебор SoA сцены для одного луча, SCENE_SOA_WIDTH примитивов за шаг. Ближайшее
+	// попадание на [tMin, t) записывается в t, возвращается номер примитива или -1.
+	// Результат как у перебора по одному со строгим сравнением: из равных - первый.
+	std::int32_t ( *closestSphere )( const Ray& ray, const SphereSoa& spheres, float tMin, float& t );
+	std::int32_t ( *closestPlane )( const Ray& ray, const PlaneSoa& planes, float tMin, float& t );
+	// Есть ли попадание на [tMin, tMax), перебор до первого блока с попаданием
+	bool ( *occludedSpheres )( const Ray& ray, const SphereSoa& spheres, float tMin, float tMax );
+	bool ( *occludedPlanes )( const Ray& ray, const PlaneSoa& planes, float tMin, float tMax );
+	// Кривая Uncharted 2 по месту
+	void ( *tonemap )( float* values, int count );
+};
+
+// Вариант собран и поддерживается процессором
+bool kernelIsaAvailable( KernelIsa isa );
+// Лучший доступный вариант
+KernelIsa detectKernelIsa();
+// false, если вариант недоступен. Вызывается до запуска потоков.
+bool selectKernels( KernelIsa isa );
+KernelIsa activeKernelIsa();
+const Kernels& kernels();
@@ -0,0 +1,7 @@
+// Ядра для AVX2 (см. kernels.h и CMakeLists.txt)
+#if !defined( __AVX2__ )
+#error "kernels_avx2.cpp must be compiled with AVX2 enabled"
+#endif
+
+#define KERNELS_TABLE kernelsAvx2
+#include "kernels_impl.h"
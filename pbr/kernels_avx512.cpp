@@ -0,0 +1,7 @@
+// Ядра для AVX-512 F и VL (см. kernels.h и CMakeLists.txt)
+#if !defined( __AVX512F__ ) || !defined( __AVX512VL__ )
+#error "kernels_avx512.cpp must be compiled with AVX-512 F and VL enabled"
+#endif
+
+#define KERNELS_TABLE kernelsAvx512
+#include "kernels_impl.h"
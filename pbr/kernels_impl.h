@@ -0,0 +1,344 @@
+// Тело ядер, общее для kernels_<isa>.cpp: файл варианта задает KERNELS_TABLE и включает этот
+// заголовок, а его флаги компилятора выбирают в packet.h ширину регистров.
+// Здесь нельзя вызывать inline-функции общих заголовков (методы Vector3, Scene и т.п.): копия,
+// собранная с AVX, могла бы достаться линкером и коду для процессоров без AVX. Поэтому данные
+// сцены читаются по полям, а все функции - в анонимном пространстве имен.
+// Таблица инициализируется константами: в этих файлах при запуске не выполняется ни одной инструкции.
+
+#include <limits>
+
+#include "kernels.h"
+
+#if !defined( KERNELS_TABLE )
+#error "define KERNELS_TABLE before including kernels_impl.h"
+#endif
+
+namespace {
+	// Вычисляется при компиляции: вызов numeric_limits при -O0 был бы inline-функцией из общего заголовка
+	constexpr float NEG_INF = -std::numeric_limits<float>::infinity();
+
+	// Промах дорожки - tMax
+	Float8 intersectPrim( const RayPacket& packet, const KernelScene& scene, std::uint32_t prim, const Float8& tMin, const Float8& tMax )
+	{
+		if ( prim < scene.sphereCount )
+		{
+			const Sphere& sp = scene.spheres[prim];
+			return intersectSphere( packet, sp.pos.d, sp.radius, tMin, tMax );
+		}
+		if ( scene.triangles )
+		{
+			const TriangleEdges& tr = scene.triangles[prim - scene.sphereCount];
+			return intersectTriangleEdges( packet, tr.v0.d, tr.e1.d, tr.e2.d, tMin, tMax );
+		}
+		const std::uint32_t* idx = scene.indices + size_t( prim - scene.sphereCount ) * 3;
+		const float* v0 = scene.vertices[idx[0]].d;
+		const float* v1 = scene.vertices[idx[1]].d;
+		const float* v2 = scene.vertices[idx[2]].d;
+		const float e1[3] = { v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] };
+		const float e2[3] = { v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] };
+		return intersectTriangleEdges( packet, v0, e1, e2, tMin, tMax );
+	}
+
+	bool intersectPrims( const PacketRays& rays, const KernelScene& scene, const std::uint32_t* prims, std::uint32_t count,
+		float tMin, float* tHit, std::uint32_t* hitPrim )
+	{
+		const RayPacket packet( rays );
+		const Float8 tMinV( tMin );
+		Float8 tMax = Float8::load( tHit );
+		bool found = false;
+		for ( std::uint32_t i = 0; i < count; ++i )
+		{
+			const std::uint32_t prim = prims[i];
+			const Float8 t = intersectPrim( packet, scene, prim, tMinV, tMax );
+			// Промах возвращает tMax, поэтому его можно присваивать целиком
+			const int closer = movemask( t < tMax );
+			if ( closer == 0 )
+				continue;
+			tMax = t;
+			found = true;
+			for ( int l = 0; l < PACKET_SIZE; ++l )
+			{
+				if ( closer & ( 1 << l ) )
+					hitPrim[l] = prim;
+			}
+		}
+		if ( found )
+			tMax.store( tHit );
+		return found;
+	}
+
+	unsigned occludedPrims( const PacketRays& rays, const KernelScene& scene, const std::uint32_t* prims, std::uint32_t count,
+		float tMin, const float* tMax, unsigned active )
+	{
+		const RayPacket packet( rays );
+		const Float8 tMinV( tMin );
+		// Дорожки вне active и уже перекрытые получают tMax = -inf: их не пересекает ни один примитив
+		alignas( 32 ) float t[PACKET_SIZE];
+		for ( int l = 0; l < PACKET_SIZE; ++l )
+			t[l] = active & ( 1u << l ) ? tMax[l] : NEG_INF;
+		Float8 tMaxV = Float8::load( t );
+		const Float8 done( NEG_INF );
+		unsigned result = 0;
+		for ( std::uint32_t i = 0; i < count; ++i )
+		{
+			const Mask8 hit = intersectPrim( packet, scene, prims[i], tMinV, tMaxV ) < tMaxV;
+			const unsigned bits = unsigned( movemask( hit ) );
+			if ( bits == 0 )
+				continue;
+			result |= bits;
+			if ( result == active )
+				break;
+			tMaxV = vselect( hit, done, tMaxV );
+		}
+		return result;
+	}
+
+	bool intersectPlanes( const PacketRays& rays, const KernelScene& scene, float tMin, float* tHit, std::int32_t* hitPlane )
+	{
+		const RayPacket packet( rays );
+		const Float8 tMinV( tMin );
+		Float8 tMax = Float8::load( tHit );
+		bool found = false;
+		for ( std::uint32_t i = 0; i < scene.planeCount; ++i )
+		{
+			const Plane& p = scene.planes[i];
+			const Float8 t = intersectPlane2( packet, p.normal.d, p.dist, tMinV, tMax );
+			const int closer = movemask( t < tMax );
+			if ( closer == 0 )
+				continue;
+			tMax = t;
+			found = true;
+			for ( int l = 0; l < PACKET_SIZE; ++l )
+			{
+				if ( closer & ( 1 << l ) )
+					hitPlane[l] = std::int32_t( i );
+			}
+		}
+		if ( found )
+			tMax.store( tHit );
+		return found;
+	}
+
+#if defined( __AVX512F__ )
+	// 16 дорожек AVX-512 для перебора SoA сцены: операции те же, что у Float8 в packet.h
+	struct Mask16
+	{
+		__mmask16 k;
+	};
+
+	struct Float16
+	{
+		__m512 v;
+
+		Float16() = default;
+		explicit Float16( float x ) : v( _mm512_set1_ps( x ) ) {}
+		static Float16 load( const float* p )
+		{
+			Float16 r;
+			r.v = _mm512_loadu_ps( p );
+			return r;
+		}
+	};
+
+#define KERNEL_FLOAT16_OP( name, op ) \
+	inline Float16 name( const Float16& a, const Float16& b ) { Float16 r; r.v = op( a.v, b.v ); return r; }
+#define KERNEL_MASK16_OP( name, predicate ) \
+	inline Mask16 name( const Float16& a, const Float16& b ) { Mask16 r; r.k = _mm512_cmp_ps_mask( a.v, b.v, predicate ); return r; }
+
+	KERNEL_FLOAT16_OP( operator+, _mm512_add_ps )
+	KERNEL_FLOAT16_OP( operator-, _mm512_sub_ps )
+	KERNEL_FLOAT16_OP( operator*, _mm512_mul_ps )
+	KERNEL_FLOAT16_OP( operator/, _mm512_div_ps )
+	KERNEL_MASK16_OP( operator<, _CMP_LT_OQ )
+	KERNEL_MASK16_OP( operator<=, _CMP_LE_OQ )
+	KERNEL_MASK16_OP( operator>=, _CMP_GE_OQ )
+	KERNEL_MASK16_OP( operator!=, _CMP_NEQ_UQ )
+	KERNEL_MASK16_OP( operator==, _CMP_EQ_OQ )
+
+#undef KERNEL_FLOAT16_OP
+#undef KERNEL_MASK16_OP
+
+	inline Float16 operator-( const Float16& a )
+	{
+		Float16 r;
+		r.v = _mm512_castsi512_ps( _mm512_xor_si512( _mm512_castps_si512( a.v ), _mm512_set1_epi32( std::int32_t( 0x80000000u ) ) ) );
+		return r;
+	}
+
+	// _mm512_sqrt_ps и _mm512_reduce_min_ps в GCC 12 подставляют _mm512_undefined_ps, и -Wextra
+	// предупреждает о неинициализированном значении. У mask-вариантов с полной маской его нет.
+	inline Float16 vsqrt( const Float16& a )
+	{
+		Float16 r;
+		r.v = _mm512_mask_sqrt_ps( a.v, __mmask16( 0xFFFF ), a.v );
+		return r;
+	}
+
+	inline Mask16 operator&( const Mask16& a, const Mask16& b )
+	{
+		Mask16 r;
+		r.k = __mmask16( a.k & b.k );
+		return r;
+	}
+
+	inline Float16 vselect( const Mask16& m, const Float16& a, const Float16& b )
+	{
+		Float16 r;
+		r.v = _mm512_mask_blend_ps( m.k, b.v, a.v );
+		return r;
+	}
+
+	inline int movemask( const Mask16& m )
+	{
+		return m.k;
+	}
+
+	// Как hmin у Float8, сначала половины по 256 бит (_mm512_castps512_ps256 - тоже extract без маски)
+	inline float hmin( const Float16& a )
+	{
+		const __m512d d = _mm512_castps_pd( a.v );
+		const __m256 lo = _mm256_castpd_ps( _mm512_mask_extractf64x4_pd( _mm256_setzero_pd(), __mmask8( 0xF ), d, 0 ) );
+		const __m256 hi = _mm256_castpd_ps( _mm512_mask_extractf64x4_pd( _mm256_setzero_pd(), __mmask8( 0xF ), d, 1 ) );
+		const __m256 m8 = _mm256_min_ps( lo, hi );
+		__m128 m = _mm_min_ps( _mm256_castps256_ps128( m8 ), _mm256_extractf128_ps( m8, 1 ) );
+		m = _mm_min_ps( m, _mm_movehl_ps( m, m ) );
+		m = _mm_min_ss( m, _mm_shuffle_ps( m, m, 1 ) );
+		return _mm_cvtss_f32( m );
+	}
+
+	// Перебор SoA - по 16 примитивов за инструкцию
+	using SoaFloat = Float16;
+	const int SOA_LANES = 16;
+#else
+	// Перебор SoA - по 8 примитивов, блок SCENE_SOA_WIDTH за два шага
+	using SoaFloat = Float8;
+	const int SOA_LANES = PACKET_SIZE;
+#endif
+
+	static_assert( SCENE_SOA_WIDTH % SOA_LANES == 0, "SoA padding must be a multiple of the lane count" );
+
+	int lowestBit( int bits )
+	{
+		int i = 0;
+		while ( !( bits & ( 1 << i ) ) )
+			++i;
+		return i;
+	}
+
+	// Один луч против SOA_LANES сфер с номера first: те же формулы, что у скалярного intersectSphere
+	SoaFloat sphereLanes( const Ray& ray, const SphereSoa& s, std::uint32_t first, const SoaFloat& tMin, const SoaFloat& tMax )
+	{
+		const SoaFloat ox = SoaFloat( ray.origin.d[0] ) - SoaFloat::load( s.x + first );
+		const SoaFloat oy = SoaFloat( ray.origin.d[1] ) - SoaFloat::load( s.y + first );
+		const SoaFloat oz = SoaFloat( ray.origin.d[2] ) - SoaFloat::load( s.z + first );
+		const SoaFloat dx( ray.direction.d[0] ), dy( ray.direction.d[1] ), dz( ray.direction.d[2] );
+		const SoaFloat radius = SoaFloat::load( s.radius + first );
+		const SoaFloat B = SoaFloat( 2.0f ) * ( ox * dx + oy * dy + oz * dz );
+		const SoaFloat C = ( ox * ox + oy * oy + oz * oz ) - radius * radius;
+		const SoaFloat D = B * B - SoaFloat( 4.0f ) * C;
+		// При D < 0 (и у сфер-заполнителей с радиусом NaN) корень - NaN, сравнения ниже ложны
+		const SoaFloat sqrtD = vsqrt( D );
+		const SoaFloat t0 = ( -B - sqrtD ) / SoaFloat( 2.0f );
+		const SoaFloat t1 = ( -B + sqrtD ) / SoaFloat( 2.0f );
+		const auto hit0 = ( t0 >= tMin ) & ( t0 < tMax );
+		const auto hit1 = ( t1 >= tMin ) & ( t1 < tMax );
+		return vselect( hit0, t0, vselect( hit1, t1, tMax ) );
+	}
+
+	// Как скалярный intersectPlane2 при tMin > 0
+	SoaFloat planeLanes( const Ray& ray, const PlaneSoa& p, std::uint32_t first, const SoaFloat& tMin, const SoaFloat& tMax )
+	{
+		const SoaFloat nx = SoaFloat::load( p.nx + first );
+		const SoaFloat ny = SoaFloat::load( p.ny + first );
+		const SoaFloat nz = SoaFloat::load( p.nz + first );
+		const SoaFloat dx( ray.direction.d[0] ), dy( ray.direction.d[1] ), dz( ray.direction.d[2] );
+		const SoaFloat dist = ( nx * SoaFloat( ray.origin.d[0] ) + ny * SoaFloat( ray.origin.d[1] ) + nz * SoaFloat( ray.origin.d[2] ) ) -
+			SoaFloat::load( p.dist + first );
+		const SoaFloat dotND = dx * nx + dy * ny + dz * nz;
+		const SoaFloat t = dist / -dotND;
+		const auto hit = ( dotND != SoaFloat( 0.0f ) ) & ( t >= tMin ) & ( t <= tMax );
+		return vselect( hit, t, tMax );
+	}
+
+	// Ближайшее из SOA_LANES попаданий блока; промах в дорожке - tMax, NaN не бывает
+	template<typename Lanes>
+	std::int32_t closest( const Lanes& lanes, std::uint32_t count, float tMin, float& t )
+	{
+		const SoaFloat tMinV( tMin );
+		std::int32_t best = -1;
+		for ( std::uint32_t first = 0; first < count; first += SOA_LANES )
+		{
+			const SoaFloat tMax( t );
+			const SoaFloat tl = lanes( first, tMinV, tMax );
+			const float nearest = hmin( tl );
+			if ( !( nearest < t ) )
+				continue;
+			t = nearest;
+			best = std::int32_t( first ) + lowestBit( movemask( tl == SoaFloat( nearest ) ) );
+		}
+		return best;
+	}
+
+	std::int32_t closestSphere( const Ray& ray, const SphereSoa& spheres, float tMin, float& t )
+	{
+		return closest( [&]( std::uint32_t first, const SoaFloat& lo, const SoaFloat& hi ) { return sphereLanes( ray, spheres, first, lo, hi ); },
+			spheres.count, tMin, t );
+	}
+
+	std::int32_t closestPlane( const Ray& ray, const PlaneSoa& planes, float tMin, float& t )
+	{
+		return closest( [&]( std::uint32_t first, const SoaFloat& lo, const SoaFloat& hi ) { return planeLanes( ray, planes, first, lo, hi ); },
+			planes.count, tMin, t );
+	}
+
+	// Первый блок SOA_LANES примитивов, где есть попадание
+	template<typename Lanes>
+	bool any( const Lanes& lanes, std::uint32_t count, float tMin, float tMax )
+	{
+		const SoaFloat tMinV( tMin );
+		const SoaFloat tMaxV( tMax );
+		for ( std::uint32_t first = 0; first < count; first += SOA_LANES )
+		{
+			if ( movemask( lanes( first, tMinV, tMaxV ) < tMaxV ) != 0 )
+				return true;
+		}
+		return false;
+	}
+
+	bool occludedSpheres( const Ray& ray, const SphereSoa& spheres, float tMin, float tMax )
+	{
+		return any( [&]( std::uint32_t first, const SoaFloat& lo, const SoaFloat& hi ) { return sphereLanes( ray, spheres, first, lo, hi ); },
+			spheres.count, tMin, tMax );
+	}
+
+	bool occludedPlanes( const Ray& ray, const PlaneSoa& planes, float tMin, float tMax )
+	{
+		return any( [&]( std::uint32_t first, const SoaFloat& lo, const SoaFloat& hi ) { return planeLanes( ray, planes, first, lo, hi ); },
+			planes.count, tMin, tMax );
+	}
+
+	// Для float и Float8: операции одни и те же, в том же порядке
+	template<typename T>
+	T uncharted( const T& c )
+	{
+		const T A( 0.15f );
+		const T B( 0.50f );
+		const T C( 0.10f );
+		const T D( 0.20f );
+		const T E( 0.02f );
+		const T F( 0.30f );
+		return ( ( c * ( A * c + C * B ) + D * E ) / ( c * ( A * c + B ) + D * F ) ) - E / F;
+	}
+
+	void tonemap( float* values, int count )
+	{
+		int i = 0;
+		for ( ; i + PACKET_SIZE <= count; i += PACKET_SIZE )
+			uncharted( Float8::load( values + i ) ).store( values + i );
+		for ( ; i < count; ++i )
+			values[i] = uncharted( values[i] );
+	}
+}
+
+extern const Kernels KERNELS_TABLE = { &intersectPrims, &intersectPlanes, &occludedPrims, &closestSphere, &closestPlane, &occludedSpheres,
+	&occludedPlanes, &tonemap };
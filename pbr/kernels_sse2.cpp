@@ -0,0 +1,4 @@
+// Базовый вариант ядер: флаги сборки по умолчанию, на x86-64 это SSE2 (см. kernels.h)
+
+#define KERNELS_TABLE kernelsSse2
+#include "kernels_impl.h"
@@ -0,0 +1,7 @@
+// Ядра для SSE4.2 (см. kernels.h и CMakeLists.txt)
+#if defined( __GNUC__ ) && !defined( __SSE4_2__ )
+#error "kernels_sse42.cpp must be compiled with SSE4.2 enabled"
+#endif
+
+#define KERNELS_TABLE kernelsSse42
+#include "kernels_impl.h"
@@ -0,0 +1,148 @@
+#include "lights.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "geometry.h"
+
+void LightSampler::build( const Scene& scene )
+{
+	scene_ = &scene;
+	sphereCount_ = (std::uint32_t)scene.spheres().size();
+	lights_.clear();
+	prob_.clear();
+	alias_.clear();
+	totalPower_ = 0.0f;
+
+	std::vector<float> power;
+	for ( std::uint32_t i = 0; i < sphereCount_; ++i )
+	{
+		const Sphere& sp = scene.spheres()[i];
+		const float p = 4.0f * PI * sp.radius * sp.radius * luminance( scene.material( sp.matIndex ).emmision );
+		if ( p > 0.0f )
+		{
+			lights_.push_back( { i, sp.matIndex, NO_INSTANCE } );
+			power.push_back( p );
+		}
+	}
+	for ( size_t i = 0; i < scene.triangleCount(); ++i )
+	{
+		const int matIndex = scene.triangleMaterial( i );
+		const float lum = luminance( scene.material( matIndex ).emmision );
+		if ( lum <= 0.0f )
+			continue;
+		const Triangle tr = scene.triangle( i );
+		const float p = 0.5f * cross( tr.b - tr.a, tr.c - tr.a ).length() * lum;
+		if ( p > 0.0f )
+		{
+			lights_.push_back( { sphereCount_ + (std::uint32_t)i, matIndex, NO_INSTANCE } );
+			power.push_back( p );
+		}
+	}
+	for ( std::uint32_t k = 0; k < (std::uint32_t)scene.instances().size(); ++k )
+	{
+		const Instance& inst = scene.instances()[k];
+		const Mesh& mesh = scene.meshes()[inst.mesh];
+		for ( std::uint32_t i = mesh.firstTriangle; i < mesh.firstTriangle + mesh.triangleCount; ++i )
+		{
+			const int matIndex = inst.matIndex >= 0 ? inst.matIndex : scene.triangleMaterial( i );
+			const float lum = luminance( scene.material( matIndex ).emmision );
+			if ( lum <= 0.0f )
+				continue;
+			// Площадь - после преобразования: в экземпляре меш может быть растянут
+			const Light light{ sphereCount_ + i, matIndex, k };
+			const Triangle tr = triangle( light );
+			const float p = 0.5f * cross( tr.b - tr.a, tr.c - tr.a ).length() * lum;
+			if ( p > 0.0f )
+			{
+				lights_.push_back( light );
+				power.push_back( p );
+			}
+		}
+	}
+	if ( lights_.empty() )
+		return;
+
+	// Построение Vose: делим ячейки на недогруженные и перегруженные и доливаем первые из вторых
+	const size_t n = lights_.size();
+	double total = 0.0;
+	for ( float p : power )
+		total += p;
+	totalPower_ = (float)total;
+
+	prob_.resize( n );
+	alias_.resize( n );
+	std::vector<double> scaled( n );
+	std::vector<std::uint32_t> small;
+	std::vector<std::uint32_t> large;
+	for ( size_t i = 0; i < n; ++i )
+	{
+		scaled[i] = power[i] * n / total;
+		alias_[i] = (std::uint32_t)i;
+		( scaled[i] < 1.0 ? small : large ).push_back( (std::uint32_t)i );
+	}
+	while ( !small.empty() && !large.empty() )
+	{
+		const std::uint32_t s = small.back();
+		small.pop_back();
+		const std::uint32_t l = large.back();
+		prob_[s] = (float)scaled[s];
+		alias_[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if ( scaled[l] < 1.0 )
+		{
+			large.pop_back();
+			small.push_back( l );
+		}
+	}
+	// Остатки из-за ошибок округления
+	for ( std::uint32_t i : small )
+		prob_[i] = 1.0f;
+	for ( std::uint32_t i : large )
+		prob_[i] = 1.0f;
+}
+
+LightSample LightSampler::sample( float u0, float u1, float u2 ) const
+{
+	const size_t n = lights_.size();
+	const float scaled = u0 * n;
+	const size_t cell = std::min( n - 1, (size_t)scaled );
+	const float coin = scaled - cell;
+	const Light& light = lights_[coin < prob_[cell] ? cell : alias_[cell]];
+
+	LightSample ls;
+	ls.emission = scene_->material( light.matIndex ).emmision;
+	ls.pdfArea = pdfArea( ls.emission );
+	if ( light.prim < sphereCount_ )
+	{
+		const Sphere& sp = scene_->spheres()[light.prim];
+		const float z = 1.0f - 2.0f * u1;
+		const float r = std::sqrt( std::max( 0.0f, 1.0f - z * z ) );
+		const float phi = 2.0f * PI * u2;
+		ls.normal = Vector3( r * std::cos( phi ), r * std::sin( phi ), z );
+		ls.position = sp.pos + ls.normal * sp.radius;
+	}
+	else
+	{
+		const Triangle tr = triangle( light );
+		const float su = std::sqrt( u1 );
+		const float b1 = su * ( 1.0f - u2 );
+		const float b2 = su * u2;
+		ls.position = tr.a + ( tr.b - tr.a ) * b1 + ( tr.c - tr.a ) * b2;
+		ls.normal = unit_vector( cross( tr.b - tr.a, tr.c - tr.a ) );
+	}
+	return ls;
+}
+
+Triangle LightSampler::triangle( const Light& light ) const
+{
+	Triangle tr = scene_->triangle( light.prim - sphereCount_ );
+	if ( light.instance != NO_INSTANCE )
+	{
+		const float* m = scene_->instances()[light.instance].transform;
+		tr.a = transformPoint( m, tr.a );
+		tr.b = transformPoint( m, tr.b );
+		tr.c = transformPoint( m, tr.c );
+	}
+	return tr;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../src/scene.h"
+
+struct LightSample
+{
+	Vector3 position;
+	Vector3 normal;
+	Vector3 emission;
+	float pdfArea; // плотность выбора точки по площади, с учетом выбора источника
+};
+
+inline float luminance( const Vector3& c )
+{
+	return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+}
+
+// Список излучающих треугольников и сфер сцены, в том числе треугольников экземпляров мешей.
+// Источник выбирается по alias-таблице пропорционально мощности (площадь * яркость излучения),
+// точка на нем - равномерно по площади. Плоскости бесконечные и в список не входят.
+class LightSampler
+{
+public:
+	void build( const Scene& scene );
+
+	bool empty() const { return lights_.empty(); }
+	size_t count() const { return lights_.size(); }
+
+	// u0 выбирает источник, u1 и u2 - точку на нем
+	LightSample sample( float u0, float u1, float u2 ) const;
+
+	// Плотность по площади для точки на источнике из списка. Вероятность выбора источника
+	// пропорциональна площади, поэтому площадь сокращается и остается только яркость.
+	float pdfArea( const Vector3& emission ) const { return luminance( emission ) / totalPower_; }
+
+private:
+	static constexpr std::uint32_t NO_INSTANCE = 0xFFFFFFFFu;
+
+	struct Light
+	{
+		std::uint32_t prim; // как в BVH: [0, число сфер) - сферы, дальше треугольники
+		int matIndex;
+		std::uint32_t instance; // треугольник меша в этом экземпляре или NO_INSTANCE
+	};
+
+	// Треугольник источника в мире
+	Triangle triangle( const Light& light ) const;
+
+private:
+	const Scene* scene_ = nullptr;
+	std::uint32_t sphereCount_ = 0;
+	std::vector<Light> lights_;
+	float totalPower_ = 0.0f;
+
+	// Alias-таблица Уокера: ячейка i берется с вероятностью prob_[i], иначе alias_[i]
+	std::vector<float> prob_;
+	std::vector<std::uint32_t> alias_;
+};
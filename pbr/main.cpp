@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <ostream>
 #include <iosfwd>
@@ -7,330 +8,169 @@
 #include <math.h>
 #include <sstream>
 #include <chrono>
-#include <random>
+#include <memory>
+#include <mutex>
+#include <limits>
 
 #include "../src/vector.h"
 #include "../src/scene.h"
-
-struct Ray
-{
-	Vector3 origin;
-	Vector3 direction;
-};
-
-float srgb( float x )
-{
-	return std::pow( x, 1.f / 2.2f );
-}
-
-Vector3 tonemapping( const Vector3& color )
-{
-	return Vector3( std::min( 1.0f, color.x() ), std::min( 1.0f, color.y() ), std::min( 1.0f, color.z() ) );
-}
-
-Vector3 tonemappingUncharted( const Vector3& color )
-{
-	const Vector3 A = Vector3( 0.15f, 0.15f, 0.15f );
-	const Vector3 B = Vector3( 0.50f, 0.50f, 0.50f );
-	const Vector3 C = Vector3( 0.10f, 0.10f, 0.10f );
-	const Vector3 D = Vector3( 0.20f, 0.20f, 0.20f );
-	const Vector3 E = Vector3( 0.02f, 0.02f, 0.02f );
-	const Vector3 F = Vector3( 0.30f, 0.30f, 0.30f );	
-	const Vector3 wPoint = Vector3(11.20f, 11.30f, 11.20f);
-
-	auto applay = [&](const Vector3& c) {
-		return ((c * (A * c + C * B) + D * E) / (c * (A * c + B) + D * F)) - E / F;
-		};	
-	
-	return applay(color) * (Vector3(1.0, 1.0f, 1.0f) / applay(wPoint));
-}
-
-void saveImageToFile( std::uint16_t width, std::uint16_t height, const std::vector<Vector3>& data )
-{
-	std::ofstream outfile( "output.ppm", std::ios::out | std::ios::binary );
-
-	if ( outfile.is_open() )
-	{
-		outfile << "P3\n" << width << " " << height << "\n255\n";
-		
-		for ( int y = 0; y < height; ++y )
-		{
-			for ( int x = 0; x < width; ++x )
-			{
-				Vector3 color = tonemappingUncharted( data[y * width + x] );
-				int r = (int)std::clamp( srgb(color.x()) * 255, 0.0f, 255.0f); // R
-				int g = (int)std::clamp( srgb(color.y()) * 255, 0.0f, 255.0f); // G
-				int b = (int)std::clamp( srgb(color.z()) * 255, 0.0f, 255.0f); // B
-
-				outfile << r << " " << g << " " << b << " ";
-			}
-			outfile << "\n";
-		}
-		outfile.close();
-
-		// Сообщаем о сохранении
-		printf( "Image saved to output.ppm\n" );
-	}
-	else
-	{
-		printf( "Error: Could not open output.ppm for writing.\n" );
-	}
-}
-
-//можно использовать точку и дистанцию 
-float intersectPlane( Ray ray,  Vector3 poinOnPlane, Vector3 normPlane, float tMin, float tMax )
+#include "geometry.h"
+#include "bench.h"
+#include "bvh.h"
+#include "denoise.h"
+#include "film.h"
+#include "image.h"
+#include "integrator.h"
+#include "kernels.h"
+#include "lights.h"
+#include "options.h"
+#include "packet.h"
+#include "sampler.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+
+// Загружает сцену и BVH: из бинарного кеша, если он свежий, иначе из текста с построением BVH.
+// С --cache или --convert кеш пишется рядом со сценой.
+bool loadScene( const Options& options, BvhBuilder builder, ThreadPool& pool, Scene& scene, BVH& bvh )
 {
-	float t =  dot( (poinOnPlane - ray.origin ) , normPlane ) / dot( ray.direction , normPlane );
-	if ( t > tMin && t < tMax )
-	{
-		return t;
-	}
-	else
-	{
-		return tMax;
-	}
-}
+	auto start = std::chrono::high_resolution_clock::now();
+	const std::string cachePath = options.scene + ".pbrs";
 
-float intersectPlane2( const Ray& ray, const Vector3& normal, float d, float tMin, float tMax )
- {
-	const float dist = dot( normal, ray.origin ) - d;
-	const float dotND = dot( ray.direction, normal );
-	if ( dotND == 0.0 )
+	bool fromCache = false;
+	if ( options.cache && !options.convert )
 	{
-		if ( dist == 0.0 && tMin == 0.0)
+		// Хеш исходника включает файлы мешей, их список - из кеша: если поменялся сам список, поменялся и текст
+		std::uint64_t sourceHash = 0;
+		std::uint64_t cachedHash = 0;
+		std::vector<std::string> meshFiles;
+		if ( Scene::readBinarySource( cachePath.c_str(), cachedHash, meshFiles ) )
 		{
-			return 0.0;
+			if ( Scene::hashSource( options.scene.c_str(), meshFiles, sourceHash ) && sourceHash == cachedHash )
+				fromCache = scene.load( cachePath.c_str() );
+			else
+				std::cout << "Scene cache " << cachePath << " is stale" << std::endl;
 		}
-		return tMax;
 	}
-	const float t = dist / -dotND;
-	if ( t< tMin || t > tMax )
-		return tMax;
-	return t;
-}
-
-float intersectTriangle( const Ray& ray, const Vector3& a, const Vector3& b, const Vector3& c, float tMin, float tMax )
-{
-	const Vector3 normal = unit_vector( cross( b- a, c - a ) );
-	const float d = dot( normal, a );
-	const float t = intersectPlane2( ray, normal, d, tMin, tMax );
-	if ( t == tMax )
-		return tMax;
-	const Vector3 p = ray.origin + ray.direction * t;
-	if ( dot( cross( b - a, p - a ), normal ) < 0.0f )
-		return tMax;
-	if ( dot( cross( c - b, p - b ), normal ) < 0.0f )
-		return tMax;
-	if ( dot( cross( a - c, p - c ), normal ) < 0.0f )
-		return tMax;
-	return t;
-}
-
-float intersectSphere(const Ray& ray, const Vector3& center, float radius, float tMin, float tMax)
-{
-	const Vector3 origin = ray.origin - center; // сдвигаем сферу в центр 
-	const float A = 1;
-	const float B = 2.0f * dot( origin, ray.direction );
-	const float C = dot( origin, origin ) - radius * radius;
-	const float D = B * B - 4 * A * C;
-	if ( D < 0.0f )
-		return tMax;
-	const float sqrtD = std::sqrt( D );
-	const float t0 = ( -B - sqrtD ) / ( 2.0f * A );	
-	if ( t0 >= tMin && t0 < tMax ) return t0;
-	const float t1 = (-B + sqrtD) / (2.0f * A);
-	if ( t1 >= tMin && t1 < tMax ) return t1;
-	return tMax;
-}
-
-//Vector3 getUniformSampleOffset( int index, int side_count )
-//{
-//	const float haflDist = 0.5 / side_count;
-//	const float dist = 1.0 / side_count;
-//	const float x = index % side_count;
-//	const float y = std::floor( index / side_count );
-//	return Vector3( haflDist + x * dist, haflDist + y * dist, 0.0 );
-//}
-
-float randomFloat()
-{
-	static std::uniform_real_distribution<float> distribution(0.0, 1.0);
-	static std::mt19937 generator;
-	return distribution(generator);
-}
-
-Vector3 getUniformSampleOffset(int index, int side_count)
-{	
-	const float x_idx = (float)(index % side_count);
-	const float y_idx = (float)std::floor(index / side_count);
-		
-	const float dist = 1.0f / side_count;
-		
-	const float jitterX = randomFloat();
-	const float jitterY = randomFloat();
-		
-	const float u = (x_idx + jitterX) * dist;
-	const float v = (y_idx + jitterY) * dist;
-	
-	return Vector3(u, v, 0.0f);
-}
 
+	if ( !fromCache && !scene.load( options.scene.c_str() ) )
+		return false;
 
+	auto load_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
+	std::cout << "Scene: " << load_ms.count() << " milliseconds" << ( fromCache ? " (cache)" : "" ) << std::endl;
 
-float randFloat( float min, float max )
-{
-	return min + ( max - min ) * ( randomFloat() );
-}
-
-Vector3 randVector( float min, float max )
-{
-	return Vector3( randFloat( min, max ), randFloat( min, max ), randFloat( min, max ) );
-}
-
-Vector3 randUnitVector()
-{
-	while ( true )
+	auto buildStart = std::chrono::high_resolution_clock::now();
+	bvh.setEdgeCache( options.edgeCache );
+	const bool prebuilt = !scene.accelData().empty() && bvh.load( scene, scene.accelData() );
+	if ( !prebuilt )
+		bvh.build( scene, builder, pool );
+	else
+		bvh.buildInstances( scene, builder, pool );
+	// В кеше бинарное дерево, широкое собирается из него заново: это быстро
+	bvh.collapse( options.bvhWidth );
+	if ( options.bruteForceLimit >= 0 )
+		bvh.setBruteForceLimit( std::uint32_t( options.bruteForceLimit ) );
+	auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - buildStart);
+	std::cout << "BVH: " << bvh.nodeCount() << " nodes, ";
+	if ( bvh.width() > 2 )
+		std::cout << bvh.wideNodeCount() << " " << bvh.width() << "-wide nodes, ";
+	std::cout << bvh.primCount() << " primitives, " << build_ms.count() << " milliseconds"
+		<< ( prebuilt ? " (cache)" : std::string( " (" ) + bvhBuilderName( builder ) + ")" )
+		<< ( bvh.bruteForce() ? " (brute force)" : "" ) << std::endl;
+	if ( !scene.instances().empty() )
+		std::cout << "Instances: " << scene.instances().size() << " of " << bvh.blasCount() << " meshes, "
+			<< scene.instancedTriangleCount() << " placed triangles" << std::endl;
+	std::cout << "Geometry: " << scene.triangleCount() << " triangles, " << scene.vertices().size() << " vertices, "
+		<< ( scene.geometryBytes() + bvh.memoryBytes() ) / 1024 << " KB with BVH" << std::endl;
+
+	if ( ( options.cache || options.convert ) && !fromCache )
 	{
-		Vector3 p = randVector( -1, 1 );
-		float l = p.length_squared();
-		if ( 1e-160 < l && l <= 1 )
-			return p / std::sqrt( l );
+		std::vector<char> accel;
+		bvh.serialize( accel );
+		if ( !scene.saveBinary( cachePath.c_str(), accel.data(), accel.size() ) )
+			return false;
+		std::cout << "Scene cache saved to " << cachePath << std::endl;
 	}
+	return true;
 }
 
-const float PI = 3.14f;
-Vector3 randomUniformVectorHemispher()
-{
-	float phi = randFloat(0, 1) * 2.0f * PI;
-	float cosTheta = randFloat(0, 1) * 2.0f - 1.0f;
-	float sinTheta = std::sqrt( 1 - cosTheta * cosTheta );
-	float x = std::cos( phi ) * sinTheta;
-	float y = cosTheta;
-	float z = std::sin( phi ) * sinTheta;
-	return Vector3( x, y, z );
-}
-
-Vector3 randOnHemispher(const Vector3& normal)
-{
-	Vector3 onSphere = randUnitVector();
-	if (dot(onSphere, normal) > 0.0f)
-		return onSphere;
-	else
-		return -onSphere;
-}
-
-Vector3 reflect(const Vector3& d, const Vector3& n)
+int main( int argc, char** argv )
 {
-	return d - 2.0f * dot(d, n) * n;
-}
-
-Vector3 trace( const Ray& ray, const Scene& scene, int depth )
-{
-
-	const float tMin = 0.001f;
-	float tMax = 10000;
-	Vector3 hitNormal;
-	
-	int matIndex = 0;
-	for ( const auto& sp : scene.spheres() )
+	Options options;
+	if ( !parseOptions( argc, argv, options ) )
 	{
-		float t = intersectSphere( ray, sp.pos, sp.radius, tMin, tMax );
-		if ( t < tMax )
-		{
-			Vector3 pos = ray.origin + ray.direction * t;
-			Vector3 v = pos - sp.pos;
-			float l = v.length();
-			hitNormal = unit_vector( pos - sp.pos );
-			tMax = t;
-			matIndex = sp.matIndex;
-		}
+		printUsage( argv[0] );
+		return 1;
 	}
 
-	for ( const auto& p : scene.planes() )
+	ImageFormat format;
+	if ( !parseImageFormat( options.format, options.output, format ) )
 	{
-		float t = intersectPlane2( ray, p.normal, p.dist, tMin, tMax );
-		if ( t < tMax )
-		{
-			hitNormal = p.normal;
-			tMax = t;
-			matIndex = p.matIndex;
-		}
-	}
-	for ( const auto& tr : scene.triangles() )
-	{
-		float t = intersectTriangle( ray, tr.a, tr.b, tr.c, tMin, tMax );
-		if ( t < tMax )
-		{
-			hitNormal = unit_vector( cross( tr.b - tr.a, tr.c - tr.a ) );
-			tMax = t;
-			matIndex = tr.matIndex;
-		}
+		std::cerr << "Error: unknown image format " << options.format << std::endl;
+		return 1;
 	}
-	if ( tMax == 10000 )
-		return scene.enviroment();
-
-	if ( dot( hitNormal, ray.direction ) > 0.0 )
-		hitNormal = -hitNormal;
-
-	const Material m = scene.material( matIndex );
-	Vector3 newDir;
-	float brdf = 1.0f / PI;
-	float pdf = 1.0f / ( 2.0f * PI );
-	float cosTheta; 
 
-	if ( m.type == 0 )
-	{
-		newDir = randomUniformVectorHemispher();
-		cosTheta = dot(newDir, hitNormal);
-		//if (cosTheta < 0.0)
-	//		newDir *= -1;
-	}
-	else if ( m.type == 1 )
+	BvhBuilder builder = BvhBuilder::Sah;
+	if ( !parseBvhBuilder( options.bvhBuilder, builder ) )
 	{
-		newDir = reflect( ray.direction, hitNormal );
-		cosTheta = 1.0f;
-		brdf = 1.0f;
-		pdf = 1.0f;
-		// cosTheta -> 0
+		std::cerr << "Error: unknown BVH builder " << options.bvhBuilder << std::endl;
+		return 1;
 	}
-	
-	//const Vector3 newDir = randOnHemispher( hitNormal );
-	
-	const Vector3 newOrig = ray.origin + ray.direction * tMax + newDir * 1e-4f;	
-	const Ray newRay( {newOrig, newDir } );
-	
-	Vector3 color;
-	if (depth > 4)
+
+	// Вариант ядер выбирается до запуска потоков
+	KernelIsa kernelIsa = detectKernelIsa();
+	if ( options.kernels != "auto" && !parseKernelIsa( options.kernels, kernelIsa ) )
 	{
-		return scene.enviroment();
+		std::cerr << "Error: unknown kernels " << options.kernels << std::endl;
+		return 1;
 	}
-	//	float p = randFloat( 0, 1 );
-	//	if ( p <= 0.5 )
-	//	{
-	//		color = m.emmision;
-	//	}
-	//	else
-	//	{
-	//		color = trace( newRay, scene, depth + 1 ) * brdf * std::abs( cosTheta ) / pdf * m.albedo + m.emmision;
-	//		color *= 1.0f / ( 1.0f - p );
-	//	}
-	//}
-	//else
+	if ( !selectKernels( kernelIsa ) )
 	{
-		color = trace( newRay, scene, depth + 1 ) * brdf * std::abs( cosTheta ) / pdf * m.albedo + m.emmision;
+		std::cerr << "Error: " << kernelIsaName( kernelIsa ) << " kernels are not supported by this CPU or build" << std::endl;
+		return 1;
 	}
+	std::cout << "Kernels: " << kernelIsaName( kernelIsa ) << ( options.kernels == "auto" ? "" : " (forced)" ) << std::endl;
 
-	return color;
-}
+	// Пул нужен уже для построения BVH
+	ThreadPool pool( options.threads );
 
-int main()
-{
 	Scene scene;
 	//scene.load( "../scenes/02-scene-hard-v2.txt" );
 	//scene.load( "../scenes/03-scene-hard.txt" );
 	//scene.load( "../scenes/03-scene-easy.txt" );
 	//scene.load( "../scenes/04-scene-easy.txt" );
-	scene.load( "../scenes/04-scene-medium.txt" );
+	BVH bvh;
+	if ( !loadScene( options, builder, pool, scene, bvh ) )
+		return 1;
+	if ( options.convert )
+		return 0;
+	if ( options.samples > 0 )
+		scene.setSamples( options.samples );
+
+	if ( !options.bench.empty() )
+		return runBenchmark( options, scene, pool );
+
+	// Сэмплер из командной строки важнее сэмплера сцены
+	SamplerType samplerType = SamplerType::Random;
+	const std::string& samplerOption = options.sampler.empty() ? scene.sampler() : options.sampler;
+	if ( !samplerOption.empty() && !parseSamplerType( samplerOption, samplerType ) )
+	{
+		std::cerr << "Error: unknown sampler " << samplerOption << std::endl;
+		return 1;
+	}
+	std::cout << "Sampler: " << samplerName( samplerType ) << std::endl;
+
+	IntegratorType integratorType = IntegratorType::Path;
+	if ( !parseIntegratorType( options.integrator, integratorType ) )
+	{
+		std::cerr << "Error: unknown integrator " << options.integrator << std::endl;
+		return 1;
+	}
+	std::cout << "Integrator: " << integratorName( integratorType ) << ( options.packets ? "" : " (packets off)" ) << std::endl;
+
+	LightSampler lights;
+	if ( options.nee )
+		lights.build( scene );
+	std::cout << "Lights: " << lights.count() << ( options.nee ? "" : " (next event estimation off)" ) << std::endl;
 
 	const std::uint16_t width = scene.width();
 	const std::uint16_t height = scene.height();
@@ -346,41 +186,438 @@ int main()
 //	const Vector3 leftTop( -aspectRatio / 2, 0.5f, 1.0f );
 	const Vector3 leftTop( -aspectRatio * viewportHight / 2.0f, viewportHight / 2.0f, 1.0f);
 
-	std::vector<Vector3> data;
-	data.resize( width * height );
-
 	const int SIDE_SAMPLE_COUNT = scene.samples();
 	auto start = std::chrono::high_resolution_clock::now();
 
-	for ( int y = 0; y < height; ++y )
+	IntegratorSettings settings;
+	settings.maxDepth = options.maxDepth;
+	settings.rouletteDepth = options.rouletteDepth;
+	PathStats stats;
+	std::mutex statsMutex;
+	Film film( width, height );
+
+	// Контрольная точка годится только для той же сцены и той же последовательности сэмплов
+	CheckpointInfo checkpointInfo;
+	checkpointInfo.sceneHash = scene.sourceHash();
+	checkpointInfo.sampler = std::uint32_t( samplerType );
+	checkpointInfo.sideCount = std::uint32_t( SIDE_SAMPLE_COUNT );
+	checkpointInfo.maxDepth = options.maxDepth;
+	checkpointInfo.rouletteDepth = options.rouletteDepth;
+	checkpointInfo.nee = options.nee;
+	checkpointInfo.seeds.push_back( options.seed );
+	auto checkpointMatches = [&]( const std::string& path, const CheckpointInfo& info ) {
+		if ( info.sceneHash != checkpointInfo.sceneHash || info.sampler != checkpointInfo.sampler || info.sideCount != checkpointInfo.sideCount )
+		{
+			std::cerr << path << ": error: checkpoint was rendered with another scene, sampler or sample count" << std::endl;
+			return false;
+		}
+		if ( info.maxDepth != checkpointInfo.maxDepth || info.rouletteDepth != checkpointInfo.rouletteDepth || info.nee != checkpointInfo.nee )
+		{
+			std::cerr << path << ": error: checkpoint was rendered with another --max-depth, --rr-depth or --no-nee" << std::endl;
+			return false;
+		}
+		return true;
+	};
+
+	DenoiseSettings denoiseSettings;
+	denoiseSettings.iterations = options.denoiseIterations;
+	auto resolveImage = [&]( std::vector<Vector3>& data ) {
+		if ( options.denoise )
+			denoise( film, denoiseSettings, data, pool );
+		else
+			film.resolve( data );
+	};
+
+	// Изображение, карта сэмплов, AOV и контрольная точка по текущему состоянию кадра
+	auto saveResults = [&]() {
+		std::vector<Vector3> data;
+		resolveImage( data );
+		if ( !saveImageToFile( options.output, format, width, height, data, pool ) )
+			return false;
+
+		if ( !options.heatmap.empty() )
+		{
+			ImageFormat heatmapFormat;
+			parseImageFormat( "", options.heatmap, heatmapFormat );
+			// В PFM - само число сэмплов, в PPM - цветовая шкала без тонмаппинга
+			std::vector<Vector3> heatmap;
+			film.sampleHeatmap( heatmap, heatmapFormat == ImageFormat::PFM );
+			if ( !saveImageToFile( options.heatmap, heatmapFormat, width, height, heatmap, pool, false ) )
+				return false;
+		}
+
+		if ( !options.aov.empty() )
+		{
+			std::vector<Vector3> albedo( data.size() ), normal( data.size() ), depth( data.size() );
+			for ( int y = 0; y < height; ++y )
+			{
+				for ( int x = 0; x < width; ++x )
+				{
+					const FilmAov& aov = film.aov( x, y );
+					const size_t i = size_t( y ) * width + x;
+					albedo[i] = aov.albedo;
+					normal[i] = aov.normal;
+					depth[i] = Vector3( aov.depth, aov.depth, aov.depth );
+				}
+			}
+			if ( !saveImageToFile( options.aov + "-albedo.pfm", ImageFormat::PFM, width, height, albedo, pool ) ||
+				!saveImageToFile( options.aov + "-normal.pfm", ImageFormat::PFM, width, height, normal, pool ) ||
+				!saveImageToFile( options.aov + "-depth.pfm", ImageFormat::PFM, width, height, depth, pool ) )
+				return false;
+		}
+
+		return options.checkpoint.empty() || film.saveCheckpoint( options.checkpoint, checkpointInfo );
+	};
+
+	// Объединение независимых прогонов: seed должны различаться, иначе сэмплы повторяются.
+	// Объединенная точка хранит seed всех своих прогонов, так что повтор ловится и через нее.
+	if ( !options.merge.empty() )
 	{
-		for ( int x = 0; x < width; ++x )
+		std::vector<std::uint32_t> seeds;
+		for ( const std::string& path : options.merge )
 		{
-			Vector3 color( 0, 0, 0);
-			const float u = float(x) / width;
-			const float v = float(y) / height;
-			
-			for ( int s = 0; s < SIDE_SAMPLE_COUNT * SIDE_SAMPLE_COUNT; ++s )
+			Film part( width, height );
+			CheckpointInfo info;
+			if ( !part.loadCheckpoint( path, info ) || !checkpointMatches( path, info ) )
+				return 1;
+			for ( std::uint32_t seed : info.seeds )
 			{
-				//Vector3 pixPos = leftTop + Vector3( pixSize / 2.0 + x * pixSize, pixSize / 2.0 + y * pixSize, 0 );
-				//Vector3 pixPos = leftTop + Vector3( pixSize / 2.0f + u * aspectRatio, -pixSize / 2.0f - v, 0.0f );
-				const Vector3 offset = getUniformSampleOffset( s, SIDE_SAMPLE_COUNT );
-				const Vector3 pixPosVS = leftTop + Vector3( (pixSize * offset.x() + u * aspectRatio) * viewportHight, (-pixSize * offset.y() - v) * viewportHight, 0.0f );
-				const Vector3 pixPos = camera.pos + pixPosVS.x() * camerRight + pixPosVS.y() * camerUp + pixPosVS.z() * camerForward;
-
-				const Vector3 dir = unit_vector( pixPos - camera.pos );
-				const Ray ray( { camera.pos, dir } );
-				color += trace( ray, scene, 0 );
+				if ( std::find( seeds.begin(), seeds.end(), seed ) != seeds.end() )
+				{
+					std::cerr << path << ": error: seed " << seed << " is already merged" << std::endl;
+					return 1;
+				}
+				seeds.push_back( seed );
 			}
+			film.merge( part );
+		}
+		checkpointInfo.seeds = std::move( seeds );
+		checkpointInfo.merged = true;
+		std::cout << "Merged: " << options.merge.size() << " checkpoints, " << double( film.totalSamples() ) / ( double( width ) * height ) << " samples per pixel" << std::endl;
+		return saveResults() ? 0 : 1;
+	}
 
-			data[y * width + x] = color / float(SIDE_SAMPLE_COUNT * SIDE_SAMPLE_COUNT);
+	if ( options.resume )
+	{
+		if ( !std::ifstream( options.checkpoint ).good() )
+		{
+			std::cout << "Resume: no checkpoint " << options.checkpoint << ", starting from scratch" << std::endl;
+		}
+		else
+		{
+			CheckpointInfo info;
+			if ( !film.loadCheckpoint( options.checkpoint, info ) || !checkpointMatches( options.checkpoint, info ) )
+				return 1;
+			if ( info.merged || info.seeds.size() != 1 || info.seeds[0] != options.seed )
+			{
+				std::cerr << options.checkpoint << ": error: checkpoint was rendered with another seed" << std::endl;
+				return 1;
+			}
+			std::cout << "Resume: " << double( film.totalSamples() ) / ( double( width ) * height ) << " samples per pixel" << std::endl;
 		}
 	}
-		
-	auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
-	std::cout << "Time: " << duration_ms.count() << " milliseconds" << std::endl;
 
-	saveImageToFile( width, height, data );
+	// Сэмплы копятся пачками: по PACKET_SIZE для пакетов, по WAVEFRONT_BATCH для волнового
+	// интегратора. Лучи камеры соседних сэмплов почти параллельны и обходят сцену вместе.
+	// В кадр сэмплы попадают в том же порядке, что и по одному, поэтому изображение не меняется.
+	const size_t WAVEFRONT_BATCH = 256;
+	const bool wavefront = integratorType == IntegratorType::Wavefront;
+	struct SampleBatch
+	{
+		// Пакету нужен сэмплер на каждый путь, волновой перезапускает один
+		std::vector<std::unique_ptr<Sampler>> samplers;
+		std::vector<Sampler*> pointers;
+		std::vector<CameraSample> samples;
+		std::vector<float> offsetX, offsetY; // положение сэмпла внутри пикселя
+		std::vector<Vector3> radiance;
+		std::vector<PathAov> aovs;
+		size_t capacity = 0;
+		std::unique_ptr<WavefrontIntegrator> wavefront;
+	};
+	auto createBatch = [&]() {
+		std::unique_ptr<SampleBatch> batch( new SampleBatch );
+		batch->capacity = wavefront ? WAVEFRONT_BATCH : size_t( PACKET_SIZE );
+		for ( size_t i = 0; i < ( wavefront ? 1 : batch->capacity ); ++i )
+		{
+			batch->samplers.push_back( createSampler( samplerType, width, SIDE_SAMPLE_COUNT, options.seed ) );
+			batch->pointers.push_back( batch->samplers.back().get() );
+		}
+		batch->samples.reserve( batch->capacity );
+		batch->offsetX.reserve( batch->capacity );
+		batch->offsetY.reserve( batch->capacity );
+		batch->radiance.resize( batch->capacity );
+		batch->aovs.resize( batch->capacity );
+		if ( wavefront )
+			batch->wavefront.reset( new WavefrontIntegrator( scene, bvh, lights, settings, options.packets ) );
+		return batch;
+	};
+	// Направления лучей камеры всей пачки, по CAMERA_LANES сэмплов за раз.
+	// В каждой дорожке те же операции, что и для одного луча, лучи совпадают до бита.
+	const int CAMERA_LANES = 8;
+	using CameraFloats = FloatxN<CAMERA_LANES>;
+	auto cameraRays = [&]( SampleBatch& batch ) {
+		const size_t count = batch.samples.size();
+		const Vec3xN<CAMERA_LANES> origin( camera.pos );
+		for ( size_t first = 0; first < count; first += CAMERA_LANES )
+		{
+			const int lanes = int( std::min( count - first, size_t( CAMERA_LANES ) ) );
+			CameraFloats x, y, offsetX, offsetY;
+			for ( int l = 0; l < lanes; ++l )
+			{
+				x[l] = float( batch.samples[first + l].x );
+				y[l] = float( batch.samples[first + l].y );
+				offsetX[l] = batch.offsetX[first + l];
+				offsetY[l] = batch.offsetY[first + l];
+			}
+			const CameraFloats u = x / CameraFloats( float( width ) );
+			const CameraFloats v = y / CameraFloats( float( height ) );
+			const CameraFloats viewX = CameraFloats( leftTop.x() ) + viewportHight * ( pixSize * offsetX + aspectRatio * u );
+			const CameraFloats viewY = CameraFloats( leftTop.y() ) + viewportHight * ( -pixSize * offsetY - v );
+			const CameraFloats viewZ( leftTop.z() + 0.0f );
+			const Vec3xN<CAMERA_LANES> pixPos = origin + viewX * camerRight + viewY * camerUp + viewZ * camerForward;
+			const Vec3xN<CAMERA_LANES> dir = unit_vector( pixPos - origin );
+			for ( int l = 0; l < lanes; ++l )
+				batch.samples[first + l].ray.direction = dir.get( l );
+		}
+	};
+	auto flushBatch = [&]( SampleBatch& batch, PathStats& pathStats ) {
+		const size_t count = batch.samples.size();
+		cameraRays( batch );
+		if ( wavefront )
+		{
+			batch.wavefront->render( batch.samples.data(), count, *batch.samplers[0], pathStats, batch.radiance.data(), batch.aovs.data() );
+		}
+		else if ( options.packets )
+		{
+			tracePacket( batch.samples.data(), int( count ), scene, bvh, lights, settings, batch.pointers.data(), pathStats, batch.radiance.data(), batch.aovs.data() );
+		}
+		else
+		{
+			for ( size_t i = 0; i < count; ++i )
+				batch.radiance[i] = trace( batch.samples[i].ray, scene, bvh, lights, settings, *batch.samplers[i], pathStats, &batch.aovs[i] );
+		}
+		for ( size_t i = 0; i < count; ++i )
+		{
+			const CameraSample& s = batch.samples[i];
+			const PathAov& aov = batch.aovs[i];
+			film.add( s.x, s.y, batch.radiance[i] );
+			film.addAov( s.x, s.y, aov.albedo, aov.normal, aov.depth );
+		}
+		batch.samples.clear();
+		batch.offsetX.clear();
+		batch.offsetY.clear();
+	};
+
+	// Сэмплы [first, first + count) пикселя (x, y); в кадре они окажутся после flushBatch
+	// Направление луча считает cameraRays при сбросе пачки
+	auto renderPixel = [&]( int x, int y, std::uint32_t first, std::uint32_t count, SampleBatch& batch, PathStats& pathStats ) {
+		for ( std::uint32_t s = first; s < first + count; ++s )
+		{
+			//Vector3 pixPos = leftTop + Vector3( pixSize / 2.0 + x * pixSize, pixSize / 2.0 + y * pixSize, 0 );
+			//Vector3 pixPos = leftTop + Vector3( pixSize / 2.0f + u * aspectRatio, -pixSize / 2.0f - v, 0.0f );
+			Sampler& sampler = *batch.samplers[wavefront ? 0 : batch.samples.size()];
+			sampler.startPixelSample( x, y, s );
+			float offsetX, offsetY;
+			sampler.getPixel2D( offsetX, offsetY );
+			batch.offsetX.push_back( offsetX );
+			batch.offsetY.push_back( offsetY );
+			batch.samples.push_back( CameraSample{ Ray{ camera.pos, Vector3() }, std::uint32_t( x ), std::uint32_t( y ), s } );
+			if ( batch.samples.size() == batch.capacity )
+				flushBatch( batch, pathStats );
+		}
+	};
+
+	// Базовый проход: samples^2 на пиксель, с бюджетом - не больше среднего по бюджету
+	const std::uint64_t pixelCount = std::uint64_t( width ) * height;
+	std::uint32_t baseSamples = std::uint32_t( SIDE_SAMPLE_COUNT * SIDE_SAMPLE_COUNT );
+	if ( options.budget > 0 )
+		baseSamples = std::uint32_t( std::max<std::uint64_t>( 2, std::min<std::uint64_t>( baseSamples, options.budget / pixelCount ) ) );
+
+	const int tileSize = options.tileSize;
+	const int tilesX = ( width + tileSize - 1 ) / tileSize;
+	const int tilesY = ( height + tileSize - 1 ) / tileSize;
+
+	using Clock = std::chrono::steady_clock;
+	const bool progressive = options.progressive || options.timeLimit > 0.0 || options.checkpointInterval > 0.0;
+	const bool hasDeadline = options.timeLimit > 0.0;
+	const Clock::time_point deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>( std::chrono::duration<double>( options.timeLimit ) );
+
+	// Все пиксели тайлами по count сэмплов, продолжая с уже накопленных, но не больше target.
+	// После дедлайна оставшиеся тайлы пропускаются, у их пикселей просто меньше сэмплов.
+	auto renderTiles = [&]( std::uint32_t count, std::uint32_t target ) {
+		pool.parallelFor( size_t( tilesX ) * tilesY, [&]( size_t tile ) {
+			if ( hasDeadline && Clock::now() >= deadline )
+				return;
+			const int x0 = int( tile % tilesX ) * tileSize;
+			const int y0 = int( tile / tilesX ) * tileSize;
+			const int x1 = std::min<int>( x0 + tileSize, width );
+			const int y1 = std::min<int>( y0 + tileSize, height );
+			PathStats tileStats;
+			const std::unique_ptr<SampleBatch> batch = createBatch();
+
+			for ( int y = y0; y < y1; ++y )
+			{
+				for ( int x = x0; x < x1; ++x )
+				{
+					const std::uint32_t done = film.pixel( x, y ).count;
+					if ( done < target )
+						renderPixel( x, y, done, std::min( count, target - done ), *batch, tileStats );
+				}
+			}
+			flushBatch( *batch, tileStats );
+
+			std::lock_guard<std::mutex> lock( statsMutex );
+			stats.merge( tileStats );
+		} );
+	};
+
+	auto lastCheckpoint = Clock::now();
+	auto checkpointDue = [&]() {
+		return options.checkpointInterval > 0.0 &&
+			std::chrono::duration<double>( Clock::now() - lastCheckpoint ).count() >= options.checkpointInterval;
+	};
+	auto writeCheckpoint = [&]() {
+		std::cout << "Checkpoint: " << film.totalSamples() << " samples, "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::high_resolution_clock::now() - start ).count() << " milliseconds" << std::endl;
+		const bool ok = film.saveCheckpoint( options.checkpoint, checkpointInfo );
+		lastCheckpoint = Clock::now();
+		return ok;
+	};
+
+	if ( progressive )
+	{
+		// Проходы по 1 сэмплу на пиксель до samples^2 или дедлайна. Снимок перезаписывает
+		// выходной файл, так что в любой момент там лучшее готовое изображение.
+		// После возобновления начинаем с самого отстающего пикселя.
+		auto lastSnapshot = Clock::now();
+		std::uint32_t pass = std::numeric_limits<std::uint32_t>::max();
+		for ( int y = 0; y < height; ++y )
+		{
+			for ( int x = 0; x < width; ++x )
+				pass = std::min( pass, film.pixel( x, y ).count );
+		}
+		std::uint32_t passes = 0;
+		for ( ; pass < baseSamples; ++pass, ++passes )
+		{
+			if ( hasDeadline && Clock::now() >= deadline )
+				break;
+			renderTiles( 1, pass + 1 );
+
+			if ( pass + 1 < baseSamples && checkpointDue() && !writeCheckpoint() )
+				return 1;
+			if ( options.snapshotInterval > 0.0 && pass + 1 < baseSamples &&
+				std::chrono::duration<double>( Clock::now() - lastSnapshot ).count() >= options.snapshotInterval )
+			{
+				std::vector<Vector3> snapshot;
+				resolveImage( snapshot );
+				std::cout << "Snapshot: " << pass + 1 << " spp, "
+					<< std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::high_resolution_clock::now() - start ).count() << " milliseconds" << std::endl;
+				if ( !saveImageToFile( options.output, format, width, height, snapshot, pool ) )
+					return 1;
+				lastSnapshot = Clock::now();
+			}
+		}
+		std::cout << "Progressive: " << passes << " passes, " << double( film.totalSamples() ) / pixelCount << " samples per pixel" << std::endl;
+	}
+	else
+	{
+		renderTiles( baseSamples, baseSamples );
+	}
+
+	// Адаптивные проходы: остаток бюджета уходит пикселям, у которых доверительный интервал
+	// шире порога, сначала самым шумным
+	if ( options.budget > 0 )
+	{
+		const size_t PIXELS_PER_TASK = 64;
+		const std::uint32_t batch = baseSamples;
+		std::vector<std::pair<float, std::uint32_t>> active;
+		int passes = 0;
+		while ( true )
+		{
+			const std::uint64_t spent = film.totalSamples();
+			if ( spent >= options.budget || ( hasDeadline && Clock::now() >= deadline ) )
+				break;
+			const std::uint64_t remaining = options.budget - spent;
+
+			// Сначала пиксели, которым сэмплы уже назначены: после возобновления прерванный
+			// проход доделывается с теми же назначениями, и кадр совпадает с непрерывным рендером
+			active.clear();
+			for ( int y = 0; y < height; ++y )
+			{
+				for ( int x = 0; x < width; ++x )
+				{
+					if ( film.pixel( x, y ).count < film.pixel( x, y ).target )
+						active.push_back( { 0.0f, std::uint32_t( y * width + x ) } );
+				}
+			}
+
+			if ( active.empty() )
+			{
+				for ( int y = 0; y < height; ++y )
+				{
+					for ( int x = 0; x < width; ++x )
+					{
+						const float error = film.relativeError( x, y );
+						if ( error > options.threshold )
+							active.push_back( { error, std::uint32_t( y * width + x ) } );
+					}
+				}
+				if ( active.empty() )
+					break;
+
+				std::uint32_t perPixel = batch;
+				if ( remaining < active.size() * std::uint64_t( batch ) )
+				{
+					std::sort( active.begin(), active.end(), []( const auto& a, const auto& b ) { return a.first > b.first; } );
+					perPixel = std::uint32_t( std::max<std::uint64_t>( 1, remaining / active.size() ) );
+					active.resize( size_t( std::min<std::uint64_t>( active.size(), remaining / perPixel ) ) );
+				}
+				for ( const auto& a : active )
+				{
+					const int x = int( a.second % width );
+					const int y = int( a.second / width );
+					film.setTarget( x, y, film.pixel( x, y ).count + perPixel );
+				}
+			}
+
+			pool.parallelFor( ( active.size() + PIXELS_PER_TASK - 1 ) / PIXELS_PER_TASK, [&]( size_t task ) {
+				if ( hasDeadline && Clock::now() >= deadline )
+					return;
+				PathStats taskStats;
+				const std::unique_ptr<SampleBatch> batch = createBatch();
+				const size_t end = std::min( active.size(), ( task + 1 ) * PIXELS_PER_TASK );
+				for ( size_t i = task * PIXELS_PER_TASK; i < end; ++i )
+				{
+					const int x = int( active[i].second % width );
+					const int y = int( active[i].second / width );
+					const FilmPixel& p = film.pixel( x, y );
+					renderPixel( x, y, p.count, p.target - p.count, *batch, taskStats );
+				}
+				flushBatch( *batch, taskStats );
+
+				std::lock_guard<std::mutex> lock( statsMutex );
+				stats.merge( taskStats );
+			} );
+			passes++;
+
+			if ( checkpointDue() && !writeCheckpoint() )
+				return 1;
+		}
+
+		size_t converged = 0;
+		for ( int y = 0; y < height; ++y )
+		{
+			for ( int x = 0; x < width; ++x )
+				converged += film.relativeError( x, y ) <= options.threshold ? 1 : 0;
+		}
+		std::cout << "Adaptive: " << passes << " passes, " << film.totalSamples() << " samples, "
+			<< double( film.totalSamples() ) / pixelCount << " per pixel, "
+			<< 100.0 * converged / pixelCount << "% pixels under error " << options.threshold << std::endl;
+	}
+
+	auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
+	std::cout << "Time: " << duration_ms.count() << " milliseconds, " << pool.size() << " threads" << std::endl;
+	stats.print();
 
-	return 0;
+	return saveResults() ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,320 @@
+#include "options.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "denoise.h"
+
+namespace {
+	bool readString( int argc, char** argv, int& i, std::string& value )
+	{
+		if ( i + 1 >= argc )
+		{
+			std::fprintf( stderr, "Error: %s expects a value\n", argv[i] );
+			return false;
+		}
+		value = argv[++i];
+		return true;
+	}
+
+	bool readDouble( int argc, char** argv, int& i, double& value )
+	{
+		if ( i + 1 >= argc )
+		{
+			std::fprintf( stderr, "Error: %s expects a value\n", argv[i] );
+			return false;
+		}
+		value = std::atof( argv[++i] );
+		return true;
+	}
+
+	bool readInt( int argc, char** argv, int& i, int& value )
+	{
+		if ( i + 1 >= argc )
+		{
+			std::fprintf( stderr, "Error: %s expects a value\n", argv[i] );
+			return false;
+		}
+		value = std::atoi( argv[++i] );
+		return true;
+	}
+}
+
+void printUsage( const char* exe )
+{
+	std::printf( "Usage: %s [scene.txt] [options]\n", exe );
+	std::printf( "  --samples N    samples per pixel side (overrides the scene)\n" );
+	std::printf( "  --threads N    worker threads, 0 - hardware thread count\n" );
+	std::printf( "  --tile N       tile size in pixels\n" );
+	std::printf( "  --cache        use <scene>.pbrs binary cache, rebuild it when stale\n" );
+	std::printf( "  --convert      write <scene>.pbrs with the prebuilt BVH and exit\n" );
+	std::printf( "  -o, --output F output image path (default output.ppm)\n" );
+	std::printf( "  --format F     p3, p6 or pfm (raw HDR floats), default by extension\n" );
+	std::printf( "  --bvh-build NAME  sah (binned SAH, default) or lbvh (Morton codes, faster\n" );
+	std::printf( "                 to build, slower to trace); both use all --threads\n" );
+	std::printf( "  --bvh-width N  2 (binary), 4 or 8 children per BVH node (default 4)\n" );
+	std::printf( "  --edge-cache   precompute triangle edges for faster traversal at 36 more\n" );
+	std::printf( "                 bytes per triangle (48 with the SSE Vector3)\n" );
+	std::printf( "  --brute-force-limit N  scenes of up to N spheres and no triangles test every\n" );
+	std::printf( "                 sphere with SIMD kernels instead of traversing the BVH\n" );
+	std::printf( "                 (default 32, 0 - never)\n" );
+	std::printf( "  --no-packets   trace camera and mirror rays and test wavefront shadow rays one by\n" );
+	std::printf( "                 one instead of in 8-ray packets\n" );
+	std::printf( "  --integrator NAME  path (default) or wavefront: bounce by bounce over batches\n" );
+	std::printf( "                 of samples with hits sorted by material type\n" );
+	std::printf( "  --kernels NAME SIMD kernels: auto (default, best for this CPU), sse2, sse4.2,\n" );
+	std::printf( "                 avx2 or avx512\n" );
+	std::printf( "  --sampler NAME random, sobol (Owen-scrambled) or bluenoise, overrides the scene\n" );
+	std::printf( "  --seed N       decorrelates independent renders of the same scene\n" );
+	std::printf( "  --budget N     total samples per frame: samples^2 per pixel first, the rest\n" );
+	std::printf( "                 goes to pixels whose error is above --threshold\n" );
+	std::printf( "  --threshold E  relative 95%% confidence half-width to stop at (default 0.05)\n" );
+	std::printf( "  --heatmap F    write the samples-per-pixel map (pfm stores raw counts)\n" );
+	std::printf( "  --denoise      filter the image with albedo/normal/depth guided a-trous before tonemapping\n" );
+	std::printf( "  --denoise-iterations N  a-trous passes, the filter radius doubles with each\n" );
+	std::printf( "                 (default 4, at most 16)\n" );
+	std::printf( "  --aov PREFIX   write PREFIX-albedo.pfm, PREFIX-normal.pfm and PREFIX-depth.pfm\n" );
+	std::printf( "  --progressive  render 1 spp passes up to samples^2, see --time-limit and --snapshot\n" );
+	std::printf( "  --time-limit S stop after S seconds with the samples done so far (implies --progressive)\n" );
+	std::printf( "  --snapshot S   rewrite the output image every S seconds while rendering progressively\n" );
+	std::printf( "  --checkpoint F write the accumulated samples to F at the end of the render\n" );
+	std::printf( "  --checkpoint-interval S  also rewrite the checkpoint every S seconds (implies --progressive)\n" );
+	std::printf( "  --resume       continue from the --checkpoint file if it exists\n" );
+	std::printf( "  --merge F      merge checkpoints of renders with different --seed instead of\n" );
+	std::printf( "                 rendering, repeat for each file\n" );
+	std::printf( "  --max-depth N  maximum number of bounces (default 16)\n" );
+	std::printf( "  --rr-depth N   bounce from which Russian roulette starts (default 3)\n" );
+	std::printf( "  --no-nee       disable next event estimation (BSDF sampling only)\n" );
+	std::printf( "  --bench NAME   run a microbenchmark on the scene instead of rendering:\n" );
+	std::printf( "                 triangles - ray/triangle intersection kernels\n" );
+	std::printf( "                 load - parse a synthetic scene of --bench-triangles triangles\n" );
+	std::printf( "                 pool - --bench-rays back-to-back small parallelFor calls on\n" );
+	std::printf( "                        2, 4 and 8 threads, each item must run exactly once\n" );
+	std::printf( "                 bvh - SAH vs LBVH build time and binary vs 4- and 8-wide traversal,\n" );
+	std::printf( "                       on the scene and on it tessellated to --bench-triangles\n" );
+	std::printf( "                 packets - camera and mirror rays one by one vs 8-ray packets\n" );
+	std::printf( "                 kernels - speed of every SIMD kernel variant this CPU runs and\n" );
+	std::printf( "                           their differences from sse2\n" );
+	std::printf( "                 bruteforce - BVH traversal vs testing every primitive on the\n" );
+	std::printf( "                              scene and on synthetic scenes of 4 to 128 spheres\n" );
+	std::printf( "                 shadow - visibility of shadow rays: closest hit vs any hit,\n" );
+	std::printf( "                          one by one and in 8-ray packets\n" );
+	std::printf( "                 instances - a grid of copies of the scene triangles as mesh\n" );
+	std::printf( "                             instances vs flattened: memory, build, traversal\n" );
+	std::printf( "  --bench-rays N rays per benchmark\n" );
+	std::printf( "  --bench-triangles N  triangles in synthetic benchmark scenes\n" );
+}
+
+bool parseOptions( int argc, char** argv, Options& options )
+{
+	for ( int i = 1; i < argc; ++i )
+	{
+		const char* arg = argv[i];
+		int value = 0;
+		if ( std::strcmp( arg, "--samples" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.samples ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--threads" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, value ) || value < 0 )
+				return false;
+			options.threads = (unsigned)value;
+		}
+		else if ( std::strcmp( arg, "--tile" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.tileSize ) || options.tileSize <= 0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--cache" ) == 0 )
+		{
+			options.cache = true;
+		}
+		else if ( std::strcmp( arg, "--convert" ) == 0 )
+		{
+			options.convert = true;
+		}
+		else if ( std::strcmp( arg, "--output" ) == 0 || std::strcmp( arg, "-o" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.output ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--format" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.format ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--bvh-build" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.bvhBuilder ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--bvh-width" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.bvhWidth ) || ( options.bvhWidth != 2 && options.bvhWidth != 4 && options.bvhWidth != 8 ) )
+			{
+				std::fprintf( stderr, "Error: --bvh-width expects 2, 4 or 8\n" );
+				return false;
+			}
+		}
+		else if ( std::strcmp( arg, "--edge-cache" ) == 0 )
+		{
+			options.edgeCache = true;
+		}
+		else if ( std::strcmp( arg, "--brute-force-limit" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.bruteForceLimit ) || options.bruteForceLimit < 0 )
+			{
+				std::fprintf( stderr, "Error: --brute-force-limit expects a non-negative number\n" );
+				return false;
+			}
+		}
+		else if ( std::strcmp( arg, "--sampler" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.sampler ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--seed" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, value ) || value < 0 )
+				return false;
+			options.seed = (unsigned)value;
+		}
+		else if ( std::strcmp( arg, "--budget" ) == 0 )
+		{
+			std::string text;
+			if ( !readString( argc, argv, i, text ) )
+				return false;
+			options.budget = std::strtoull( text.c_str(), nullptr, 10 );
+		}
+		else if ( std::strcmp( arg, "--threshold" ) == 0 )
+		{
+			double value = 0.0;
+			if ( !readDouble( argc, argv, i, value ) || value <= 0.0 )
+				return false;
+			options.threshold = (float)value;
+		}
+		else if ( std::strcmp( arg, "--heatmap" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.heatmap ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--denoise" ) == 0 )
+		{
+			options.denoise = true;
+		}
+		else if ( std::strcmp( arg, "--denoise-iterations" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.denoiseIterations ) || options.denoiseIterations < 0 ||
+				options.denoiseIterations > DENOISE_MAX_ITERATIONS )
+			{
+				std::fprintf( stderr, "Error: --denoise-iterations expects 0 to %d\n", DENOISE_MAX_ITERATIONS );
+				return false;
+			}
+		}
+		else if ( std::strcmp( arg, "--aov" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.aov ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--progressive" ) == 0 )
+		{
+			options.progressive = true;
+		}
+		else if ( std::strcmp( arg, "--time-limit" ) == 0 )
+		{
+			if ( !readDouble( argc, argv, i, options.timeLimit ) || options.timeLimit < 0.0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--snapshot" ) == 0 )
+		{
+			if ( !readDouble( argc, argv, i, options.snapshotInterval ) || options.snapshotInterval < 0.0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--checkpoint" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.checkpoint ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--checkpoint-interval" ) == 0 )
+		{
+			if ( !readDouble( argc, argv, i, options.checkpointInterval ) || options.checkpointInterval < 0.0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--resume" ) == 0 )
+		{
+			options.resume = true;
+		}
+		else if ( std::strcmp( arg, "--merge" ) == 0 )
+		{
+			std::string path;
+			if ( !readString( argc, argv, i, path ) )
+				return false;
+			options.merge.push_back( path );
+		}
+		else if ( std::strcmp( arg, "--max-depth" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.maxDepth ) || options.maxDepth < 0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--rr-depth" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.rouletteDepth ) || options.rouletteDepth < 0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--no-nee" ) == 0 )
+		{
+			options.nee = false;
+		}
+		else if ( std::strcmp( arg, "--no-packets" ) == 0 )
+		{
+			options.packets = false;
+		}
+		else if ( std::strcmp( arg, "--integrator" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.integrator ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--kernels" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.kernels ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--bench" ) == 0 )
+		{
+			if ( !readString( argc, argv, i, options.bench ) )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--bench-rays" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.benchRays ) || options.benchRays <= 0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--bench-triangles" ) == 0 )
+		{
+			if ( !readInt( argc, argv, i, options.benchTriangles ) || options.benchTriangles <= 0 )
+				return false;
+		}
+		else if ( std::strcmp( arg, "--help" ) == 0 || std::strcmp( arg, "-h" ) == 0 )
+		{
+			return false;
+		}
+		else if ( arg[0] == '-' )
+		{
+			std::fprintf( stderr, "Error: unknown option %s\n", arg );
+			return false;
+		}
+		else
+		{
+			options.scene = arg;
+		}
+	}
+	if ( ( options.resume || options.checkpointInterval > 0.0 ) && options.checkpoint.empty() )
+	{
+		std::fprintf( stderr, "Error: --resume and --checkpoint-interval need --checkpoint\n" );
+		return false;
+	}
+	return true;
+}
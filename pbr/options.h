@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Options
+{
+	std::string scene = "../scenes/04-scene-medium.txt";
+	int samples = 0; // сэмплов на сторону пикселя, 0 - из файла сцены
+	unsigned threads = 0; // 0 - по числу аппаратных потоков
+	int tileSize = 16;
+	bool cache = false;   // читать/писать бинарный кеш <scene>.pbrs
+	bool convert = false; // только записать кеш и выйти
+	std::string output = "output.ppm";
+	std::string format; // p3, p6, pfm; пусто - по расширению output
+	bool nee = true; // явное сэмплирование источников света
+	std::string bvhBuilder = "sah"; // sah или lbvh
+	int bvhWidth = 4; // 2 - бинарная BVH, 4 или 8 - широкие узлы с SIMD проверкой детей
+	bool edgeCache = false; // ребра треугольников заранее: быстрее обход, больше памяти
+	int bruteForceLimit = -1; // сфер, до которых BVH без треугольников перебирает все вместо обхода, -1 - порог по умолчанию
+	bool packets = true; // лучи камеры и отражения от зеркал пакетами по 8
+	std::string integrator = "path"; // path или wavefront
+	std::string kernels = "auto"; // набор инструкций SIMD-ядер: auto - лучший для процессора
+	std::string sampler; // random, sobol, bluenoise; пусто - из сцены
+	unsigned seed = 0;   // независимые прогоны одной сцены отличаются seed
+	std::uint64_t budget = 0; // всего сэмплов на кадр для адаптивного режима, 0 - ровно samples^2 на пиксель
+	float threshold = 0.05f;  // относительная ошибка пикселя, после которой сэмплы ему не добавляются
+	std::string heatmap;      // карта числа сэмплов на пиксель
+	bool denoise = false;      // a-trous по AOV перед тонмаппингом, в том числе для снимков
+	int denoiseIterations = 4;
+	std::string aov;           // префикс файлов albedo, normal и depth в PFM
+	bool progressive = false;     // проходы по 1 сэмплу на пиксель
+	double timeLimit = 0.0;       // секунд на рендер, включает progressive; 0 - без ограничения
+	double snapshotInterval = 0.0; // секунд между промежуточными снимками в output
+	std::string checkpoint;          // файл контрольной точки, пишется в конце и каждые checkpointInterval секунд
+	double checkpointInterval = 0.0; // включает progressive
+	bool resume = false;             // продолжить с checkpoint, если он есть
+	std::vector<std::string> merge;  // объединить контрольные точки прогонов с разными seed вместо рендера
+	int maxDepth = 16;
+	int rouletteDepth = 3;
+
+	std::string bench; // имя микробенчмарка, пусто - обычный рендер
+	int benchRays = 10000;
+	int benchTriangles = 2000000;
+};
+
+bool parseOptions( int argc, char** argv, Options& options );
+void printUsage( const char* exe );
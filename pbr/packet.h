@@ -0,0 +1,364 @@
+#pragma once
+
+#include "geometry.h"
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define PACKET_SSE 1
+#include <immintrin.h>
+#if defined( __SSE4_1__ )
+#define PACKET_SSE41 1
+#endif
+#if defined( __AVX__ )
+#define PACKET_AVX 1
+#endif
+#if defined( __AVX512F__ ) && defined( __AVX512VL__ )
+#define PACKET_AVX512 1
+#endif
+#endif
+
+// Код ниже зависит от набора инструкций единицы трансляции, а ядра kernels_<isa>.cpp собираются
+// с разными флагами (см. kernels.h). Свое пространство имен на каждый набор не дает линкеру
+// склеить inline-функции разных вариантов в одну копию.
+#if defined( PACKET_AVX512 )
+#define PACKET_NAMESPACE packet_avx512
+#elif defined( __AVX2__ )
+#define PACKET_NAMESPACE packet_avx2
+#elif defined( PACKET_AVX )
+#define PACKET_NAMESPACE packet_avx
+#elif defined( PACKET_SSE41 )
+#define PACKET_NAMESPACE packet_sse41
+#elif defined( PACKET_SSE )
+#define PACKET_NAMESPACE packet_sse2
+#else
+#define PACKET_NAMESPACE packet_scalar
+#endif
+
+// Лучей в пакете - ширина регистра AVX. Без AVX пакет считается двумя половинами SSE.
+const int PACKET_SIZE = 8;
+
+// Пакет лучей по компонентам (SoA) в памяти: так пакет передается в ядра любого варианта.
+// Неполный пакет дополняется копиями последнего луча.
+struct alignas( 32 ) PacketRays
+{
+	float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+	float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+	float ix[PACKET_SIZE], iy[PACKET_SIZE], iz[PACKET_SIZE]; // 1 / direction, как в скалярном обходе
+};
+
+inline namespace PACKET_NAMESPACE {
+
+// Маска дорожек пакета: результат сравнения Float8
+struct Mask8
+{
+#if defined( PACKET_AVX512 )
+	__mmask8 k;
+#elif defined( PACKET_AVX )
+	__m256 v;
+#elif defined( PACKET_SSE )
+	__m128 lo, hi;
+#else
+	bool b[PACKET_SIZE];
+#endif
+};
+
+// 8 float по дорожкам. Операции поэлементные, без FMA и перестановок, поэтому код,
+// повторяющий скалярные формулы в том же порядке, дает те же результаты до бита.
+struct Float8
+{
+#if defined( PACKET_AVX )
+	__m256 v;
+#elif defined( PACKET_SSE )
+	__m128 lo, hi;
+#else
+	float f[PACKET_SIZE];
+#endif
+
+	Float8() = default;
+
+	explicit Float8( float x )
+	{
+#if defined( PACKET_AVX )
+		v = _mm256_set1_ps( x );
+#elif defined( PACKET_SSE )
+		lo = hi = _mm_set1_ps( x );
+#else
+		for ( float& a : f )
+			a = x;
+#endif
+	}
+
+	static Float8 load( const float* p )
+	{
+		Float8 r;
+#if defined( PACKET_AVX )
+		r.v = _mm256_loadu_ps( p );
+#elif defined( PACKET_SSE )
+		r.lo = _mm_loadu_ps( p );
+		r.hi = _mm_loadu_ps( p + 4 );
+#else
+		for ( int i = 0; i < PACKET_SIZE; ++i )
+			r.f[i] = p[i];
+#endif
+		return r;
+	}
+
+	void store( float* p ) const
+	{
+#if defined( PACKET_AVX )
+		_mm256_storeu_ps( p, v );
+#elif defined( PACKET_SSE )
+		_mm_storeu_ps( p, lo );
+		_mm_storeu_ps( p + 4, hi );
+#else
+		for ( int i = 0; i < PACKET_SIZE; ++i )
+			p[i] = f[i];
+#endif
+	}
+};
+
+#if defined( PACKET_AVX )
+#define PACKET_FLOAT_OP( name, avx, sse, expr ) \
+	inline Float8 name( const Float8& a, const Float8& b ) { Float8 r; r.v = avx( a.v, b.v ); return r; }
+#elif defined( PACKET_SSE )
+#define PACKET_FLOAT_OP( name, avx, sse, expr ) \
+	inline Float8 name( const Float8& a, const Float8& b ) { Float8 r; r.lo = sse( a.lo, b.lo ); r.hi = sse( a.hi, b.hi ); return r; }
+#else
+#define PACKET_FLOAT_OP( name, avx, sse, expr ) \
+	inline Float8 name( const Float8& a, const Float8& b ) \
+	{ Float8 r; for ( int i = 0; i < PACKET_SIZE; ++i ) { const float x = a.f[i], y = b.f[i]; r.f[i] = expr; } return r; }
+#endif
+
+#if defined( PACKET_AVX512 )
+#define PACKET_MASK_OP( name, predicate, sse, expr ) \
+	inline Mask8 name( const Float8& a, const Float8& b ) { Mask8 r; r.k = _mm256_cmp_ps_mask( a.v, b.v, predicate ); return r; }
+#elif defined( PACKET_AVX )
+#define PACKET_MASK_OP( name, predicate, sse, expr ) \
+	inline Mask8 name( const Float8& a, const Float8& b ) { Mask8 r; r.v = _mm256_cmp_ps( a.v, b.v, predicate ); return r; }
+#elif defined( PACKET_SSE )
+#define PACKET_MASK_OP( name, predicate, sse, expr ) \
+	inline Mask8 name( const Float8& a, const Float8& b ) { Mask8 r; r.lo = sse( a.lo, b.lo ); r.hi = sse( a.hi, b.hi ); return r; }
+#else
+#define PACKET_MASK_OP( name, predicate, sse, expr ) \
+	inline Mask8 name( const Float8& a, const Float8& b ) \
+	{ Mask8 r; for ( int i = 0; i < PACKET_SIZE; ++i ) { const float x = a.f[i], y = b.f[i]; r.b[i] = expr; } return r; }
+#endif
+
+PACKET_FLOAT_OP( operator+, _mm256_add_ps, _mm_add_ps, x + y )
+PACKET_FLOAT_OP( operator-, _mm256_sub_ps, _mm_sub_ps, x - y )
+PACKET_FLOAT_OP( operator*, _mm256_mul_ps, _mm_mul_ps, x * y )
+PACKET_FLOAT_OP( operator/, _mm256_div_ps, _mm_div_ps, x / y )
+// Как minps/maxps: при NaN в любом операнде результат - второй операнд
+PACKET_FLOAT_OP( vmin, _mm256_min_ps, _mm_min_ps, x < y ? x : y )
+PACKET_FLOAT_OP( vmax, _mm256_max_ps, _mm_max_ps, x > y ? x : y )
+
+// Сравнения как в C++: с NaN ложны все, кроме !=
+PACKET_MASK_OP( operator<, _CMP_LT_OQ, _mm_cmplt_ps, x < y )
+PACKET_MASK_OP( operator<=, _CMP_LE_OQ, _mm_cmple_ps, x <= y )
+PACKET_MASK_OP( operator>, _CMP_GT_OQ, _mm_cmpgt_ps, x > y )
+PACKET_MASK_OP( operator>=, _CMP_GE_OQ, _mm_cmpge_ps, x >= y )
+PACKET_MASK_OP( operator!=, _CMP_NEQ_UQ, _mm_cmpneq_ps, x != y )
+PACKET_MASK_OP( operator==, _CMP_EQ_OQ, _mm_cmpeq_ps, x == y )
+
+#undef PACKET_FLOAT_OP
+#undef PACKET_MASK_OP
+
+// Смена знака, -0 для 0, как у скалярного унарного минуса
+inline Float8 operator-( const Float8& a )
+{
+#if defined( PACKET_AVX )
+	Float8 r;
+	r.v = _mm256_xor_ps( a.v, _mm256_set1_ps( -0.0f ) );
+	return r;
+#elif defined( PACKET_SSE )
+	Float8 r;
+	r.lo = _mm_xor_ps( a.lo, _mm_set1_ps( -0.0f ) );
+	r.hi = _mm_xor_ps( a.hi, _mm_set1_ps( -0.0f ) );
+	return r;
+#else
+	Float8 r;
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+		r.f[i] = -a.f[i];
+	return r;
+#endif
+}
+
+inline Float8 vsqrt( const Float8& a )
+{
+	Float8 r;
+#if defined( PACKET_AVX )
+	r.v = _mm256_sqrt_ps( a.v );
+#elif defined( PACKET_SSE )
+	r.lo = _mm_sqrt_ps( a.lo );
+	r.hi = _mm_sqrt_ps( a.hi );
+#else
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+		r.f[i] = std::sqrt( a.f[i] );
+#endif
+	return r;
+}
+
+inline Mask8 operator&( const Mask8& a, const Mask8& b )
+{
+	Mask8 r;
+#if defined( PACKET_AVX512 )
+	r.k = __mmask8( a.k & b.k );
+#elif defined( PACKET_AVX )
+	r.v = _mm256_and_ps( a.v, b.v );
+#elif defined( PACKET_SSE )
+	r.lo = _mm_and_ps( a.lo, b.lo );
+	r.hi = _mm_and_ps( a.hi, b.hi );
+#else
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+		r.b[i] = a.b[i] && b.b[i];
+#endif
+	return r;
+}
+
+// m ? a : b по дорожкам
+inline Float8 vselect( const Mask8& m, const Float8& a, const Float8& b )
+{
+	Float8 r;
+#if defined( PACKET_AVX512 )
+	r.v = _mm256_mask_blend_ps( m.k, b.v, a.v );
+#elif defined( PACKET_AVX )
+	r.v = _mm256_blendv_ps( b.v, a.v, m.v );
+#elif defined( PACKET_SSE41 )
+	r.lo = _mm_blendv_ps( b.lo, a.lo, m.lo );
+	r.hi = _mm_blendv_ps( b.hi, a.hi, m.hi );
+#elif defined( PACKET_SSE )
+	r.lo = _mm_or_ps( _mm_and_ps( m.lo, a.lo ), _mm_andnot_ps( m.lo, b.lo ) );
+	r.hi = _mm_or_ps( _mm_and_ps( m.hi, a.hi ), _mm_andnot_ps( m.hi, b.hi ) );
+#else
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+		r.f[i] = m.b[i] ? a.f[i] : b.f[i];
+#endif
+	return r;
+}
+
+// Бит i - дорожка i
+inline int movemask( const Mask8& m )
+{
+#if defined( PACKET_AVX512 )
+	return m.k;
+#elif defined( PACKET_AVX )
+	return _mm256_movemask_ps( m.v );
+#elif defined( PACKET_SSE )
+	return _mm_movemask_ps( m.lo ) | ( _mm_movemask_ps( m.hi ) << 4 );
+#else
+	int bits = 0;
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+		bits |= m.b[i] ? 1 << i : 0;
+	return bits;
+#endif
+}
+
+// Минимум и максимум по дорожкам, без NaN
+inline float hmin( const Float8& a )
+{
+#if defined( PACKET_SSE )
+#if defined( PACKET_AVX )
+	__m128 m = _mm_min_ps( _mm256_castps256_ps128( a.v ), _mm256_extractf128_ps( a.v, 1 ) );
+#else
+	__m128 m = _mm_min_ps( a.lo, a.hi );
+#endif
+	m = _mm_min_ps( m, _mm_movehl_ps( m, m ) );
+	m = _mm_min_ss( m, _mm_shuffle_ps( m, m, 1 ) );
+	return _mm_cvtss_f32( m );
+#else
+	float r = a.f[0];
+	for ( int i = 1; i < PACKET_SIZE; ++i )
+		r = a.f[i] < r ? a.f[i] : r;
+	return r;
+#endif
+}
+
+inline float hmax( const Float8& a )
+{
+#if defined( PACKET_SSE )
+#if defined( PACKET_AVX )
+	__m128 m = _mm_max_ps( _mm256_castps256_ps128( a.v ), _mm256_extractf128_ps( a.v, 1 ) );
+#else
+	__m128 m = _mm_max_ps( a.lo, a.hi );
+#endif
+	m = _mm_max_ps( m, _mm_movehl_ps( m, m ) );
+	m = _mm_max_ss( m, _mm_shuffle_ps( m, m, 1 ) );
+	return _mm_cvtss_f32( m );
+#else
+	float r = a.f[0];
+	for ( int i = 1; i < PACKET_SIZE; ++i )
+		r = a.f[i] > r ? a.f[i] : r;
+	return r;
+#endif
+}
+
+// Пакет лучей в регистрах
+struct RayPacket
+{
+	Float8 ox, oy, oz;
+	Float8 dx, dy, dz;
+	Float8 ix, iy, iz;
+
+	explicit RayPacket( const PacketRays& rays )
+		: ox( Float8::load( rays.ox ) ), oy( Float8::load( rays.oy ) ), oz( Float8::load( rays.oz ) )
+		, dx( Float8::load( rays.dx ) ), dy( Float8::load( rays.dy ) ), dz( Float8::load( rays.dz ) )
+		, ix( Float8::load( rays.ix ) ), iy( Float8::load( rays.iy ) ), iz( Float8::load( rays.iz ) )
+	{
+	}
+};
+
+// Пакетные версии пересечений из geometry.h: те же формулы в том же порядке,
+// в дорожке - расстояние или tMax при промахе. Точки и векторы - три float (Vector3::d).
+
+inline Float8 intersectTriangleEdges( const RayPacket& r, const float* v0, const float* e1, const float* e2, const Float8& tMin, const Float8& tMax )
+{
+	const Float8 e1x( e1[0] ), e1y( e1[1] ), e1z( e1[2] );
+	const Float8 e2x( e2[0] ), e2y( e2[1] ), e2z( e2[2] );
+	const Float8 px = r.dy * e2z - r.dz * e2y;
+	const Float8 py = r.dz * e2x - r.dx * e2z;
+	const Float8 pz = r.dx * e2y - r.dy * e2x;
+	const Float8 det = e1x * px + e1y * py + e1z * pz;
+	const Float8 invDet = Float8( 1.0f ) / det;
+	const Float8 sx = r.ox - Float8( v0[0] );
+	const Float8 sy = r.oy - Float8( v0[1] );
+	const Float8 sz = r.oz - Float8( v0[2] );
+	const Float8 u = ( sx * px + sy * py + sz * pz ) * invDet;
+	const Float8 qx = sy * e1z - sz * e1y;
+	const Float8 qy = sz * e1x - sx * e1z;
+	const Float8 qz = sx * e1y - sy * e1x;
+	const Float8 v = ( r.dx * qx + r.dy * qy + r.dz * qz ) * invDet;
+	const Float8 t = ( e2x * qx + e2y * qy + e2z * qz ) * invDet;
+	const Float8 zero( 0.0f );
+	const Float8 one( 1.0f );
+	const Mask8 hit = ( det != zero ) & ( u >= zero ) & ( u <= one ) & ( v >= zero ) & ( u + v <= one ) & ( t >= tMin ) & ( t <= tMax );
+	return vselect( hit, t, tMax );
+}
+
+inline Float8 intersectSphere( const RayPacket& r, const float* center, float radius, const Float8& tMin, const Float8& tMax )
+{
+	const Float8 ox = r.ox - Float8( center[0] );
+	const Float8 oy = r.oy - Float8( center[1] );
+	const Float8 oz = r.oz - Float8( center[2] );
+	const Float8 B = Float8( 2.0f ) * ( ox * r.dx + oy * r.dy + oz * r.dz );
+	const Float8 C = ( ox * ox + oy * oy + oz * oz ) - Float8( radius * radius );
+	const Float8 D = B * B - Float8( 4.0f ) * C;
+	// При D < 0 корень - NaN, и оба сравнения ниже ложны
+	const Float8 sqrtD = vsqrt( D );
+	const Float8 t0 = ( -B - sqrtD ) / Float8( 2.0f );
+	const Float8 t1 = ( -B + sqrtD ) / Float8( 2.0f );
+	const Mask8 hit0 = ( t0 >= tMin ) & ( t0 < tMax );
+	const Mask8 hit1 = ( t1 >= tMin ) & ( t1 < tMax );
+	return vselect( hit0, t0, vselect( hit1, t1, tMax ) );
+}
+
+// Как intersectPlane2 при tMin > 0
+inline Float8 intersectPlane2( const RayPacket& r, const float* normal, float d, const Float8& tMin, const Float8& tMax )
+{
+	const Float8 nx( normal[0] ), ny( normal[1] ), nz( normal[2] );
+	const Float8 dist = ( nx * r.ox + ny * r.oy + nz * r.oz ) - Float8( d );
+	const Float8 dotND = r.dx * nx + r.dy * ny + r.dz * nz;
+	const Float8 t = dist / -dotND;
+	const Mask8 hit = ( dotND != Float8( 0.0f ) ) & ( t >= tMin ) & ( t <= tMax );
+	return vselect( hit, t, tMax );
+}
+
+} // namespace PACKET_NAMESPACE
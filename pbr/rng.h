@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+// Счетчиковый генератор: каждое число - хеш от (ключ пути, номер отскока, номер вызова).
+// Ключ строится из индекса пикселя и номера сэмпла, поэтому результат не зависит
+// от того, какой поток и в каком порядке считает пиксели. Состояние - 16 байт.
+class Rng
+{
+public:
+	// seed разводит независимые прогоны одной и той же сцены, 0 - ключи как без него
+	Rng( std::uint32_t pixel, std::uint32_t sample, std::uint32_t seed = 0 )
+		: key_( mix( ( ( std::uint64_t( pixel ) << 32 ) | sample ) ^ ( std::uint64_t( seed ) * 0xD1B54A32D192ED03ull ) ) )
+	{
+	}
+
+	// Каждый отскок получает свой диапазон счетчика
+	void setBounce( std::uint32_t bounce ) { counter_ = std::uint64_t( bounce ) << 32; }
+
+	std::uint32_t nextUint()
+	{
+		return std::uint32_t( mix( key_ + counter_++ ) >> 32 );
+	}
+
+	// [0, 1)
+	float nextFloat()
+	{
+		return float( nextUint() >> 8 ) * ( 1.0f / 16777216.0f );
+	}
+
+private:
+	// splitmix64
+	static std::uint64_t mix( std::uint64_t z )
+	{
+		z += 0x9E3779B97F4A7C15ull;
+		z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+		z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBull;
+		return z ^ ( z >> 31 );
+	}
+
+private:
+	std::uint64_t key_;
+	std::uint64_t counter_ = 0;
+};
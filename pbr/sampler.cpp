@@ -0,0 +1,395 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "rng.h"
+
+namespace {
+	const int SOBOL_DIMENSIONS = 4;
+	// У каждого отскока два блока по 4 измерения: BSDF, точка на источнике, выбор источника, рулетка
+	const int GROUPS_PER_BOUNCE = 2;
+	const int BLUE_NOISE_SIZE = 64;
+
+	float toFloat( std::uint32_t x )
+	{
+		return float( x >> 8 ) * ( 1.0f / 16777216.0f );
+	}
+
+	std::uint32_t hash( std::uint32_t x )
+	{
+		x ^= x >> 16;
+		x *= 0x7FEB352Du;
+		x ^= x >> 15;
+		x *= 0x846CA68Bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+	std::uint32_t hashCombine( std::uint32_t seed, std::uint32_t v )
+	{
+		return seed ^ ( hash( v ) + ( seed << 6 ) + ( seed >> 2 ) );
+	}
+
+	std::uint32_t reverseBits( std::uint32_t x )
+	{
+		x = ( x << 16 ) | ( x >> 16 );
+		x = ( ( x & 0x00FF00FFu ) << 8 ) | ( ( x & 0xFF00FF00u ) >> 8 );
+		x = ( ( x & 0x0F0F0F0Fu ) << 4 ) | ( ( x & 0xF0F0F0F0u ) >> 4 );
+		x = ( ( x & 0x33333333u ) << 2 ) | ( ( x & 0xCCCCCCCCu ) >> 2 );
+		x = ( ( x & 0x55555555u ) << 1 ) | ( ( x & 0xAAAAAAAAu ) >> 1 );
+		return x;
+	}
+
+	// Перемешивание Оуэна через хеш (Burley, "Practical Hash-based Owen Scrambling", 2020)
+	std::uint32_t laineKarrasPermutation( std::uint32_t x, std::uint32_t seed )
+	{
+		x += seed;
+		x ^= x * 0x6C50B47Cu;
+		x ^= x * 0xB82F1E52u;
+		x ^= x * 0xC7AFE638u;
+		x ^= x * 0x8D22F6E6u;
+		return x;
+	}
+
+	std::uint32_t nestedUniformScramble( std::uint32_t x, std::uint32_t seed )
+	{
+		return reverseBits( laineKarrasPermutation( reverseBits( x ), seed ) );
+	}
+
+	// Направляющие числа первых 4 измерений (Joe, Kuo). Перемешанный индекс занимает все 32 бита,
+	// поэтому точка собирается по байтам индекса из таблиц XOR-комбинаций: 4 чтения вместо 32 шагов.
+	struct SobolTable
+	{
+		std::uint32_t bytes[SOBOL_DIMENSIONS][4][256];
+
+		SobolTable()
+		{
+			std::uint32_t directions[SOBOL_DIMENSIONS][32];
+			for ( int i = 0; i < 32; ++i )
+				directions[0][i] = 1u << ( 31 - i );
+
+			const int s[] = { 1, 2, 3 };
+			const int a[] = { 0, 1, 1 };
+			const std::uint32_t m[][3] = { { 1 }, { 1, 3 }, { 1, 3, 1 } };
+			for ( int d = 1; d < SOBOL_DIMENSIONS; ++d )
+			{
+				std::uint32_t* v = directions[d];
+				const int deg = s[d - 1];
+				for ( int i = 0; i < deg; ++i )
+					v[i] = m[d - 1][i] << ( 31 - i );
+				for ( int i = deg; i < 32; ++i )
+				{
+					v[i] = v[i - deg] ^ ( v[i - deg] >> deg );
+					for ( int k = 1; k < deg; ++k )
+						v[i] ^= ( ( a[d - 1] >> ( deg - 1 - k ) ) & 1 ) * v[i - k];
+				}
+			}
+
+			for ( int d = 0; d < SOBOL_DIMENSIONS; ++d )
+			{
+				for ( int b = 0; b < 4; ++b )
+				{
+					for ( int value = 0; value < 256; ++value )
+					{
+						std::uint32_t x = 0;
+						for ( int bit = 0; bit < 8; ++bit )
+						{
+							if ( value & ( 1 << bit ) )
+								x ^= directions[d][b * 8 + bit];
+						}
+						bytes[d][b][value] = x;
+					}
+				}
+			}
+		}
+	};
+
+	const SobolTable& sobolTable()
+	{
+		static const SobolTable table;
+		return table;
+	}
+
+	std::uint32_t sobol( const SobolTable& table, std::uint32_t index, int dim )
+	{
+		return table.bytes[dim][0][index & 0xFF] ^ table.bytes[dim][1][( index >> 8 ) & 0xFF] ^
+			table.bytes[dim][2][( index >> 16 ) & 0xFF] ^ table.bytes[dim][3][index >> 24];
+	}
+
+	// Маска синего шума void-and-cluster (Ulichney 1993), значения - ранги в (0, 1).
+	// Строится один раз, около 0.1 с.
+	std::vector<float> buildBlueNoise( int size )
+	{
+		const int n = size * size;
+		const float sigma = 1.5f;
+
+		// Гауссово ядро с заворачиванием по краям
+		std::vector<float> kernel( n );
+		for ( int y = 0; y < size; ++y )
+		{
+			for ( int x = 0; x < size; ++x )
+			{
+				const int dx = std::min( x, size - x );
+				const int dy = std::min( y, size - y );
+				kernel[y * size + x] = std::exp( -float( dx * dx + dy * dy ) / ( 2.0f * sigma * sigma ) );
+			}
+		}
+
+		std::vector<char> pattern( n, 0 );
+		std::vector<float> energy( n, 0.0f );
+		auto splat = [&]( std::vector<float>& e, int index, float sign ) {
+			const int px = index % size;
+			const int py = index / size;
+			for ( int y = 0; y < size; ++y )
+			{
+				const int ky = ( ( y - py + size ) % size ) * size;
+				for ( int x = 0; x < size; ++x )
+					e[y * size + x] += sign * kernel[ky + ( x - px + size ) % size];
+			}
+		};
+		// Самый плотный кластер среди единиц или самая большая пустота среди нулей
+		auto extreme = [&]( const std::vector<char>& p, const std::vector<float>& e, char value ) {
+			int best = -1;
+			for ( int i = 0; i < n; ++i )
+			{
+				if ( p[i] != value )
+					continue;
+				if ( best < 0 || ( value ? e[i] > e[best] : e[i] < e[best] ) )
+					best = i;
+			}
+			return best;
+		};
+
+		// Начальный набор: 10% случайных точек, затем переносим точки из кластеров в пустоты
+		Rng rng( 0, 0 );
+		const int ones = n / 10;
+		for ( int placed = 0; placed < ones; )
+		{
+			const int i = int( rng.nextUint() % std::uint32_t( n ) );
+			if ( pattern[i] )
+				continue;
+			pattern[i] = 1;
+			splat( energy, i, 1.0f );
+			++placed;
+		}
+		for ( int iteration = 0; iteration < n; ++iteration )
+		{
+			const int cluster = extreme( pattern, energy, 1 );
+			pattern[cluster] = 0;
+			splat( energy, cluster, -1.0f );
+			const int voidIndex = extreme( pattern, energy, 0 );
+			pattern[voidIndex] = 1;
+			splat( energy, voidIndex, 1.0f );
+			if ( voidIndex == cluster )
+				break;
+		}
+
+		std::vector<int> rank( n );
+		{
+			std::vector<char> p = pattern;
+			std::vector<float> e = energy;
+			for ( int r = ones - 1; r >= 0; --r )
+			{
+				const int i = extreme( p, e, 1 );
+				p[i] = 0;
+				splat( e, i, -1.0f );
+				rank[i] = r;
+			}
+		}
+		for ( int r = ones; r < n; ++r )
+		{
+			const int i = extreme( pattern, energy, 0 );
+			pattern[i] = 1;
+			splat( energy, i, 1.0f );
+			rank[i] = r;
+		}
+
+		std::vector<float> mask( n );
+		for ( int i = 0; i < n; ++i )
+			mask[i] = ( rank[i] + 0.5f ) / n;
+		return mask;
+	}
+
+	const std::vector<float>& blueNoiseMask()
+	{
+		static const std::vector<float> mask = buildBlueNoise( BLUE_NOISE_SIZE );
+		return mask;
+	}
+
+	class RandomSampler : public Sampler
+	{
+	public:
+		RandomSampler( int width, int sideCount, std::uint32_t seed )
+			: width_( width ), sideCount_( sideCount ), seed_( seed )
+		{
+		}
+
+		void startPixelSample( std::uint32_t x, std::uint32_t y, std::uint32_t index ) override
+		{
+			rng_ = Rng( y * width_ + x, index, seed_ );
+			index_ = index;
+		}
+
+		// Сетка sideCount x sideCount со случайным сдвигом в ячейке, повторяется каждые sideCount^2 сэмплов
+		void getPixel2D( float& u, float& v ) override
+		{
+			const float cell = 1.0f / sideCount_;
+			u = ( float( index_ % sideCount_ ) + rng_.nextFloat() ) * cell;
+			v = ( float( index_ / sideCount_ % sideCount_ ) + rng_.nextFloat() ) * cell;
+		}
+
+		// Диапазон 0 занят сдвигом сэмпла в пикселе
+		void startBounce( int bounce ) override { rng_.setBounce( bounce + 1 ); }
+
+		float get1D() override { return rng_.nextFloat(); }
+
+	private:
+		std::uint32_t width_;
+		std::uint32_t sideCount_;
+		std::uint32_t seed_;
+		Rng rng_{ 0, 0 };
+		std::uint32_t index_ = 0;
+	};
+
+	// Измерения раздаются блоками по 4: каждый блок - отдельная 4-мерная последовательность
+	// со своим перемешанным индексом, поэтому блоки не коррелируют между собой.
+	class SobolSampler : public Sampler
+	{
+	public:
+		SobolSampler( int width, std::uint32_t seed )
+			: width_( width ), runSeed_( hash( seed ) ), table_( sobolTable() )
+		{
+		}
+
+		void startPixelSample( std::uint32_t x, std::uint32_t y, std::uint32_t index ) override
+		{
+			seed_ = hashCombine( runSeed_, y * width_ + x + 1 );
+			index_ = index;
+		}
+
+		void getPixel2D( float& u, float& v ) override
+		{
+			group_ = 0;
+			next_ = SOBOL_DIMENSIONS;
+			u = get1D();
+			v = get1D();
+		}
+
+		void startBounce( int bounce ) override
+		{
+			group_ = 1 + bounce * GROUPS_PER_BOUNCE;
+			next_ = SOBOL_DIMENSIONS;
+		}
+
+		float get1D() override
+		{
+			if ( next_ == SOBOL_DIMENSIONS )
+			{
+				fill( group_++ );
+				next_ = 0;
+			}
+			return toFloat( values_[next_++] );
+		}
+
+	protected:
+		void fill( std::uint32_t group )
+		{
+			const std::uint32_t seed = hashCombine( seed_, group );
+			const std::uint32_t index = nestedUniformScramble( index_, seed );
+			for ( int d = 0; d < SOBOL_DIMENSIONS; ++d )
+				values_[d] = nestedUniformScramble( sobol( table_, index, d ), hashCombine( seed, d ) );
+			dimension_ = group * SOBOL_DIMENSIONS;
+		}
+
+	protected:
+		std::uint32_t width_;
+		std::uint32_t runSeed_;
+		const SobolTable& table_;
+		std::uint32_t seed_ = 0;
+		std::uint32_t index_ = 0;
+		std::uint32_t group_ = 0;
+		std::uint32_t dimension_ = 0; // номер первого измерения в values_
+		int next_ = SOBOL_DIMENSIONS;
+		std::uint32_t values_[SOBOL_DIMENSIONS] = {};
+	};
+
+	// Одна и та же последовательность во всех пикселях, сдвинутая по модулю 1 на значение
+	// маски синего шума (для каждого измерения маска смещена по-своему). Ошибка соседних
+	// пикселей получается высокочастотной и на малом числе сэмплов выглядит мельче.
+	class BlueNoiseSampler : public SobolSampler
+	{
+	public:
+		BlueNoiseSampler( int width, std::uint32_t seed )
+			: SobolSampler( width, seed ), mask_( blueNoiseMask() )
+		{
+		}
+
+		void startPixelSample( std::uint32_t x, std::uint32_t y, std::uint32_t index ) override
+		{
+			SobolSampler::startPixelSample( x, y, index );
+			seed_ = runSeed_;
+			x_ = x;
+			y_ = y;
+		}
+
+		float get1D() override
+		{
+			if ( next_ == SOBOL_DIMENSIONS )
+			{
+				fill( group_++ );
+				next_ = 0;
+			}
+			const std::uint32_t shift = hash( dimension_ + next_ );
+			const std::uint32_t mx = ( x_ + shift ) % BLUE_NOISE_SIZE;
+			const std::uint32_t my = ( y_ + ( shift >> 16 ) ) % BLUE_NOISE_SIZE;
+			const float value = toFloat( values_[next_++] ) + mask_[my * BLUE_NOISE_SIZE + mx];
+			return value < 1.0f ? value : value - 1.0f;
+		}
+
+	private:
+		const std::vector<float>& mask_;
+		std::uint32_t x_ = 0;
+		std::uint32_t y_ = 0;
+	};
+}
+
+bool parseSamplerType( const std::string& name, SamplerType& type )
+{
+	if ( name == "random" )
+		type = SamplerType::Random;
+	else if ( name == "sobol" )
+		type = SamplerType::Sobol;
+	else if ( name == "bluenoise" )
+		type = SamplerType::BlueNoise;
+	else
+		return false;
+	return true;
+}
+
+const char* samplerName( SamplerType type )
+{
+	switch ( type )
+	{
+	case SamplerType::Sobol:
+		return "sobol";
+	case SamplerType::BlueNoise:
+		return "bluenoise";
+	default:
+		return "random";
+	}
+}
+
+std::unique_ptr<Sampler> createSampler( SamplerType type, int width, int sideCount, std::uint32_t seed )
+{
+	switch ( type )
+	{
+	case SamplerType::Sobol:
+		return std::make_unique<SobolSampler>( width, seed );
+	case SamplerType::BlueNoise:
+		return std::make_unique<BlueNoiseSampler>( width, seed );
+	default:
+		return std::make_unique<RandomSampler>( width, sideCount, seed );
+	}
+}
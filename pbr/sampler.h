@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+enum class SamplerType
+{
+	Random,    // независимые числа из Rng, стратифицированный сдвиг в пикселе
+	Sobol,     // Sobol с перемешиванием Оуэна, свой скрэмблинг в каждом пикселе
+	BlueNoise, // одна последовательность Sobol на кадр, сдвинутая по маске синего шума
+};
+
+bool parseSamplerType( const std::string& name, SamplerType& type );
+const char* samplerName( SamplerType type );
+
+// Числа для одного пути. Измерения раздаются по порядку вызовов: сначала сдвиг в пикселе,
+// затем на каждом отскоке свой набор измерений. Интегратор должен запрашивать их
+// в одном и том же порядке, иначе измерения разных сэмплеров не будут соответствовать друг другу.
+class Sampler
+{
+public:
+	virtual ~Sampler() = default;
+
+	// Начинает сэмпл index пикселя (x, y)
+	virtual void startPixelSample( std::uint32_t x, std::uint32_t y, std::uint32_t index ) = 0;
+	// Сдвиг внутри пикселя, [0, 1)^2
+	virtual void getPixel2D( float& u, float& v ) = 0;
+	// Переходит к измерениям отскока bounce
+	virtual void startBounce( int bounce ) = 0;
+	// Следующее измерение текущего отскока, [0, 1)
+	virtual float get1D() = 0;
+
+	void get2D( float& u, float& v )
+	{
+		u = get1D();
+		v = get1D();
+	}
+};
+
+// width - ширина кадра, sideCount - сторона сетки сэмплов в пикселе, seed - номер независимого прогона.
+// Сэмплер хранит состояние одного пути, поэтому у каждого потока свой.
+std::unique_ptr<Sampler> createSampler( SamplerType type, int width, int sideCount, std::uint32_t seed = 0 );
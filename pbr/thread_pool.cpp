@@ -0,0 +1,119 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool( unsigned threadCount )
+{
+	if ( threadCount == 0 )
+		threadCount = std::max( 1u, std::thread::hardware_concurrency() );
+
+	for ( unsigned i = 0; i < threadCount; ++i )
+		queues_.push_back( std::make_unique<Queue>() );
+
+	// Поток 0 - вызывающий parallelFor
+	for ( unsigned i = 1; i < threadCount; ++i )
+		workers_.emplace_back( &ThreadPool::workerLoop, this, i );
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for ( auto& w : workers_ )
+		w.join();
+}
+
+void ThreadPool::parallelFor( size_t count, const std::function<void( size_t )>& task )
+{
+	if ( count == 0 )
+		return;
+
+	// Задача и счетчик - до первого номера в очереди: поток, который еще крутит runOne после
+	// прошлого вызова, может украсть номер сразу. Номер берется под мьютексом очереди, а кладется
+	// после этой записи, поэтому вор видит уже новые task_ и pending_.
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		task_ = &task;
+		pending_ = count;
+		generation_++;
+	}
+
+	// Раздаем задачи непрерывными кусками, чтобы соседние тайлы попадали в один поток
+	const size_t threads = queues_.size();
+	for ( size_t q = 0; q < threads; ++q )
+	{
+		std::lock_guard<std::mutex> lock( queues_[q]->mutex );
+		const size_t begin = count * q / threads;
+		const size_t end = count * ( q + 1 ) / threads;
+		for ( size_t i = begin; i < end; ++i )
+			queues_[q]->items.push_back( i );
+	}
+	wake_.notify_all();
+
+	while ( runOne( 0 ) )
+	{
+	}
+
+	// pending_ == 0 - все номера выполнены и очереди пусты, сбрасывать task_ безопасно
+	std::unique_lock<std::mutex> lock( mutex_ );
+	done_.wait( lock, [this] { return pending_ == 0; } );
+	task_ = nullptr;
+}
+
+bool ThreadPool::runOne( unsigned index )
+{
+	size_t item = 0;
+	bool found = false;
+
+	// Свою очередь берем с начала, у чужих воруем с конца
+	for ( size_t k = 0; k < queues_.size() && !found; ++k )
+	{
+		Queue& q = *queues_[( index + k ) % queues_.size()];
+		std::lock_guard<std::mutex> lock( q.mutex );
+		if ( q.items.empty() )
+			continue;
+		if ( k == 0 )
+		{
+			item = q.items.front();
+			q.items.pop_front();
+		}
+		else
+		{
+			item = q.items.back();
+			q.items.pop_back();
+		}
+		found = true;
+	}
+	if ( !found )
+		return false;
+
+	( *task_ )( item );
+	if ( --pending_ == 0 )
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		done_.notify_all();
+	}
+	return true;
+}
+
+void ThreadPool::workerLoop( unsigned index )
+{
+	unsigned seen = 0;
+	while ( true )
+	{
+		{
+			std::unique_lock<std::mutex> lock( mutex_ );
+			wake_.wait( lock, [&] { return stop_ || generation_ != seen; } );
+			if ( stop_ )
+				return;
+			seen = generation_;
+		}
+
+		while ( runOne( index ) )
+		{
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с work-stealing: у каждого потока своя очередь, свободный поток
+// забирает задачи с другого конца чужих очередей.
+class ThreadPool
+{
+public:
+	// 0 - по числу аппаратных потоков
+	explicit ThreadPool( unsigned threadCount = 0 );
+	~ThreadPool();
+
+	ThreadPool( const ThreadPool& ) = delete;
+	ThreadPool& operator=( const ThreadPool& ) = delete;
+
+	unsigned size() const { return (unsigned)queues_.size(); }
+
+	// Вызывает task( i ) для i в [0, count) и ждет завершения. Вызывающий поток тоже работает.
+	void parallelFor( size_t count, const std::function<void( size_t )>& task );
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<size_t> items;
+	};
+
+	void workerLoop( unsigned index );
+	bool runOne( unsigned index );
+
+private:
+	std::vector<std::unique_ptr<Queue>> queues_;
+	std::vector<std::thread> workers_;
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable done_;
+	const std::function<void( size_t )>* task_ = nullptr;
+	std::atomic<size_t> pending_{ 0 };
+	unsigned generation_ = 0;
+	bool stop_ = false;
+};
@@ -0,0 +1,240 @@
+#include "wavefront.h"
+
+#include <algorithm>
+
+#include "bsdf.h"
+#include "packet.h"
+
+namespace {
+	// Виды попаданий, по которым раскладывается поток перед шейдингом
+	enum HitKind { MISS, DIFFUSE, MIRROR, KIND_COUNT };
+}
+
+void WavefrontIntegrator::RayQueue::clear()
+{
+	ox.clear();
+	oy.clear();
+	oz.clear();
+	dx.clear();
+	dy.clear();
+	dz.clear();
+	path.clear();
+}
+
+void WavefrontIntegrator::RayQueue::push( const Ray& ray, std::uint32_t pathIndex )
+{
+	ox.push_back( ray.origin.x() );
+	oy.push_back( ray.origin.y() );
+	oz.push_back( ray.origin.z() );
+	dx.push_back( ray.direction.x() );
+	dy.push_back( ray.direction.y() );
+	dz.push_back( ray.direction.z() );
+	path.push_back( pathIndex );
+}
+
+Ray WavefrontIntegrator::RayQueue::ray( size_t i ) const
+{
+	return Ray{ Vector3( ox[i], oy[i], oz[i] ), Vector3( dx[i], dy[i], dz[i] ) };
+}
+
+WavefrontIntegrator::WavefrontIntegrator( const Scene& scene, const BVH& bvh, const LightSampler& lights, const IntegratorSettings& settings, bool packets )
+	: scene_( scene ), bvh_( bvh ), lights_( lights ), settings_( settings ), packets_( packets )
+{
+}
+
+void WavefrontIntegrator::render( const CameraSample* samples, size_t count, Sampler& sampler, PathStats& stats, Vector3* radiance, PathAov* aovs )
+{
+	samples_ = samples;
+	paths_.resize( count );
+	rays_.clear();
+	for ( size_t i = 0; i < count; ++i )
+	{
+		paths_[i] = PathState{ samples[i].ray, Vector3( 1, 1, 1 ), Vector3( 0, 0, 0 ), 0, 0.0f, aovs ? &aovs[i] : nullptr };
+		rays_.push( samples[i].ray, std::uint32_t( i ) );
+	}
+	coherentBegin_ = 0;
+	coherentEnd_ = packets_ ? count : 0;
+
+	// Все пути потока на одном отскоке
+	for ( int depth = 0; rays_.size() > 0; ++depth )
+	{
+		intersectRays();
+		sortByMaterial();
+
+		next_.clear();
+		shadows_.clear();
+		shadowT_.clear();
+		contributions_.clear();
+		shadeMisses( 0, kindEnd_[MISS], stats );
+		shadeDiffuse( kindEnd_[MISS], kindEnd_[DIFFUSE], sampler, stats );
+		const size_t mirrorsBegin = next_.size();
+		shadeMirrors( kindEnd_[DIFFUSE], kindEnd_[MIRROR], sampler, stats );
+		traceShadows();
+
+		// Отражения лучей камеры от зеркал еще почти параллельны, дальше пакеты не окупаются
+		coherentBegin_ = mirrorsBegin;
+		coherentEnd_ = packets_ && depth == 0 ? next_.size() : mirrorsBegin;
+		std::swap( rays_, next_ );
+	}
+
+	for ( size_t i = 0; i < count; ++i )
+		radiance[i] = paths_[i].radiance;
+}
+
+void WavefrontIntegrator::intersectRays()
+{
+	hits_.resize( rays_.size() );
+	size_t i = 0;
+	while ( i < rays_.size() )
+	{
+		if ( i >= coherentBegin_ && i + PACKET_SIZE <= coherentEnd_ )
+		{
+			Ray packet[PACKET_SIZE];
+			for ( int k = 0; k < PACKET_SIZE; ++k )
+				packet[k] = rays_.ray( i + k );
+			intersectScene( packet, scene_, bvh_, &hits_[i] );
+			i += PACKET_SIZE;
+		}
+		else
+		{
+			hits_[i] = intersectScene( rays_.ray( i ), scene_, bvh_ );
+			++i;
+		}
+	}
+}
+
+void WavefrontIntegrator::sortByMaterial()
+{
+	// Сортировка подсчетом, внутри вида лучи остаются в исходном порядке
+	const size_t count = rays_.size();
+	size_t begin[KIND_COUNT] = {};
+	kinds_.resize( count );
+	normals_.resize( count );
+	for ( size_t i = 0; i < count; ++i )
+	{
+		const SceneHit& hit = hits_[i];
+		HitKind kind = MISS;
+		if ( hit.t != RAY_T_MAX )
+		{
+			const Vector3 direction( rays_.dx[i], rays_.dy[i], rays_.dz[i] );
+			normals_[i] = dot( hit.normal, direction ) > 0.0 ? -hit.normal : hit.normal;
+			kind = isSpecular( scene_.material( hit.matIndex ) ) ? MIRROR : DIFFUSE;
+		}
+		kinds_[i] = std::uint8_t( kind );
+		if ( kind + 1 < KIND_COUNT )
+			begin[kind + 1]++;
+	}
+	for ( int k = 1; k < KIND_COUNT; ++k )
+		begin[k] += begin[k - 1];
+	for ( int k = 0; k < KIND_COUNT; ++k )
+		kindEnd_[k] = k + 1 < KIND_COUNT ? begin[k + 1] : count;
+
+	order_.resize( count );
+	for ( size_t i = 0; i < count; ++i )
+		order_[begin[kinds_[i]]++] = std::uint32_t( i );
+}
+
+void WavefrontIntegrator::startBounce( Sampler& sampler, std::uint32_t pathIndex ) const
+{
+	const CameraSample& s = samples_[pathIndex];
+	sampler.startPixelSample( s.x, s.y, s.index );
+	sampler.startBounce( paths_[pathIndex].depth );
+}
+
+void WavefrontIntegrator::pushNext( std::uint32_t pathIndex )
+{
+	next_.push( paths_[pathIndex].ray, pathIndex );
+}
+
+void WavefrontIntegrator::shadeMisses( size_t begin, size_t end, PathStats& stats )
+{
+	for ( size_t k = begin; k < end; ++k )
+		shadeMiss( paths_[rays_.path[order_[k]]], scene_, stats );
+}
+
+void WavefrontIntegrator::shadeDiffuse( size_t begin, size_t end, Sampler& sampler, PathStats& stats )
+{
+	for ( size_t k = begin; k < end; ++k )
+	{
+		const std::uint32_t r = order_[k];
+		const std::uint32_t p = rays_.path[r];
+		PathState& path = paths_[p];
+		const SceneHit& hit = hits_[r];
+		const Vector3& normal = normals_[r];
+		startBounce( sampler, p );
+		const Material m = scene_.material( hit.matIndex );
+		if ( !shadeEmission( path, hit, m, normal, lights_, settings_, stats ) )
+			continue;
+
+		float u1, u2;
+		sampler.get2D( u1, u2 );
+		const BsdfSample bs = sampleBsdf( m, normal, path.ray.direction, u1, u2 );
+		const Vector3 hitPoint = path.ray.origin + path.ray.direction * hit.t;
+
+		// Видимость источника проверяется потом, всеми теневыми лучами сразу
+		Ray shadow;
+		float shadowT;
+		Vector3 contribution;
+		if ( !lights_.empty() && sampleLight( path, lights_, m, hitPoint, normal, sampler, shadow, shadowT, contribution ) )
+		{
+			shadows_.push( shadow, p );
+			shadowT_.push_back( shadowT );
+			contributions_.push_back( contribution );
+		}
+
+		if ( continuePath( path, bs, hitPoint, normal, settings_, sampler, stats ) )
+			pushNext( p );
+	}
+}
+
+void WavefrontIntegrator::shadeMirrors( size_t begin, size_t end, Sampler& sampler, PathStats& stats )
+{
+	for ( size_t k = begin; k < end; ++k )
+	{
+		const std::uint32_t r = order_[k];
+		const std::uint32_t p = rays_.path[r];
+		PathState& path = paths_[p];
+		const SceneHit& hit = hits_[r];
+		const Vector3& normal = normals_[r];
+		startBounce( sampler, p );
+		const Material m = scene_.material( hit.matIndex );
+		if ( !shadeEmission( path, hit, m, normal, lights_, settings_, stats ) )
+			continue;
+
+		// Зеркалу числа не нужны, но измерения тратятся так же, как в trace
+		float u1, u2;
+		sampler.get2D( u1, u2 );
+		const BsdfSample bs = sampleBsdf( m, normal, path.ray.direction, u1, u2 );
+		const Vector3 hitPoint = path.ray.origin + path.ray.direction * hit.t;
+		if ( continuePath( path, bs, hitPoint, normal, settings_, sampler, stats ) )
+			pushNext( p );
+	}
+}
+
+void WavefrontIntegrator::traceShadows()
+{
+	// Теневые лучи соседних путей сходятся к тем же источникам, пакеты окупаются на любом отскоке
+	size_t i = 0;
+	while ( i < shadows_.size() )
+	{
+		if ( packets_ && i + PACKET_SIZE <= shadows_.size() )
+		{
+			Ray packet[PACKET_SIZE];
+			for ( int k = 0; k < PACKET_SIZE; ++k )
+				packet[k] = shadows_.ray( i + k );
+			const unsigned mask = occluded( packet, scene_, bvh_, RAY_T_MIN, &shadowT_[i] );
+			for ( int k = 0; k < PACKET_SIZE; ++k )
+			{
+				if ( !( mask & ( 1u << k ) ) )
+					paths_[shadows_.path[i + k]].radiance += contributions_[i + k];
+			}
+			i += PACKET_SIZE;
+		}
+		else
+		{
+			if ( !occluded( shadows_.ray( i ), scene_, bvh_, RAY_T_MIN, shadowT_[i] ) )
+				paths_[shadows_.path[i]].radiance += contributions_[i];
+			++i;
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "integrator.h"
+
+// Волновой интегратор: пачка путей идет отскок за отскоком вся сразу. На каждом отскоке
+// весь поток лучей пересекается со сценой, попадания раскладываются по типу материала и каждый
+// тип оттеняется своим циклом, затем все теневые лучи NEE проверяются одним проходом.
+// Каждый этап - короткий цикл над буферами, код и данные одного этапа остаются в кеше.
+// Пути те же, что у trace: сэмплер перезапускается по пикселю, номеру сэмпла и отскоку.
+// Буферы переиспользуются между вызовами render, поэтому объект - на поток.
+class WavefrontIntegrator
+{
+public:
+	// packets - лучи камеры, отражения от зеркал на первом отскоке и теневые лучи проверяются пакетами
+	WavefrontIntegrator( const Scene& scene, const BVH& bvh, const LightSampler& lights, const IntegratorSettings& settings, bool packets );
+
+	// radiance[i] и, если aovs задан, aovs[i] - для samples[i]
+	void render( const CameraSample* samples, size_t count, Sampler& sampler, PathStats& stats, Vector3* radiance, PathAov* aovs );
+
+private:
+	// Лучи по компонентам (SoA) и номера путей, которым они принадлежат
+	struct RayQueue
+	{
+		std::vector<float> ox, oy, oz;
+		std::vector<float> dx, dy, dz;
+		std::vector<std::uint32_t> path;
+
+		size_t size() const { return path.size(); }
+		void clear();
+		void push( const Ray& ray, std::uint32_t pathIndex );
+		Ray ray( size_t i ) const;
+	};
+
+	void intersectRays();
+	void sortByMaterial();
+	void shadeMisses( size_t begin, size_t end, PathStats& stats );
+	void shadeDiffuse( size_t begin, size_t end, Sampler& sampler, PathStats& stats );
+	void shadeMirrors( size_t begin, size_t end, Sampler& sampler, PathStats& stats );
+	void traceShadows();
+
+	// Начинает измерения отскока пути заново
+	void startBounce( Sampler& sampler, std::uint32_t pathIndex ) const;
+	void pushNext( std::uint32_t pathIndex );
+
+private:
+	const Scene& scene_;
+	const BVH& bvh_;
+	const LightSampler& lights_;
+	IntegratorSettings settings_;
+	bool packets_;
+
+	const CameraSample* samples_ = nullptr;
+	std::vector<PathState> paths_;
+	RayQueue rays_; // лучи текущего отскока
+	RayQueue next_; // продолжения путей для следующего отскока
+	// Диапазон rays_, который пересекается пакетами: лучи камеры или отражения от зеркал
+	size_t coherentBegin_ = 0;
+	size_t coherentEnd_ = 0;
+	std::vector<SceneHit> hits_;        // по номеру луча в rays_
+	std::vector<std::uint8_t> kinds_;   // вид попадания по номеру луча
+	std::vector<std::uint32_t> order_;  // номера лучей rays_: промахи, затем по типам материалов
+	size_t kindEnd_[3] = {};            // конец промахов, диффузных и зеркальных попаданий в order_
+	std::vector<Vector3> normals_;      // развернутые навстречу лучу нормали, по номеру луча
+
+	RayQueue shadows_;
+	std::vector<float> shadowT_;
+	std::vector<Vector3> contributions_;
+};
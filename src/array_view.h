@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Невладеющий вид на непрерывный массив: данные лежат либо в std::vector,
+// либо прямо в отображенном в память файле
+template<typename T>
+class ArrayView
+{
+public:
+	ArrayView() = default;
+	ArrayView( const T* data, size_t size ) : data_( data ), size_( size ) {}
+	ArrayView( const std::vector<T>& v ) : data_( v.data() ), size_( v.size() ) {}
+
+	const T* data() const { return data_; }
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	const T* begin() const { return data_; }
+	const T* end() const { return data_ + size_; }
+
+	const T& operator[]( size_t i ) const { return data_[i]; }
+
+private:
+	const T* data_ = nullptr;
+	size_t size_ = 0;
+};
@@ -0,0 +1,114 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open( const char* path )
+{
+	close();
+
+	HANDLE file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return false;
+	file_ = file;
+
+	LARGE_INTEGER size;
+	if ( !GetFileSizeEx( file, &size ) )
+	{
+		close();
+		return false;
+	}
+	size_ = (size_t)size.QuadPart;
+	if ( size_ == 0 )
+		return true;
+
+	HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+	if ( mapping == nullptr )
+	{
+		close();
+		return false;
+	}
+	mapping_ = mapping;
+
+	data_ = static_cast<const char*>( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+	if ( data_ == nullptr )
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if ( data_ )
+		UnmapViewOfFile( data_ );
+	if ( mapping_ )
+		CloseHandle( mapping_ );
+	if ( file_ )
+		CloseHandle( file_ );
+	data_ = nullptr;
+	mapping_ = nullptr;
+	file_ = nullptr;
+	size_ = 0;
+}
+
+#else
+
+bool MappedFile::open( const char* path )
+{
+	close();
+
+	const int fd = ::open( path, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 )
+	{
+		::close( fd );
+		return false;
+	}
+	size_ = (size_t)st.st_size;
+	if ( size_ == 0 )
+	{
+		::close( fd );
+		return true;
+	}
+
+	// Отображение остается валидным после закрытия дескриптора
+	void* p = mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+	::close( fd );
+	if ( p == MAP_FAILED )
+	{
+		size_ = 0;
+		return false;
+	}
+	madvise( p, size_, MADV_SEQUENTIAL );
+	data_ = static_cast<const char*>( p );
+	return true;
+}
+
+void MappedFile::close()
+{
+	if ( data_ )
+		munmap( const_cast<char*>( data_ ), size_ );
+	data_ = nullptr;
+	size_ = 0;
+}
+
+#endif
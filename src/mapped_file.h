@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+
+// Файл, отображенный в память только для чтения
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+
+	MappedFile( const MappedFile& ) = delete;
+	MappedFile& operator=( const MappedFile& ) = delete;
+
+	bool open( const char* path );
+	void close();
+
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	const char* data_ = nullptr;
+	size_t size_ = 0;
+#ifdef _WIN32
+	void* file_ = nullptr;
+	void* mapping_ = nullptr;
+#endif
+};
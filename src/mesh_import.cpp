@@ -0,0 +1,376 @@
+#include "mesh_import.h"
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+
+namespace {
+	bool isSpace( char c ) { return c == ' ' || c == '\t' || c == '\r'; }
+
+	bool hasExtension( const std::string& name, const char* ext )
+	{
+		const size_t n = std::strlen( ext );
+		if ( name.size() < n )
+			return false;
+		for ( size_t i = 0; i < n; ++i )
+		{
+			char c = name[name.size() - n + i];
+			if ( c >= 'A' && c <= 'Z' )
+				c = char( c - 'A' + 'a' );
+			if ( c != ext[i] )
+				return false;
+		}
+		return true;
+	}
+
+	bool fail( const char* name, int line, const char* message )
+	{
+		std::cerr << name << ":" << line << ": error: " << message << std::endl;
+		return false;
+	}
+
+	const char* skipSpaces( const char* p, const char* end )
+	{
+		while ( p < end && isSpace( *p ) )
+			++p;
+		return p;
+	}
+
+	void addPolygon( const std::vector<std::uint32_t>& polygon, std::vector<std::uint32_t>& indices )
+	{
+		for ( size_t i = 2; i < polygon.size(); ++i )
+		{
+			indices.push_back( polygon[0] );
+			indices.push_back( polygon[i - 1] );
+			indices.push_back( polygon[i] );
+		}
+	}
+
+	bool loadObj( const char* name, const MappedFile& file, std::vector<Vector3>& vertices, std::vector<std::uint32_t>& indices )
+	{
+		const char* cur = file.data();
+		const char* end = cur + file.size();
+		std::vector<std::uint32_t> polygon;
+		int line = 0;
+
+		while ( cur < end )
+		{
+			const char* lineEnd = static_cast<const char*>( std::memchr( cur, '\n', end - cur ) );
+			if ( !lineEnd )
+				lineEnd = end;
+			++line;
+			const char* p = skipSpaces( cur, lineEnd );
+			cur = lineEnd < end ? lineEnd + 1 : end;
+
+			if ( lineEnd - p >= 2 && p[0] == 'v' && isSpace( p[1] ) )
+			{
+				Vector3 v;
+				p += 2;
+				for ( int i = 0; i < 3; ++i )
+				{
+					p = skipSpaces( p, lineEnd );
+					const auto res = std::from_chars( p, lineEnd, v[i] );
+					if ( res.ec != std::errc() )
+						return fail( name, line, "bad vertex" );
+					p = res.ptr;
+				}
+				vertices.push_back( v );
+			}
+			else if ( lineEnd - p >= 2 && p[0] == 'f' && isSpace( p[1] ) )
+			{
+				polygon.clear();
+				p += 2;
+				while ( ( p = skipSpaces( p, lineEnd ) ) < lineEnd )
+				{
+					// v, v/vt, v//vn, v/vt/vn - нужна только позиция
+					long long index = 0;
+					const auto res = std::from_chars( p, lineEnd, index );
+					if ( res.ec != std::errc() )
+						return fail( name, line, "bad face index" );
+					p = res.ptr;
+					while ( p < lineEnd && !isSpace( *p ) )
+						++p;
+
+					// Отрицательные индексы - от конца списка вершин
+					const long long resolved = index < 0 ? (long long)vertices.size() + index : index - 1;
+					if ( index == 0 || resolved < 0 || resolved >= (long long)vertices.size() )
+						return fail( name, line, "face index out of range" );
+					polygon.push_back( (std::uint32_t)resolved );
+				}
+				if ( polygon.size() < 3 )
+					return fail( name, line, "face with less than 3 vertices" );
+				addPolygon( polygon, indices );
+			}
+		}
+		return true;
+	}
+
+	enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Unknown };
+
+	PlyType plyType( const std::string& s )
+	{
+		if ( s == "char" || s == "int8" ) return PlyType::Int8;
+		if ( s == "uchar" || s == "uint8" ) return PlyType::UInt8;
+		if ( s == "short" || s == "int16" ) return PlyType::Int16;
+		if ( s == "ushort" || s == "uint16" ) return PlyType::UInt16;
+		if ( s == "int" || s == "int32" ) return PlyType::Int32;
+		if ( s == "uint" || s == "uint32" ) return PlyType::UInt32;
+		if ( s == "float" || s == "float32" ) return PlyType::Float32;
+		if ( s == "double" || s == "float64" ) return PlyType::Float64;
+		return PlyType::Unknown;
+	}
+
+	size_t plySize( PlyType t )
+	{
+		switch ( t )
+		{
+		case PlyType::Int8: case PlyType::UInt8: return 1;
+		case PlyType::Int16: case PlyType::UInt16: return 2;
+		case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+		case PlyType::Float64: return 8;
+		default: return 0;
+		}
+	}
+
+	struct PlyProperty
+	{
+		std::string name;
+		PlyType type;
+		PlyType countType; // для списков, иначе Unknown
+	};
+
+	struct PlyElement
+	{
+		std::string name;
+		size_t count;
+		std::vector<PlyProperty> properties;
+	};
+
+	// Чтение значений PLY из ascii или бинарного потока
+	class PlyReader
+	{
+	public:
+		PlyReader( const char* p, const char* end, int format ) : p_( p ), end_( end ), format_( format ) {}
+
+		// Каждое значение занимает хотя бы байт: больше элементов в остатке файла не поместится
+		size_t remaining() const { return size_t( end_ - p_ ); }
+
+		bool read( PlyType type, double& value )
+		{
+			if ( format_ == 0 )
+			{
+				while ( p_ < end_ && ( isSpace( *p_ ) || *p_ == '\n' ) )
+					++p_;
+				const auto res = std::from_chars( p_, end_, value );
+				if ( res.ec != std::errc() )
+					return false;
+				p_ = res.ptr;
+				return true;
+			}
+
+			const size_t size = plySize( type );
+			if ( size == 0 || size_t( end_ - p_ ) < size )
+				return false;
+			unsigned char bytes[8];
+			std::memcpy( bytes, p_, size );
+			p_ += size;
+			if ( format_ == 2 )
+			{
+				for ( size_t i = 0; i < size / 2; ++i )
+					std::swap( bytes[i], bytes[size - 1 - i] );
+			}
+
+			switch ( type )
+			{
+			case PlyType::Int8: { std::int8_t v; std::memcpy( &v, bytes, 1 ); value = v; break; }
+			case PlyType::UInt8: { value = bytes[0]; break; }
+			case PlyType::Int16: { std::int16_t v; std::memcpy( &v, bytes, 2 ); value = v; break; }
+			case PlyType::UInt16: { std::uint16_t v; std::memcpy( &v, bytes, 2 ); value = v; break; }
+			case PlyType::Int32: { std::int32_t v; std::memcpy( &v, bytes, 4 ); value = v; break; }
+			case PlyType::UInt32: { std::uint32_t v; std::memcpy( &v, bytes, 4 ); value = v; break; }
+			case PlyType::Float32: { float v; std::memcpy( &v, bytes, 4 ); value = v; break; }
+			case PlyType::Float64: { std::memcpy( &value, bytes, 8 ); break; }
+			default: return false;
+			}
+			return true;
+		}
+
+	private:
+		const char* p_;
+		const char* end_;
+		int format_; // 0 - ascii, 1 - little endian, 2 - big endian
+	};
+
+	bool loadPly( const char* name, const MappedFile& file, std::vector<Vector3>& vertices, std::vector<std::uint32_t>& indices )
+	{
+		const char* cur = file.data();
+		const char* end = cur + file.size();
+		std::vector<PlyElement> elements;
+		int format = -1;
+		int line = 0;
+
+		// Заголовок
+		while ( true )
+		{
+			if ( cur >= end )
+				return fail( name, line, "unexpected end of header" );
+			const char* lineEnd = static_cast<const char*>( std::memchr( cur, '\n', end - cur ) );
+			if ( !lineEnd )
+				lineEnd = end;
+			++line;
+
+			std::vector<std::string> words;
+			const char* p = cur;
+			while ( ( p = skipSpaces( p, lineEnd ) ) < lineEnd )
+			{
+				const char* w = p;
+				while ( p < lineEnd && !isSpace( *p ) )
+					++p;
+				words.emplace_back( w, p );
+			}
+			cur = lineEnd < end ? lineEnd + 1 : end;
+
+			if ( words.empty() )
+				continue;
+			if ( line == 1 && words[0] != "ply" )
+				return fail( name, line, "not a PLY file" );
+			if ( words[0] == "end_header" )
+				break;
+			if ( words[0] == "format" && words.size() >= 2 )
+			{
+				if ( words[1] == "ascii" ) format = 0;
+				else if ( words[1] == "binary_little_endian" ) format = 1;
+				else if ( words[1] == "binary_big_endian" ) format = 2;
+				else return fail( name, line, "unknown PLY format" );
+			}
+			else if ( words[0] == "element" && words.size() >= 3 )
+			{
+				size_t count = 0;
+				const auto res = std::from_chars( words[2].data(), words[2].data() + words[2].size(), count );
+				if ( res.ec != std::errc() )
+					return fail( name, line, "bad element count" );
+				elements.push_back( PlyElement{ words[1], count, {} } );
+			}
+			else if ( words[0] == "property" && !elements.empty() )
+			{
+				if ( words.size() >= 5 && words[1] == "list" )
+					elements.back().properties.push_back( PlyProperty{ words[4], plyType( words[3] ), plyType( words[2] ) } );
+				else if ( words.size() >= 3 )
+					elements.back().properties.push_back( PlyProperty{ words[2], plyType( words[1] ), PlyType::Unknown } );
+			}
+		}
+		if ( format < 0 )
+			return fail( name, line, "missing PLY format" );
+		for ( const auto& e : elements )
+		{
+			if ( e.name != "vertex" )
+				continue;
+			for ( const char* axis : { "x", "y", "z" } )
+			{
+				const bool found = std::any_of( e.properties.begin(), e.properties.end(),
+					[axis]( const PlyProperty& prop ) { return prop.countType == PlyType::Unknown && prop.name == axis; } );
+				if ( !found )
+					return fail( name, line, "vertex element without x, y or z" );
+			}
+		}
+
+		// Индексы проверяются до приведения к uint32: отрицательное, дробное или NaN значение дало бы UB.
+		// Грань может идти в файле раньше вершин, поэтому граница - число вершин из заголовка.
+		double vertexLimit = double( vertices.size() );
+		for ( const auto& e : elements )
+		{
+			if ( e.name == "vertex" )
+				vertexLimit += double( e.count );
+		}
+		vertexLimit = std::min( vertexLimit, double( std::numeric_limits<std::uint32_t>::max() ) + 1.0 );
+
+		PlyReader reader( cur, end, format );
+		std::vector<std::uint32_t> polygon;
+		for ( const auto& e : elements )
+		{
+			// Счетчик из заголовка не проверен, резерв - не больше, чем поместится в файле
+			const size_t reserve = std::min( e.count, reader.remaining() );
+			if ( e.name == "vertex" )
+				vertices.reserve( vertices.size() + reserve );
+			else if ( e.name == "face" )
+				indices.reserve( indices.size() + reserve * 3 );
+
+			for ( size_t i = 0; i < e.count; ++i )
+			{
+				Vector3 v( 0.0f, 0.0f, 0.0f );
+				polygon.clear();
+				for ( const auto& prop : e.properties )
+				{
+					double value = 0.0;
+					if ( prop.countType != PlyType::Unknown )
+					{
+						double count = 0.0;
+						if ( !reader.read( prop.countType, count ) )
+							return fail( name, line, "truncated PLY data" );
+						if ( !( count >= 0.0 ) || count != std::floor( count ) || count > double( reader.remaining() ) )
+							return fail( name, line, "bad PLY list length" );
+						for ( size_t k = 0; k < size_t( count ); ++k )
+						{
+							if ( !reader.read( prop.type, value ) )
+								return fail( name, line, "truncated PLY data" );
+							if ( e.name == "face" && ( prop.name == "vertex_indices" || prop.name == "vertex_index" ) )
+							{
+								if ( !( value >= 0.0 && value < vertexLimit ) || value != std::floor( value ) )
+									return fail( name, line, "face index out of range" );
+								polygon.push_back( (std::uint32_t)value );
+							}
+						}
+						continue;
+					}
+
+					if ( !reader.read( prop.type, value ) )
+						return fail( name, line, "truncated PLY data" );
+					if ( e.name == "vertex" )
+					{
+						if ( prop.name == "x" ) v[0] = (float)value;
+						else if ( prop.name == "y" ) v[1] = (float)value;
+						else if ( prop.name == "z" ) v[2] = (float)value;
+					}
+				}
+
+				if ( e.name == "vertex" )
+					vertices.push_back( v );
+				else if ( e.name == "face" && polygon.size() >= 3 )
+					addPolygon( polygon, indices );
+			}
+		}
+
+		for ( const std::uint32_t index : indices )
+		{
+			if ( index >= vertices.size() )
+				return fail( name, line, "face index out of range" );
+		}
+		return true;
+	}
+}
+
+bool loadMeshFile( const char* name, std::vector<Vector3>& vertices, std::vector<std::uint32_t>& indices )
+{
+	MappedFile file;
+	if ( !file.open( name ) )
+	{
+		std::cerr << "Error: could not open mesh " << name << std::endl;
+		return false;
+	}
+
+	vertices.clear();
+	indices.clear();
+	if ( hasExtension( name, ".obj" ) )
+		return loadObj( name, file, vertices, indices );
+	if ( hasExtension( name, ".ply" ) )
+		return loadPly( name, file, vertices, indices );
+
+	std::cerr << "Error: unsupported mesh format " << name << std::endl;
+	return false;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "vector.h"
+
+#include <cstdint>
+#include <vector>
+
+// Загрузка треугольного меша из OBJ или PLY (ascii и binary) по расширению файла.
+// Многоугольники разбиваются веером, индексы относительно vertices.
+bool loadMeshFile( const char* name, std::vector<Vector3>& vertices, std::vector<std::uint32_t>& indices );
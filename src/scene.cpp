@@ -1,26 +1,166 @@
 #include "scene.h"
 
-#include <string>
-#include <sstream>
+#include "mapped_file.h"
+#include "mesh_import.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
 #include <iostream>
-#include <ostream>
-#include <iosfwd>
-#include <fstream>
+#include <limits>
+#include <string>
+#include <unordered_map>
 
 namespace {
-	std::stringstream getNextDataLine( std::ifstream& file )
+	// Разбор текста прямо из отображенного в память файла, без копий строк
+	class TextReader
 	{
-		std::string line;
-		while ( std::getline( file, line ) ) {
-			size_t firstChar = line.find_first_not_of( " \t\r\n" );
+	public:
+		TextReader( const char* begin, const char* end, const std::string& filename )
+			: cur_( begin ), end_( end ), filename_( filename )
+		{
+			// UTF-8 BOM
+			if ( end_ - cur_ >= 3 && cur_[0] == '\xEF' && cur_[1] == '\xBB' && cur_[2] == '\xBF' )
+				cur_ += 3;
+		}
 
-			if ( firstChar == std::string::npos || line[firstChar] == '#' ) {
-				continue;
+		// Переходит к следующей строке с данными, пропуская пустые строки и комментарии.
+		// Если required == false, конец файла не считается ошибкой.
+		bool nextDataLine( bool required = true )
+		{
+			while ( cur_ < end_ )
+			{
+				const char* lineEnd = cur_;
+				while ( lineEnd < end_ && *lineEnd != '\n' )
+					++lineEnd;
+				++lineNumber_;
+
+				const char* p = cur_;
+				cur_ = lineEnd < end_ ? lineEnd + 1 : end_;
+
+				while ( p < lineEnd && isSpace( *p ) )
+					++p;
+				if ( p == lineEnd || *p == '#' )
+					continue;
+
+				pos_ = p;
+				lineEnd_ = lineEnd;
+				return true;
 			}
-			return std::stringstream( line );
+			return required ? error( "unexpected end of file" ) : false;
 		}
-		return std::stringstream( "" );
-	}
+
+		bool read( float& value )
+		{
+			if ( !skipSpaces() )
+				return error( "missing value" );
+			const auto res = std::from_chars( pos_, lineEnd_, value );
+			if ( res.ec != std::errc() )
+				return error( "expected a number" );
+			pos_ = res.ptr;
+			return true;
+		}
+
+		bool read( int& value )
+		{
+			if ( !skipSpaces() )
+				return error( "missing value" );
+			const auto res = std::from_chars( pos_, lineEnd_, value );
+			if ( res.ec != std::errc() )
+				return error( "expected an integer" );
+			pos_ = res.ptr;
+			// Индексы материалов в старых файлах бывают записаны как "1.0"
+			if ( pos_ < lineEnd_ && *pos_ == '.' )
+			{
+				++pos_;
+				while ( pos_ < lineEnd_ && *pos_ == '0' )
+					++pos_;
+				if ( pos_ < lineEnd_ && *pos_ >= '1' && *pos_ <= '9' )
+					return error( "expected an integer" );
+			}
+			return true;
+		}
+
+		// Слово до пробела
+		bool read( std::string& value )
+		{
+			if ( !skipSpaces() )
+				return error( "missing value" );
+			const char* begin = pos_;
+			while ( pos_ < lineEnd_ && !isSpace( *pos_ ) )
+				++pos_;
+			value.assign( begin, pos_ );
+			return true;
+		}
+
+		bool read( Vector3& v )
+		{
+			return read( v[0] ) && read( v[1] ) && read( v[2] );
+		}
+
+		// Читает строку, в которой только одно целое число
+		bool readCount( int& count )
+		{
+			return nextDataLine() && read( count ) && checkCount( count );
+		}
+
+		// Каждый элемент занимает хотя бы строку, поэтому число больше оставшихся байт
+		// заведомо ложно: не даем ему дойти до resize
+		bool checkCount( int count )
+		{
+			if ( count < 0 )
+				return error( "negative count" );
+			if ( size_t( count ) > size_t( end_ - cur_ ) )
+				return error( "count exceeds file size" );
+			return true;
+		}
+
+		// Текущая строка начинается со слова word. Ошибок не печатает.
+		bool isKeyword( const char* word ) const
+		{
+			const size_t n = std::strlen( word );
+			return size_t( lineEnd_ - pos_ ) >= n && std::memcmp( pos_, word, n ) == 0 &&
+				( pos_ + n == lineEnd_ || isSpace( pos_[n] ) );
+		}
+
+		// Текущая строка - одно неотрицательное целое. Ошибок не печатает.
+		bool isCountLine() const
+		{
+			int count = 0;
+			const auto res = std::from_chars( pos_, lineEnd_, count );
+			if ( res.ec != std::errc() || count < 0 )
+				return false;
+			const char* p = res.ptr;
+			while ( p < lineEnd_ && isSpace( *p ) )
+				++p;
+			return p == lineEnd_;
+		}
+
+		bool error( const char* message )
+		{
+			std::cerr << filename_ << ":" << lineNumber_ << ": error: " << message << std::endl;
+			return false;
+		}
+
+	private:
+		static bool isSpace( char c ) { return c == ' ' || c == '\t' || c == '\r'; }
+
+		bool skipSpaces()
+		{
+			while ( pos_ < lineEnd_ && isSpace( *pos_ ) )
+				++pos_;
+			return pos_ < lineEnd_;
+		}
+
+	private:
+		const char* cur_;
+		const char* end_;
+		const char* pos_ = nullptr;
+		const char* lineEnd_ = nullptr;
+		int lineNumber_ = 0;
+		const std::string& filename_;
+	};
 }
 
 
@@ -29,109 +169,410 @@ Scene::Scene()
 	
 }
 
-bool Scene::load( const char* name )
+void Scene::clear()
 {
-	parse( name );
-	return true;
+	materials_ = {};
+	spheres_ = {};
+	planes_ = {};
+	meshes_ = {};
+	vertices_ = {};
+	indices_ = {};
+	faceMaterials_ = {};
+	instances_ = {};
+	accel_ = {};
+	worldTriangles_ = 0;
+	sampler_.clear();
+	meshFiles_.clear();
+	materialStorage_.clear();
+	sphereStorage_.clear();
+	planeStorage_.clear();
+	meshStorage_.clear();
+	vertexStorage_.clear();
+	indexStorage_.clear();
+	faceMaterialStorage_.clear();
+	instanceStorage_.clear();
+	file_.close();
+	buildSoa();
 }
 
-void Scene::parse( const std::string& filename ) {
-	std::ifstream file( filename );
-	if ( !file.is_open() ) {
-		std::cerr << ":     " << filename << std::endl;
-		return;
+void Scene::updateViews()
+{
+	materials_ = materialStorage_;
+	spheres_ = sphereStorage_;
+	planes_ = planeStorage_;
+	meshes_ = meshStorage_;
+	vertices_ = vertexStorage_;
+	indices_ = indexStorage_;
+	faceMaterials_ = faceMaterialStorage_;
+	instances_ = instanceStorage_;
+	updateTriangleCount();
+	buildSoa();
+}
+
+void Scene::updateTriangleCount()
+{
+	// Меши экземпляров лежат последними, мир кончается на первом из них
+	worldTriangles_ = indices_.size() / 3;
+	for ( const Instance& inst : instances_ )
+		worldTriangles_ = std::min( worldTriangles_, size_t( meshes_[inst.mesh].firstTriangle ) );
+}
+
+void Scene::buildSoa()
+{
+	const std::uint32_t sphereCount = std::uint32_t( ( spheres_.size() + SCENE_SOA_WIDTH - 1 ) / SCENE_SOA_WIDTH * SCENE_SOA_WIDTH );
+	sphereSoaStorage_.assign( size_t( sphereCount ) * 4, 0.0f );
+	sphereSoa_.count = sphereCount;
+	sphereSoa_.x = sphereSoaStorage_.data();
+	sphereSoa_.y = sphereSoa_.x + sphereCount;
+	sphereSoa_.z = sphereSoa_.y + sphereCount;
+	sphereSoa_.radius = sphereSoa_.z + sphereCount;
+	float* sphere = sphereSoaStorage_.data();
+	for ( std::uint32_t i = 0; i < sphereCount; ++i )
+	{
+		if ( i < spheres_.size() )
+		{
+			sphere[i] = spheres_[i].pos.x();
+			sphere[sphereCount + i] = spheres_[i].pos.y();
+			sphere[sphereCount * 2 + i] = spheres_[i].pos.z();
+			sphere[sphereCount * 3 + i] = spheres_[i].radius;
+		}
+		else
+		{
+			sphere[sphereCount * 3 + i] = std::numeric_limits<float>::quiet_NaN();
+		}
+	}
+
+	const std::uint32_t planeCount = std::uint32_t( ( planes_.size() + SCENE_SOA_WIDTH - 1 ) / SCENE_SOA_WIDTH * SCENE_SOA_WIDTH );
+	planeSoaStorage_.assign( size_t( planeCount ) * 4, 0.0f );
+	planeSoa_.count = planeCount;
+	planeSoa_.nx = planeSoaStorage_.data();
+	planeSoa_.ny = planeSoa_.nx + planeCount;
+	planeSoa_.nz = planeSoa_.ny + planeCount;
+	planeSoa_.dist = planeSoa_.nz + planeCount;
+	float* plane = planeSoaStorage_.data();
+	for ( std::uint32_t i = 0; i < std::uint32_t( planes_.size() ); ++i )
+	{
+		plane[i] = planes_[i].normal.x();
+		plane[planeCount + i] = planes_[i].normal.y();
+		plane[planeCount * 2 + i] = planes_[i].normal.z();
+		plane[planeCount * 3 + i] = planes_[i].dist;
+	}
+}
+
+Triangle Scene::triangle( size_t i ) const
+{
+	const std::uint32_t* idx = triangleIndices( i );
+	return Triangle{ vertices_[idx[0]], vertices_[idx[1]], vertices_[idx[2]], triangleMaterial( i ) };
+}
+
+int Scene::triangleMeshMaterial( size_t i ) const
+{
+	// Меши идут по возрастанию firstTriangle
+	const auto it = std::upper_bound( meshes_.begin(), meshes_.end(), i,
+		[]( size_t index, const Mesh& m ) { return index < m.firstTriangle; } );
+	return it == meshes_.begin() ? 0 : ( it - 1 )->matIndex;
+}
+
+size_t Scene::geometryBytes() const
+{
+	return vertices_.size() * sizeof( Vector3 ) + indices_.size() * sizeof( std::uint32_t ) + faceMaterials_.size() * sizeof( int ) +
+		meshes_.size() * sizeof( Mesh ) + spheres_.size() * sizeof( Sphere ) + planes_.size() * sizeof( Plane ) +
+		instances_.size() * sizeof( Instance ) + ( sphereSoaStorage_.size() + planeSoaStorage_.size() ) * sizeof( float );
+}
+
+size_t Scene::instancedTriangleCount() const
+{
+	size_t count = 0;
+	for ( const Instance& inst : instances_ )
+		count += meshes_[inst.mesh].triangleCount;
+	return count;
+}
+
+void Scene::addMesh( const std::vector<Vector3>& vertices, const std::vector<std::uint32_t>& indices, int matIndex, const int* faceMaterials )
+{
+	const std::uint32_t baseVertex = (std::uint32_t)vertexStorage_.size();
+	const std::uint32_t firstTriangle = (std::uint32_t)( indexStorage_.size() / 3 );
+	const std::uint32_t count = (std::uint32_t)( indices.size() / 3 );
+
+	vertexStorage_.insert( vertexStorage_.end(), vertices.begin(), vertices.end() );
+	indexStorage_.reserve( indexStorage_.size() + count * 3 );
+	for ( size_t i = 0; i < size_t( count ) * 3; ++i )
+		indexStorage_.push_back( baseVertex + indices[i] );
+
+	// Первый меш с материалами на треугольник: заполняем массив и для уже добавленных
+	if ( faceMaterials && faceMaterialStorage_.empty() )
+	{
+		faceMaterialStorage_.reserve( firstTriangle + count );
+		for ( const auto& m : meshStorage_ )
+			faceMaterialStorage_.insert( faceMaterialStorage_.end(), m.triangleCount, m.matIndex );
 	}
-	// 1.    (width, height, samples)
-	std::stringstream ss = getNextDataLine( file );
-	if ( ss.fail() )
+	if ( faceMaterials )
+		faceMaterialStorage_.insert( faceMaterialStorage_.end(), faceMaterials, faceMaterials + count );
+	else if ( !faceMaterialStorage_.empty() )
+		faceMaterialStorage_.insert( faceMaterialStorage_.end(), count, matIndex );
+
+	meshStorage_.push_back( Mesh{ firstTriangle, count, faceMaterials ? -1 : matIndex } );
+}
+
+void Scene::addTriangles( const std::vector<Triangle>& triangles )
+{
+	if ( triangles.empty() )
 		return;
-	ss >> version_;
-
-	ss = getNextDataLine( file );
-
-	ss >> width_ >> height_ >> samples_;
-	// Camera 
-	ss = getNextDataLine( file );
-	float px, py, pz, tx, ty, tz, ux, uy, uz, fov;
-	ss >> px >> py >> pz >> tx >> ty >> tz >> ux >> uy >> uz >> fov;
-	camera_.pos = Vector3( px, py, pz );
-	camera_.target = Vector3( tx, ty, tz );
-	camera_.up = Vector3( ux, uy, uz );
-	camera_.fov = fov;
-
-	// 2. Enviroment 
-	ss = getNextDataLine( file );
-	float r, g, b;
-	ss >> r >> g >> b;
-	enviroment_ = Vector3( r, g, b );
-
-	// 3. Matterials 
-	ss = getNextDataLine( file );
-	int numMat;
-	ss >> numMat;
-
-	for ( int i = 0; i < numMat; ++i ) {
-		ss = getNextDataLine( file );
-		
-		float r1, g1, b1, r2, g2, b2;
-		int type;
-		ss >> r1 >> g1 >> b1 >> r2 >> g2 >> b2 >> type;
-		Material mat;
-		mat.albedo = Vector3( r1, g1, b1 );
-		mat.emmision = Vector3( r2, g2, b2 );
-		mat.type = type;
-		materials_.push_back( mat );
-	}
-
-	// 4.  
-	ss = getNextDataLine( file );
-	int numSpheres;
-	ss >> numSpheres;
 
-	for ( int i = 0; i < numSpheres; ++i ) {
-		ss = getNextDataLine( file );
-		Sphere sphere;
-		float x, y, z, rad, matIndex;
-		ss >> x >> y >> z >> rad >> matIndex;
-		sphere.pos = Vector3( x, y, z );
-		sphere.matIndex = (int)matIndex;
-		sphere.radius = rad;
+	// Склеиваем вершины с одинаковыми координатами
+	struct Key
+	{
+		std::uint32_t v[3];
+		bool operator==( const Key& o ) const { return v[0] == o.v[0] && v[1] == o.v[1] && v[2] == o.v[2]; }
+	};
+	struct KeyHash
+	{
+		size_t operator()( const Key& k ) const
+		{
+			std::uint64_t h = k.v[0] * 0x9E3779B1ull;
+			h = ( h ^ k.v[1] ) * 0x85EBCA77ull;
+			h = ( h ^ k.v[2] ) * 0xC2B2AE3Dull;
+			return size_t( h ^ ( h >> 29 ) );
+		}
+	};
+	std::unordered_map<Key, std::uint32_t, KeyHash> lookup;
+	lookup.reserve( triangles.size() * 2 );
+
+	std::vector<Vector3> vertices;
+	std::vector<std::uint32_t> indices;
+	indices.reserve( triangles.size() * 3 );
+	auto addVertex = [&]( const Vector3& p ) {
+		Key key;
+		std::memcpy( key.v, p.d, sizeof( key.v ) );
+		const auto it = lookup.emplace( key, (std::uint32_t)vertices.size() );
+		if ( it.second )
+			vertices.push_back( p );
+		indices.push_back( it.first->second );
+	};
 
-		spheres_.push_back( sphere );
+	bool sameMaterial = true;
+	std::vector<int> materials( triangles.size() );
+	for ( size_t i = 0; i < triangles.size(); ++i )
+	{
+		const Triangle& t = triangles[i];
+		addVertex( t.a );
+		addVertex( t.b );
+		addVertex( t.c );
+		materials[i] = t.matIndex;
+		sameMaterial = sameMaterial && t.matIndex == triangles[0].matIndex;
 	}
 
-	// 3.  
-	ss = getNextDataLine( file );
-	int numPlanes;
-	ss >> numPlanes;
+	addMesh( vertices, indices, triangles[0].matIndex, sameMaterial ? nullptr : materials.data() );
+}
+
+bool Scene::load( const char* name )
+{
+	clear();
+	if ( !file_.open( name ) ) {
+		std::cerr << "Error: could not open file " << name << std::endl;
+		return false;
+	}
+
+	if ( isBinary( file_.data(), file_.size() ) )
+		return loadBinary( name );
+
+	sourceHash_ = hashBytes( file_.data(), file_.size() );
+	bool ok = parse( name );
+	file_.close();
+	// Меши уже прочитаны, но кеш должен устареть и от их изменения
+	for ( size_t i = 0; ok && i < meshFiles_.size(); ++i )
+	{
+		std::uint64_t meshHash = 0;
+		ok = hashFile( meshPath( name, meshFiles_[i] ).c_str(), meshHash );
+		sourceHash_ = combineHash( sourceHash_, meshHash );
+	}
+	updateViews();
+	return ok;
+}
+
+std::string Scene::meshPath( const std::string& sceneName, const std::string& path )
+{
+	const bool absolute = path[0] == '/' || path[0] == '\\' || ( path.size() > 1 && path[1] == ':' );
+	const size_t slash = sceneName.find_last_of( "/\\" );
+	if ( absolute || slash == std::string::npos )
+		return path;
+	return sceneName.substr( 0, slash + 1 ) + path;
+}
+
+bool Scene::parse( const std::string& filename ) {
+	TextReader reader( file_.data(), file_.data() + file_.size(), filename );
+
+	// 1. Версия и настройки кадра (width, height, samples)
+	if ( !reader.nextDataLine() || !reader.read( version_ ) )
+		return false;
+	if ( version_ < 2 || version_ > 5 )
+		return reader.error( "unsupported scene version, expected 2, 3, 4 or 5" );
+
+	if ( !reader.nextDataLine() || !reader.read( width_ ) || !reader.read( height_ ) || !reader.read( samples_ ) )
+		return false;
+
+	// Камера появилась в 4 версии, в 2 и 3 - камера в нуле, смотрит по +Z, вьюпорт высотой 1 на расстоянии 1
+	if ( version_ >= 4 )
+	{
+		if ( !reader.nextDataLine() || !reader.read( camera_.pos ) || !reader.read( camera_.target ) ||
+			!reader.read( camera_.up ) || !reader.read( camera_.fov ) )
+			return false;
+	}
+	else
+	{
+		camera_.pos = Vector3( 0.0f, 0.0f, 0.0f );
+		camera_.target = Vector3( 0.0f, 0.0f, 1.0f );
+		camera_.up = Vector3( 0.0f, 1.0f, 0.0f );
+		camera_.fov = 2.0f * std::atan( 0.5f ) * 180.0f / 3.14159265f;
+	}
+
+	// 2. Enviroment и 3. Materials. В версии 2 их нет: у примитивов сразу albedo, фон белый
+	int numMat = 0;
+	if ( version_ >= 3 )
+	{
+		if ( !reader.nextDataLine() || !reader.read( enviroment_ ) )
+			return false;
+
+		if ( !reader.readCount( numMat ) )
+			return false;
+		materialStorage_.resize( numMat );
+		for ( auto& mat : materialStorage_ ) {
+			if ( !reader.nextDataLine() || !reader.read( mat.albedo ) || !reader.read( mat.emmision ) || !reader.read( mat.type ) )
+				return false;
+		}
+	}
+	else
+	{
+		enviroment_ = Vector3( 1.0f, 1.0f, 1.0f );
+	}
+
+	auto readMatIndex = [&]( int& matIndex ) {
+		if ( version_ == 2 )
+		{
+			Material mat;
+			if ( !reader.read( mat.albedo ) )
+				return false;
+			mat.type = 0;
+			matIndex = (int)materialStorage_.size();
+			materialStorage_.push_back( mat );
+			return true;
+		}
+		if ( !reader.read( matIndex ) )
+			return false;
+		if ( matIndex < 0 || matIndex >= numMat )
+			return reader.error( "material index out of range" );
+		return true;
+	};
 
-	for ( int i = 0; i < numPlanes; ++i ) {
-		ss = getNextDataLine( file );
-		Plane p;
-		float x, y, z, dist, matIndex;
-		ss >> x >> y >> z >> dist >> matIndex;
-		p.normal = Vector3( x, y, z );
-		p.dist = dist;
-		p.matIndex = (int)matIndex;
-		planes_.push_back( p );
+	// 4. Сферы
+	int numSpheres;
+	if ( !reader.readCount( numSpheres ) )
+		return false;
+	sphereStorage_.resize( numSpheres );
+	for ( auto& sphere : sphereStorage_ ) {
+		if ( !reader.nextDataLine() || !reader.read( sphere.pos ) || !reader.read( sphere.radius ) || !readMatIndex( sphere.matIndex ) )
+			return false;
+	}
+
+	// 5. Плоскости
+	int numPlanes;
+	if ( !reader.readCount( numPlanes ) )
+		return false;
+	planeStorage_.resize( numPlanes );
+	for ( auto& p : planeStorage_ ) {
+		if ( !reader.nextDataLine() || !reader.read( p.normal ) || !reader.read( p.dist ) || !readMatIndex( p.matIndex ) )
+			return false;
 	}
 
-	// 4.  
-	ss = getNextDataLine( file );
+	// 6. Треугольники
 	int numTriangles;
-	ss >> numTriangles;
+	if ( !reader.readCount( numTriangles ) )
+		return false;
+	std::vector<Triangle> triangles( numTriangles );
+	for ( auto& t : triangles ) {
+		if ( !reader.nextDataLine() || !reader.read( t.a ) || !reader.read( t.b ) || !reader.read( t.c ) || !readMatIndex( t.matIndex ) )
+			return false;
+	}
+	addTriangles( triangles );
 
-	for ( int i = 0; i < numTriangles; ++i ) {
-		ss = getNextDataLine( file );
+	// 7. Необязательно: строка "sampler NAME" и меши из OBJ/PLY (путь относительно файла сцены и индекс материала).
+	// В старых файлах после объявленного числа треугольников бывают лишние строки,
+	// их, как и раньше, пропускаем.
+	int numMeshes = 0;
+	bool hasLine = version_ >= 4 && reader.nextDataLine( false );
+	if ( hasLine && reader.isKeyword( "sampler" ) )
+	{
+		std::string keyword;
+		if ( !reader.read( keyword ) || !reader.read( sampler_ ) )
+			return false;
+		hasLine = reader.nextDataLine( false );
+	}
+	if ( hasLine && reader.isCountLine() )
+	{
+		if ( !reader.read( numMeshes ) || !reader.checkCount( numMeshes ) )
+			return false;
+	}
+	struct MeshFile
+	{
+		std::vector<Vector3> vertices;
+		std::vector<std::uint32_t> indices;
+		int matIndex;
+	};
+	std::vector<MeshFile> meshFiles( numMeshes );
+	for ( auto& mesh : meshFiles ) {
+		std::string path;
+		if ( !reader.nextDataLine() || !reader.read( path ) || !readMatIndex( mesh.matIndex ) )
+			return false;
+		if ( !loadMeshFile( meshPath( filename, path ).c_str(), mesh.vertices, mesh.indices ) )
+			return reader.error( "could not import mesh" );
+		meshFiles_.push_back( path );
+	}
 
-		float x1, y1, z1, x2, y2, z2, x3, y3, z3, matIndex;
-		ss >> x1 >> y1 >> z1 >> x2 >> y2 >> z2 >> x3 >> y3 >> z3  >> matIndex;
+	// 8. Версия 5, необязательно: экземпляры мешей из списка выше (тогда число мешей обязательно, хотя бы 0).
+	// Номер меша, матрица 3x4 по строкам и индекс материала, -1 - материал меша.
+	int numInstances = 0;
+	if ( version_ >= 5 && reader.nextDataLine( false ) )
+	{
+		if ( !reader.read( numInstances ) || !reader.checkCount( numInstances ) )
+			return false;
+	}
+	std::vector<char> instanced( numMeshes, 0 );
+	instanceStorage_.resize( numInstances );
+	for ( auto& inst : instanceStorage_ ) {
+		int mesh;
+		if ( !reader.nextDataLine() || !reader.read( mesh ) )
+			return false;
+		if ( mesh < 0 || mesh >= numMeshes )
+			return reader.error( "mesh index out of range" );
+		for ( float& m : inst.transform ) {
+			if ( !reader.read( m ) )
+				return false;
+		}
+		if ( !reader.read( inst.matIndex ) )
+			return false;
+		if ( inst.matIndex < -1 || inst.matIndex >= numMat )
+			return reader.error( "material index out of range" );
+		// Лучи переводятся в систему меша обратной матрицей
+		const float* t = inst.transform;
+		const float det = t[0] * ( t[5] * t[10] - t[6] * t[9] ) - t[1] * ( t[4] * t[10] - t[6] * t[8] ) + t[2] * ( t[4] * t[9] - t[5] * t[8] );
+		if ( det == 0.0f || !std::isfinite( det ) )
+			return reader.error( "degenerate instance transform" );
+		inst.mesh = std::uint32_t( mesh );
+		instanced[mesh] = 1;
+	}
 
-		Triangle t;
-		t.a = Vector3( x1, y1, z1  );
-		t.b = Vector3( x2, y2, z2  );
-		t.c = Vector3( x3, y3, z3  );
-		t.matIndex = (int)matIndex;
-		triangles_.push_back( t );
+	// Сначала меши мира, за ними меши экземпляров: треугольники мира остаются в начале буферов
+	std::vector<std::uint32_t> meshIndex( numMeshes );
+	for ( int pass = 0; pass < 2; ++pass ) {
+		for ( int i = 0; i < numMeshes; ++i ) {
+			if ( instanced[i] != pass )
+				continue;
+			meshIndex[i] = std::uint32_t( meshStorage_.size() );
+			addMesh( meshFiles[i].vertices, meshFiles[i].indices, meshFiles[i].matIndex );
+		}
 	}
-}
\ No newline at end of file
+	for ( auto& inst : instanceStorage_ )
+		inst.mesh = meshIndex[inst.mesh];
+
+	return true;
+}
@@ -1,7 +1,11 @@
 #pragma once 
 
+#include "array_view.h"
+#include "mapped_file.h"
 #include "vector.h"
 
+#include <cstdint>
+#include <string>
 #include <vector>
 
 struct Sphere
@@ -18,6 +22,30 @@ struct Plane
 	int matIndex;
 };
 
+// Ширина SoA-массивов сфер и плоскостей: 16 float - регистр AVX-512, два AVX или четыре SSE
+const std::uint32_t SCENE_SOA_WIDTH = 16;
+
+// Сферы по компонентам (SoA) для SIMD-ядер полного перебора. count кратен SCENE_SOA_WIDTH,
+// у добавленных в конец сфер радиус NaN: их не пересекает ни один луч.
+struct SphereSoa
+{
+	const float* x = nullptr;
+	const float* y = nullptr;
+	const float* z = nullptr;
+	const float* radius = nullptr;
+	std::uint32_t count = 0;
+};
+
+// Плоскости так же, у добавленных нулевая нормаль
+struct PlaneSoa
+{
+	const float* nx = nullptr;
+	const float* ny = nullptr;
+	const float* nz = nullptr;
+	const float* dist = nullptr;
+	std::uint32_t count = 0;
+};
+
 struct Triangle
 {
 	Vector3 a;
@@ -26,6 +54,24 @@ struct Triangle
 	int matIndex;
 };
 
+// Диапазон треугольников в общих буферах вершин и индексов сцены.
+// Индексы абсолютные (в vertices()), материал общий на меш или, если matIndex < 0, на каждый треугольник.
+struct Mesh
+{
+	std::uint32_t firstTriangle;
+	std::uint32_t triangleCount;
+	int matIndex;
+};
+
+// Размещение меша (сцены версии 5): аффинное преобразование из системы меша в мир -
+// матрица 3x4 по строкам, p' = M * (p, 1) - и материал поверх материала меша
+struct Instance
+{
+	float transform[12];
+	std::uint32_t mesh; // номер в Scene::meshes()
+	int matIndex;       // -1 - материал меша
+};
+
 struct Material
 {
 	Vector3 albedo;
@@ -46,26 +92,86 @@ class Scene
 public:
 	Scene();
 
+	Scene( const Scene& ) = delete;
+	Scene& operator=( const Scene& ) = delete;
+
+	// Текстовая сцена или бинарный кеш (определяется по сигнатуре файла)
 	bool load( const char* name );
 
+	// Бинарный кеш: все массивы и, опционально, сериализованная структура ускорения.
+	// sourceHash() записывается в заголовок для проверки устаревания.
+	bool saveBinary( const char* name, const void* accel, size_t accelSize ) const;
+
+	// Хеш исходника: текст сцены name и содержимое файлов мешей, на которые он ссылается
+	// (пути как в тексте, относительные - от папки сцены)
+	static bool hashSource( const char* name, const std::vector<std::string>& meshFiles, std::uint64_t& hash );
+	// Хеш исходника и файлы мешей, записанные в бинарном кеше
+	static bool readBinarySource( const char* name, std::uint64_t& hash, std::vector<std::string>& meshFiles );
+
 	void setSamples( int i ) { samples_ = i; }
 
 	int samples() const { return samples_; }
 	int width() const { return width_; }
 	int height() const { return height_; }
 	Vector3 enviroment() const { return enviroment_; }
+	// Имя сэмплера из необязательной строки "sampler NAME", пусто - не задан
+	const std::string& sampler() const { return sampler_; }
 	Material material( int index ) const { return materials_[index]; }
 
 	const Camera& camera() const { return camera_; }
 
-	const std::vector<Sphere>& spheres() const { return spheres_; }
-	const std::vector<Plane>& planes() const { return planes_; }
-	const std::vector<Triangle>& triangles() const { return triangles_; }
+	ArrayView<Material> materials() const { return materials_; }
+	ArrayView<Sphere> spheres() const { return spheres_; }
+	ArrayView<Plane> planes() const { return planes_; }
+	// Те же сферы и плоскости по компонентам, строятся при загрузке
+	const SphereSoa& sphereSoa() const { return sphereSoa_; }
+	const PlaneSoa& planeSoa() const { return planeSoa_; }
+
+	// Все треугольники сцены хранятся индексированными мешами с общими вершинами
+	ArrayView<Mesh> meshes() const { return meshes_; }
+	ArrayView<Vector3> vertices() const { return vertices_; }
+	ArrayView<std::uint32_t> indices() const { return indices_; }
+	// Экземпляры мешей. Меш, у которого есть экземпляры, сам в мир не попадает: такие меши лежат
+	// в буферах после остальных, и их треугольники не входят в triangleCount()
+	ArrayView<Instance> instances() const { return instances_; }
+
+	// Треугольники мира [0, triangleCount()); triangleIndices, triangleMaterial и triangle
+	// принимают и номера треугольников мешей экземпляров, они идут дальше
+	size_t triangleCount() const { return worldTriangles_; }
+	const std::uint32_t* triangleIndices( size_t i ) const { return &indices_[i * 3]; }
+	int triangleMaterial( size_t i ) const { return faceMaterials_.empty() ? triangleMeshMaterial( i ) : faceMaterials_[i]; }
+	Triangle triangle( size_t i ) const;
+
+	// Память под геометрию (вершины, индексы, материалы треугольников, сферы, плоскости, экземпляры), в байтах
+	size_t geometryBytes() const;
+	// Треугольников во всех экземплярах, как если бы каждый был отдельной копией меша
+	size_t instancedTriangleCount() const;
 
 	size_t count() const { return spheres_.size() + planes_.size(); }
 
+	std::uint64_t sourceHash() const { return sourceHash_; }
+	// Файлы мешей из текста сцены, входят в sourceHash()
+	const std::vector<std::string>& meshFiles() const { return meshFiles_; }
+	// Пусто, если сцена загружена из текста или кеш без структуры ускорения
+	ArrayView<char> accelData() const { return accel_; }
+
 private:
-	void parse( const std::string& filename );	
+	bool parse( const std::string& filename );
+	bool loadBinary( const std::string& filename );
+	void clear();
+	void addTriangles( const std::vector<Triangle>& triangles );
+	void addMesh( const std::vector<Vector3>& vertices, const std::vector<std::uint32_t>& indices, int matIndex, const int* faceMaterials = nullptr );
+	void updateViews();
+	void updateTriangleCount();
+	void buildSoa();
+	int triangleMeshMaterial( size_t i ) const;
+
+	static std::uint64_t hashBytes( const char* data, size_t size );
+	static bool hashFile( const char* name, std::uint64_t& hash );
+	static std::uint64_t combineHash( std::uint64_t hash, std::uint64_t next );
+	// Путь меша из сцены sceneName: относительный - от папки сцены
+	static std::string meshPath( const std::string& sceneName, const std::string& path );
+	static bool isBinary( const char* data, size_t size );
 
 private:
 	int version_;
@@ -74,8 +180,35 @@ private:
 	int height_;
 	Camera camera_;
 	Vector3 enviroment_;
-	std::vector<Material> materials_;
-	std::vector<Sphere> spheres_;
-	std::vector<Plane> planes_;
-	std::vector<Triangle> triangles_;
+	std::string sampler_;
+	std::uint64_t sourceHash_ = 0;
+	std::vector<std::string> meshFiles_;
+
+	// Виды смотрят либо в векторы ниже (текст), либо в file_ (бинарный кеш)
+	ArrayView<Material> materials_;
+	ArrayView<Sphere> spheres_;
+	ArrayView<Plane> planes_;
+	ArrayView<Mesh> meshes_;
+	ArrayView<Vector3> vertices_;
+	ArrayView<std::uint32_t> indices_;
+	ArrayView<int> faceMaterials_; // пусто, если у всех мешей общий материал
+	ArrayView<Instance> instances_;
+	ArrayView<char> accel_;
+	size_t worldTriangles_ = 0;
+
+	std::vector<Material> materialStorage_;
+	std::vector<Sphere> sphereStorage_;
+	std::vector<Plane> planeStorage_;
+	std::vector<Mesh> meshStorage_;
+	std::vector<Vector3> vertexStorage_;
+	std::vector<std::uint32_t> indexStorage_;
+	std::vector<int> faceMaterialStorage_;
+	std::vector<Instance> instanceStorage_;
+	MappedFile file_;
+
+	// x, y, z и радиус (или нормаль и расстояние) подряд, по count чисел каждое
+	std::vector<float> sphereSoaStorage_;
+	std::vector<float> planeSoaStorage_;
+	SphereSoa sphereSoa_;
+	PlaneSoa planeSoa_;
 };
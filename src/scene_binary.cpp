@@ -0,0 +1,315 @@
+#include "scene.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+	const char MAGIC[4] = { 'P', 'B', 'R', 'S' };
+	const std::uint32_t FORMAT_VERSION = 5;
+	const std::uint64_t SECTION_ALIGNMENT = 16;
+	const int STRUCT_COUNT = 6;
+	const std::uint64_t HASH_PRIME = 0x9FB21C651E98DF25ull;
+
+	struct Section
+	{
+		std::uint64_t offset;
+		std::uint64_t count;
+	};
+
+	// Размеры структур пишутся в заголовок: кеш от другой сборки с другой раскладкой не подойдет
+	struct Header
+	{
+		char magic[4];
+		std::uint32_t formatVersion;
+		std::uint64_t sourceHash;
+		std::uint32_t structSizes[STRUCT_COUNT];
+		std::int32_t version;
+		std::int32_t width;
+		std::int32_t height;
+		std::int32_t samples;
+		Camera camera;
+		Vector3 enviroment;
+		char sampler[16];
+		Section materials;
+		Section spheres;
+		Section planes;
+		Section meshes;
+		Section vertices;
+		Section indices;
+		Section faceMaterials;
+		Section instances;
+		Section meshFiles; // пути через '\0'
+		Section accel;
+	};
+
+	void fillStructSizes( std::uint32_t* sizes )
+	{
+		sizes[0] = sizeof( Material );
+		sizes[1] = sizeof( Sphere );
+		sizes[2] = sizeof( Plane );
+		sizes[3] = sizeof( Mesh );
+		sizes[4] = sizeof( Instance );
+		sizes[5] = sizeof( Header );
+	}
+
+	std::uint64_t align( std::uint64_t offset )
+	{
+		return ( offset + SECTION_ALIGNMENT - 1 ) & ~( SECTION_ALIGNMENT - 1 );
+	}
+
+	// Пути файлов мешей, каждый с завершающим нулем
+	bool splitPaths( const char* data, size_t size, std::vector<std::string>& paths )
+	{
+		paths.clear();
+		if ( size > 0 && data[size - 1] != '\0' )
+			return false;
+		for ( const char* p = data; p < data + size; p += paths.back().size() + 1 )
+			paths.emplace_back( p );
+		return true;
+	}
+
+	template<typename T>
+	bool sectionView( const MappedFile& file, const Section& s, ArrayView<T>& view )
+	{
+		if ( s.offset % alignof( T ) != 0 || s.offset > file.size() || s.count > ( file.size() - s.offset ) / sizeof( T ) )
+			return false;
+		view = ArrayView<T>( reinterpret_cast<const T*>( file.data() + s.offset ), (size_t)s.count );
+		return true;
+	}
+}
+
+bool Scene::isBinary( const char* data, size_t size )
+{
+	return size >= sizeof( MAGIC ) && std::memcmp( data, MAGIC, sizeof( MAGIC ) ) == 0;
+}
+
+std::uint64_t Scene::hashBytes( const char* data, size_t size )
+{
+	// Пословный мультипликативный хеш, не криптографический, но быстрый на сотнях мегабайт
+	std::uint64_t h = 0xCBF29CE484222325ull ^ size;
+	size_t i = 0;
+	for ( ; i + 8 <= size; i += 8 )
+	{
+		std::uint64_t w;
+		std::memcpy( &w, data + i, 8 );
+		h = ( h ^ w ) * HASH_PRIME;
+		h ^= h >> 29;
+	}
+	for ( ; i < size; ++i )
+		h = ( h ^ (unsigned char)data[i] ) * HASH_PRIME;
+	h ^= h >> 32;
+	return h;
+}
+
+std::uint64_t Scene::combineHash( std::uint64_t hash, std::uint64_t next )
+{
+	hash = ( hash ^ next ) * HASH_PRIME;
+	return hash ^ ( hash >> 29 );
+}
+
+bool Scene::hashFile( const char* name, std::uint64_t& hash )
+{
+	MappedFile file;
+	if ( !file.open( name ) )
+		return false;
+	hash = hashBytes( file.data(), file.size() );
+	return true;
+}
+
+bool Scene::hashSource( const char* name, const std::vector<std::string>& meshFiles, std::uint64_t& hash )
+{
+	if ( !hashFile( name, hash ) )
+		return false;
+	for ( const std::string& path : meshFiles )
+	{
+		std::uint64_t meshHash = 0;
+		if ( !hashFile( meshPath( name, path ).c_str(), meshHash ) )
+			return false;
+		hash = combineHash( hash, meshHash );
+	}
+	return true;
+}
+
+bool Scene::readBinarySource( const char* name, std::uint64_t& hash, std::vector<std::string>& meshFiles )
+{
+	std::ifstream file( name, std::ios::binary );
+	Header header;
+	if ( !file.read( reinterpret_cast<char*>( &header ), sizeof( header ) ) )
+		return false;
+
+	std::uint32_t sizes[STRUCT_COUNT];
+	fillStructSizes( sizes );
+	if ( !isBinary( header.magic, sizeof( header.magic ) ) || header.formatVersion != FORMAT_VERSION ||
+		std::memcmp( sizes, header.structSizes, sizeof( sizes ) ) != 0 )
+		return false;
+
+	// Секция путей маленькая, остальной кеш не читается
+	file.seekg( 0, std::ios::end );
+	const std::uint64_t fileSize = std::uint64_t( file.tellg() );
+	const Section& s = header.meshFiles;
+	if ( s.offset > fileSize || s.count > fileSize - s.offset )
+		return false;
+	std::vector<char> paths( (size_t)s.count );
+	file.seekg( std::streamoff( s.offset ) );
+	if ( !paths.empty() && !file.read( paths.data(), std::streamsize( paths.size() ) ) )
+		return false;
+	if ( !splitPaths( paths.data(), paths.size(), meshFiles ) )
+		return false;
+
+	hash = header.sourceHash;
+	return true;
+}
+
+bool Scene::loadBinary( const std::string& filename )
+{
+	Header header;
+	if ( file_.size() < sizeof( header ) )
+	{
+		std::cerr << filename << ": error: truncated scene cache" << std::endl;
+		return false;
+	}
+	std::memcpy( &header, file_.data(), sizeof( header ) );
+
+	std::uint32_t sizes[STRUCT_COUNT];
+	fillStructSizes( sizes );
+	if ( header.formatVersion != FORMAT_VERSION || std::memcmp( sizes, header.structSizes, sizeof( sizes ) ) != 0 )
+	{
+		std::cerr << filename << ": error: scene cache was written by an incompatible build" << std::endl;
+		return false;
+	}
+
+	version_ = header.version;
+	width_ = header.width;
+	height_ = header.height;
+	samples_ = header.samples;
+	camera_ = header.camera;
+	enviroment_ = header.enviroment;
+	sampler_.assign( header.sampler, std::find( header.sampler, header.sampler + sizeof( header.sampler ), '\0' ) );
+	sourceHash_ = header.sourceHash;
+
+	ArrayView<char> meshFileData;
+	if ( !sectionView( file_, header.materials, materials_ ) || !sectionView( file_, header.spheres, spheres_ ) ||
+		!sectionView( file_, header.planes, planes_ ) || !sectionView( file_, header.meshes, meshes_ ) ||
+		!sectionView( file_, header.vertices, vertices_ ) || !sectionView( file_, header.indices, indices_ ) ||
+		!sectionView( file_, header.faceMaterials, faceMaterials_ ) || !sectionView( file_, header.instances, instances_ ) ||
+		!sectionView( file_, header.meshFiles, meshFileData ) || !sectionView( file_, header.accel, accel_ ) ||
+		!splitPaths( meshFileData.data(), meshFileData.size(), meshFiles_ ) )
+	{
+		std::cerr << filename << ": error: corrupted scene cache" << std::endl;
+		clear();
+		return false;
+	}
+	const bool badInstance = std::any_of( instances_.begin(), instances_.end(),
+		[this]( const Instance& inst ) { return inst.mesh >= meshes_.size(); } );
+	// BLAS экземпляров строятся по диапазонам мешей: они должны идти подряд внутри буфера индексов
+	size_t meshEnd = 0;
+	bool badMesh = false;
+	for ( const Mesh& mesh : meshes_ )
+	{
+		badMesh = badMesh || mesh.firstTriangle < meshEnd || size_t( mesh.firstTriangle ) + mesh.triangleCount > indices_.size() / 3;
+		meshEnd = size_t( mesh.firstTriangle ) + mesh.triangleCount;
+	}
+	// Индексы вершин и материалов читаются без проверок при построении BVH и шейдинге
+	const size_t vertexCount = vertices_.size();
+	const bool badIndex = std::any_of( indices_.begin(), indices_.end(),
+		[vertexCount]( std::uint32_t index ) { return index >= vertexCount; } );
+	const size_t materialCount = materials_.size();
+	auto badMaterial = [materialCount]( int matIndex ) { return matIndex < 0 || size_t( matIndex ) >= materialCount; };
+	// Треугольники вне мешей берут материал 0
+	bool badMaterials = !indices_.empty() && materials_.empty();
+	badMaterials = badMaterials || std::any_of( spheres_.begin(), spheres_.end(), [&]( const Sphere& s ) { return badMaterial( s.matIndex ); } );
+	badMaterials = badMaterials || std::any_of( planes_.begin(), planes_.end(), [&]( const Plane& p ) { return badMaterial( p.matIndex ); } );
+	badMaterials = badMaterials || std::any_of( faceMaterials_.begin(), faceMaterials_.end(), badMaterial );
+	// Отрицательный материал меша означает материал на треугольник, без faceMaterials его негде взять
+	badMaterials = badMaterials || std::any_of( meshes_.begin(), meshes_.end(),
+		[&]( const Mesh& mesh ) { return mesh.matIndex < 0 ? faceMaterials_.empty() : badMaterial( mesh.matIndex ); } );
+	badMaterials = badMaterials || std::any_of( instances_.begin(), instances_.end(),
+		[&]( const Instance& inst ) { return inst.matIndex != -1 && badMaterial( inst.matIndex ); } );
+	if ( indices_.size() % 3 != 0 || ( !faceMaterials_.empty() && faceMaterials_.size() != indices_.size() / 3 ) || badInstance || badMesh ||
+		badIndex || badMaterials )
+	{
+		std::cerr << filename << ": error: corrupted scene cache" << std::endl;
+		clear();
+		return false;
+	}
+	updateTriangleCount();
+	// SoA в кеш не пишется: это копия сфер и плоскостей
+	buildSoa();
+	return true;
+}
+
+bool Scene::saveBinary( const char* name, const void* accel, size_t accelSize ) const
+{
+	Header header;
+	std::memset( static_cast<void*>( &header ), 0, sizeof( header ) );
+	std::memcpy( header.magic, MAGIC, sizeof( MAGIC ) );
+	header.formatVersion = FORMAT_VERSION;
+	header.sourceHash = sourceHash_;
+	fillStructSizes( header.structSizes );
+	header.version = version_;
+	header.width = width_;
+	header.height = height_;
+	header.samples = samples_;
+	header.camera = camera_;
+	header.enviroment = enviroment_;
+	std::memcpy( header.sampler, sampler_.data(), std::min( sampler_.size(), sizeof( header.sampler ) ) );
+
+	struct Chunk
+	{
+		Section* section;
+		const void* data;
+		size_t size;
+		size_t count;
+	};
+	std::string meshFiles;
+	for ( const std::string& path : meshFiles_ )
+		meshFiles.append( path.c_str(), path.size() + 1 );
+
+	Chunk chunks[] = {
+		{ &header.materials, materials_.data(), materials_.size() * sizeof( Material ), materials_.size() },
+		{ &header.spheres, spheres_.data(), spheres_.size() * sizeof( Sphere ), spheres_.size() },
+		{ &header.planes, planes_.data(), planes_.size() * sizeof( Plane ), planes_.size() },
+		{ &header.meshes, meshes_.data(), meshes_.size() * sizeof( Mesh ), meshes_.size() },
+		{ &header.vertices, vertices_.data(), vertices_.size() * sizeof( Vector3 ), vertices_.size() },
+		{ &header.indices, indices_.data(), indices_.size() * sizeof( std::uint32_t ), indices_.size() },
+		{ &header.faceMaterials, faceMaterials_.data(), faceMaterials_.size() * sizeof( int ), faceMaterials_.size() },
+		{ &header.instances, instances_.data(), instances_.size() * sizeof( Instance ), instances_.size() },
+		{ &header.meshFiles, meshFiles.data(), meshFiles.size(), meshFiles.size() },
+		{ &header.accel, accel, accelSize, accelSize },
+	};
+
+	std::uint64_t offset = align( sizeof( header ) );
+	for ( auto& c : chunks )
+	{
+		c.section->offset = offset;
+		c.section->count = c.count;
+		offset = align( offset + c.size );
+	}
+
+	std::ofstream file( name, std::ios::binary | std::ios::trunc );
+	if ( !file.is_open() )
+	{
+		std::cerr << "Error: could not open " << name << " for writing" << std::endl;
+		return false;
+	}
+
+	const char zeros[SECTION_ALIGNMENT] = {};
+	file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+	std::uint64_t written = sizeof( header );
+	for ( const auto& c : chunks )
+	{
+		file.write( zeros, c.section->offset - written );
+		if ( c.size > 0 )
+			file.write( static_cast<const char*>( c.data ), c.size );
+		written = c.section->offset + c.size;
+	}
+
+	if ( !file )
+	{
+		std::cerr << "Error: could not write " << name << std::endl;
+		return false;
+	}
+	return true;
+}